@@ -1,5 +1,6 @@
 #pragma once
 
+#include <map>
 #include <string>
 
 namespace bpftrace {
@@ -11,6 +12,8 @@ int arg_offset(int arg_num);
 int ret_offset();
 int pc_offset();
 std::string name();
+const std::map<int, std::string> &syscalls();
+std::string syscall_name(int nr);
 
 } // namespace arch
 } // namespace bpftrace
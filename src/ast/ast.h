@@ -26,6 +26,8 @@ public:
   bool is_literal = false;
   bool is_variable = false;
   bool is_map = false;
+  bool is_builtin = false;
+  int bound = 0; // Exclusive upper bound on an integer value, or 0 if unknown
 };
 using ExpressionList = std::vector<Expression *>;
 
@@ -47,7 +49,7 @@ public:
 
 class Builtin : public Expression {
 public:
-  explicit Builtin(std::string ident) : ident(ident) { }
+  explicit Builtin(std::string ident) : ident(ident) { is_builtin = true; }
   std::string ident;
 
   void accept(Visitor &v) override;
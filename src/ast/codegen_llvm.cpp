@@ -40,7 +40,7 @@ void CodegenLLVM::visit(Builtin &builtin)
   }
   else if (builtin.ident == "pid" || builtin.ident == "tid")
   {
-    Value *pidtgid = b_.CreateGetPidTgid();
+    Value *pidtgid = getCachedBuiltin("pid_tgid", [&]() { return b_.CreateGetPidTgid(); });
     if (builtin.ident == "pid")
     {
       expr_ = b_.CreateLShr(pidtgid, 32);
@@ -52,7 +52,7 @@ void CodegenLLVM::visit(Builtin &builtin)
   }
   else if (builtin.ident == "uid" || builtin.ident == "gid")
   {
-    Value *uidgid = b_.CreateGetUidGid();
+    Value *uidgid = getCachedBuiltin("uid_gid", [&]() { return b_.CreateGetUidGid(); });
     if (builtin.ident == "uid")
     {
       expr_ = b_.CreateAnd(uidgid, 0xffffffff);
@@ -64,15 +64,63 @@ void CodegenLLVM::visit(Builtin &builtin)
   }
   else if (builtin.ident == "cpu")
   {
-    expr_ = b_.CreateGetCpuId();
+    expr_ = getCachedBuiltin("cpu", [&]() { return b_.CreateGetCpuId(); });
   }
   else if (builtin.ident == "comm")
   {
-    AllocaInst *buf = b_.CreateAllocaBPF(builtin.type, "comm");
-    // initializing memory needed for older kernels:
-    b_.CreateMemSet(buf, b_.getInt8(0), builtin.type.size, 1);
-    b_.CreateGetCurrentComm(buf, builtin.type.size);
-    expr_ = buf;
+    expr_ = getCachedBuiltin("comm", [&]()
+    {
+      AllocaInst *buf = b_.CreateAllocaBPF(builtin.type, "comm");
+      // initializing memory needed for older kernels:
+      b_.CreateMemSet(buf, b_.getInt8(0), builtin.type.size, 1);
+      b_.CreateGetCurrentComm(buf, builtin.type.size);
+      return buf;
+    });
+  }
+  else if (probe_type_ == ProbeType::syscall)
+  {
+    // raw_syscalls tracepoint format: syscall number at offset 8, followed by
+    // either the arguments or the return value
+    int offset;
+    if (builtin.ident == "func")
+      offset = 8;
+    else if (builtin.ident == "retval")
+      offset = 16;
+    else // argX
+    {
+      int arg_num = atoi(builtin.ident.substr(3).c_str());
+      offset = 16 + arg_num * sizeof(uint64_t);
+    }
+
+    Value *src = b_.CreateGEP(ctx_, b_.getInt64(offset));
+    expr_ = b_.CreateLoad(b_.getInt64Ty(),
+        b_.CreatePointerCast(src, b_.getInt64Ty()->getPointerTo()),
+        builtin.ident);
+  }
+  else if (probe_type_ == ProbeType::kfunc || probe_type_ == ProbeType::kretfunc)
+  {
+    // Trampoline programs get the function's arguments as an array of u64s,
+    // so they can be read directly instead of through probe_read
+    if (builtin.ident == "retval")
+      expr_ = b_.CreateGetFuncRet(ctx_);
+    else if (builtin.ident == "func")
+      expr_ = b_.CreateGetFuncId(ctx_, false);
+    else // argX
+    {
+      int arg_num = atoi(builtin.ident.substr(3).c_str());
+      Value *src = b_.CreateGEP(ctx_, b_.getInt64(arg_num * sizeof(uint64_t)));
+      expr_ = b_.CreateLoad(b_.getInt64Ty(),
+          b_.CreatePointerCast(src, b_.getInt64Ty()->getPointerTo()),
+          builtin.ident);
+    }
+  }
+  else if (builtin.ident == "func" &&
+      (probe_type_ == ProbeType::kprobe || probe_type_ == ProbeType::kretprobe))
+  {
+    // Every attachment knows which function it's on, so there's no need to
+    // read and symbolise the IP. Programs attached with a multi-kprobe link
+    // are shared between functions, so read it from the attach cookie.
+    expr_ = b_.CreateGetFuncId(ctx_, bpftrace_.kprobe_multi_);
   }
   else if (!builtin.ident.compare(0, 3, "arg") && builtin.ident.size() == 4 &&
       builtin.ident.at(3) >= '0' && builtin.ident.at(3) <= '9' ||
@@ -136,15 +184,209 @@ void CodegenLLVM::visit(Call &call)
     b_.CreateLifetimeEnd(newval);
     expr_ = nullptr;
   }
+  else if (call.func == "lhist" || call.func == "llhist")
+  {
+    Map &map = *call.map;
+    call.vargs->front()->accept(*this);
+    Value *bucket = getHistBucket(map.type, expr_);
+    AllocaInst *key = getMapKey(map);
+
+    // Count the value in this CPU's bucket array, in place
+    Function *parent = b_.GetInsertBlock()->getParent();
+    BasicBlock *merge_block = BasicBlock::Create(module_->getContext(), call.func + "_merge", parent);
+    Value *buckets = createZeroedMapLookup(map, key, call.func, merge_block);
+    Value *slot = b_.CreateGEP(
+        b_.CreatePointerCast(buckets, b_.getInt64Ty()->getPointerTo()), bucket);
+    b_.CreateStore(b_.CreateAdd(b_.CreateLoad(slot), b_.getInt64(1)), slot);
+    b_.CreateBr(merge_block);
+
+    b_.SetInsertPoint(merge_block);
+    b_.CreateLifetimeEnd(key);
+    expr_ = nullptr;
+  }
+  else if (call.func == "distinct")
+  {
+    Map &map = *call.map;
+    Expression &arg = *call.vargs->front();
+    arg.accept(*this);
+    Value *hash = getHash(arg.type, expr_);
+    if (arg.type.type == Type::string && !arg.is_variable && !isCachedBuiltin(expr_))
+      b_.CreateLifetimeEnd(expr_);
+    AllocaInst *key = getMapKey(map);
+
+    // HyperLogLog: the top bits of the hash pick a register, which keeps the
+    // highest position of the first set bit seen in the rest of the hash
+    int precision = __builtin_ctzll(map.type.size);
+    int rest_bits = 64 - precision;
+    Value *index = b_.CreateLShr(hash, rest_bits);
+    Value *rest = b_.CreateAnd(hash, b_.getInt64((1ULL << rest_bits) - 1));
+    Value *rank = b_.CreateSub(b_.getInt64(rest_bits), getLog2(rest));
+    rank = b_.CreateAdd(rank, b_.CreateZExt(
+        b_.CreateICmpEQ(rest, b_.getInt64(0)), b_.getInt64Ty()));
+    rank = b_.CreateTrunc(rank, b_.getInt8Ty());
+
+    Function *parent = b_.GetInsertBlock()->getParent();
+    BasicBlock *merge_block = BasicBlock::Create(module_->getContext(), call.func + "_merge", parent);
+    Value *registers = createZeroedMapLookup(map, key, call.func, merge_block);
+    Value *slot = b_.CreateGEP(registers, index);
+    Value *old_rank = b_.CreateLoad(slot);
+    b_.CreateStore(b_.CreateSelect(b_.CreateICmpUGT(rank, old_rank), rank, old_rank), slot);
+    b_.CreateBr(merge_block);
+
+    b_.SetInsertPoint(merge_block);
+    b_.CreateLifetimeEnd(key);
+    expr_ = nullptr;
+  }
+  else if (call.func == "topk")
+  {
+    Map &map = *call.map;
+    Expression &arg = *call.vargs->front();
+    arg.accept(*this);
+    Value *val = expr_;
+    Value *hash = getHash(arg.type, val);
+
+    // Count the element in each row of the count-min sketch, at columns picked
+    // by combining two halves of its hash
+    Function *parent = b_.GetInsertBlock()->getParent();
+    Value *hash1 = b_.CreateAnd(hash, b_.getInt64(0xffffffff));
+    Value *hash2 = b_.CreateOr(b_.CreateLShr(hash, 32), b_.getInt64(1));
+    AllocaInst *row_key = b_.CreateAllocaBPF(SizedType(Type::integer, 4), map.ident + "_key");
+    for (int row = 0; row < TOPK_SKETCH_DEPTH; row++)
+    {
+      BasicBlock *update_block = BasicBlock::Create(module_->getContext(), "topk_update", parent);
+      BasicBlock *next_block = BasicBlock::Create(module_->getContext(), "topk_next", parent);
+
+      b_.CreateStore(b_.getInt32(row), row_key);
+      Value *counts = b_.CreateMapLookup(map, row_key);
+      b_.CreateCondBr(b_.CreateICmpNE(counts,
+            ConstantPointerNull::get(b_.getInt8PtrTy()), "lookup_cond"),
+          update_block, next_block);
+
+      b_.SetInsertPoint(update_block);
+      Value *column = b_.CreateAnd(
+          b_.CreateAdd(hash1, b_.CreateMul(hash2, b_.getInt64(row))),
+          b_.getInt64(TOPK_SKETCH_WIDTH - 1));
+      Value *slot = b_.CreateGEP(
+          b_.CreatePointerCast(counts, b_.getInt64Ty()->getPointerTo()), column);
+      b_.CreateStore(b_.CreateAdd(b_.CreateLoad(slot), b_.getInt64(1)), slot);
+      b_.CreateBr(next_block);
+
+      b_.SetInsertPoint(next_block);
+    }
+    b_.CreateLifetimeEnd(row_key);
+
+    // Make sure the element is in the candidates table. Looking it up marks it
+    // as recently used, so only new elements need to be written.
+    int candidates_fd = bpftrace_.topk_candidates_.at(map.ident)->mapfd_;
+    BasicBlock *insert_block = BasicBlock::Create(module_->getContext(), "topk_insert", parent);
+    BasicBlock *merge_block = BasicBlock::Create(module_->getContext(), "topk_merge", parent);
+    AllocaInst *key = b_.CreateAllocaBPF(arg.type, map.ident + "_candidate");
+    if (arg.type.type == Type::string)
+    {
+      b_.CreateMemCpy(key, val, arg.type.size, 1);
+      if (!arg.is_variable && !isCachedBuiltin(val))
+        b_.CreateLifetimeEnd(val);
+    }
+    else
+    {
+      b_.CreateStore(val, key);
+    }
+    Value *found = b_.CreateMapLookup(candidates_fd, key);
+    b_.CreateCondBr(b_.CreateICmpEQ(found,
+          ConstantPointerNull::get(b_.getInt8PtrTy()), "lookup_cond"),
+        insert_block, merge_block);
+
+    b_.SetInsertPoint(insert_block);
+    AllocaInst *zero = b_.CreateAllocaBPF(SizedType(Type::integer, 8), map.ident + "_zero");
+    b_.CreateStore(b_.getInt64(0), zero);
+    b_.CreateMapUpdateElem(candidates_fd, key, zero);
+    b_.CreateLifetimeEnd(zero);
+    b_.CreateBr(merge_block);
+
+    b_.SetInsertPoint(merge_block);
+    b_.CreateLifetimeEnd(key);
+    expr_ = nullptr;
+  }
+  else if (call.func == "sum" || call.func == "min" || call.func == "max" ||
+           call.func == "avg" || call.func == "stats")
+  {
+    Map &map = *call.map;
+    call.vargs->front()->accept(*this);
+    Value *val = expr_;
+    AllocaInst *key = getMapKey(map);
+    int num_fields = map.type.size / 8;
+
+    Function *parent = b_.GetInsertBlock()->getParent();
+    BasicBlock *update_block = BasicBlock::Create(module_->getContext(), call.func + "_update", parent);
+    BasicBlock *init_block = BasicBlock::Create(module_->getContext(), call.func + "_init", parent);
+    BasicBlock *merge_block = BasicBlock::Create(module_->getContext(), call.func + "_merge", parent);
+
+    Value *lookup = b_.CreateMapLookup(map, key);
+    Value *found = b_.CreateICmpNE(lookup,
+        ConstantPointerNull::get(b_.getInt8PtrTy()), "lookup_cond");
+    b_.CreateCondBr(found, update_block, init_block);
+
+    // This CPU already has a value for the key, so update it in place
+    b_.SetInsertPoint(update_block);
+    Value *fields = b_.CreatePointerCast(lookup, b_.getInt64Ty()->getPointerTo());
+    std::vector<Value *> old_fields;
+    for (int i=0; i<num_fields; i++)
+      old_fields.push_back(b_.CreateLoad(b_.CreateGEP(fields, b_.getInt64(i))));
+    std::vector<Value *> new_fields = updateAggregation(call.func, old_fields, val);
+    for (int i=0; i<num_fields; i++)
+      b_.CreateStore(new_fields.at(i), b_.CreateGEP(fields, b_.getInt64(i)));
+    b_.CreateBr(merge_block);
+
+    // Otherwise create it, starting from all fields zeroed
+    b_.SetInsertPoint(init_block);
+    AllocaInst *newval = b_.CreateAllocaBPF(
+        ArrayType::get(b_.getInt64Ty(), num_fields), map.ident + "_val");
+    std::vector<Value *> zero_fields(num_fields, b_.getInt64(0));
+    new_fields = updateAggregation(call.func, zero_fields, val);
+    for (int i=0; i<num_fields; i++)
+      b_.CreateStore(new_fields.at(i), b_.CreateGEP(newval, {b_.getInt64(0), b_.getInt64(i)}));
+    b_.CreateMapUpdateElem(map, key, newval);
+    b_.CreateLifetimeEnd(newval);
+    b_.CreateBr(merge_block);
+
+    b_.SetInsertPoint(merge_block);
+    b_.CreateLifetimeEnd(key);
+    expr_ = nullptr;
+  }
   else if (call.func == "delete")
   {
     auto &arg = *call.vargs->at(0);
     auto &map = static_cast<Map&>(arg);
+    if (isTaskStorageMap(map))
+    {
+      b_.CreateTaskStorageDelete(map, getCurrentTask());
+      expr_ = nullptr;
+      return;
+    }
     AllocaInst *key = getMapKey(map);
     b_.CreateMapDeleteElem(map, key);
     b_.CreateLifetimeEnd(key);
     expr_ = nullptr;
   }
+  else if (call.func == "take")
+  {
+    // There's no helper for looking up and deleting from a hash map in one
+    // call, but the key only needs to be built once for both
+    auto &map = static_cast<Map&>(*call.vargs->at(0));
+    if (isTaskStorageMap(map))
+    {
+      Value *task = getCurrentTask();
+      expr_ = b_.CreateTaskStorageLookup(map, task);
+      b_.CreateTaskStorageDelete(map, task);
+    }
+    else
+    {
+      AllocaInst *key = getMapKey(map);
+      expr_ = b_.CreateMapLookupElem(map, key);
+      b_.CreateMapDeleteElem(map, key);
+      b_.CreateLifetimeEnd(key);
+    }
+  }
   else if (call.func == "str")
   {
     AllocaInst *buf = b_.CreateAllocaBPF(call.type, "str");
@@ -178,6 +420,25 @@ void CodegenLLVM::visit(Call &call)
     std::vector<llvm::Type *> elements = { b_.getInt64Ty() }; // printf ID
     String &fmt = static_cast<String&>(*call.vargs->at(0));
 
+    // Rate limited lines are counted and skipped. Anything fetched while
+    // building the line isn't always fetched, so can't be reused.
+    BasicBlock *merge_block = nullptr;
+    if (bpftrace_.ratelimit_map_)
+    {
+      Function *parent = b_.GetInsertBlock()->getParent();
+      BasicBlock *output_block = BasicBlock::Create(module_->getContext(), "printf_output", parent);
+      BasicBlock *limited_block = BasicBlock::Create(module_->getContext(), "printf_limited", parent);
+      merge_block = BasicBlock::Create(module_->getContext(), "printf_merge", parent);
+      b_.CreateCondBr(createRateLimit(), output_block, limited_block);
+
+      b_.SetInsertPoint(limited_block);
+      createDropCount(1);
+      b_.CreateBr(merge_block);
+
+      b_.SetInsertPoint(output_block);
+      conditional_depth_++;
+    }
+
     static int printf_id = 0;
     auto args = std::get<1>(bpftrace_.printf_args_.at(printf_id));
     for (SizedType t : args)
@@ -205,8 +466,59 @@ void CodegenLLVM::visit(Call &call)
     printf_id++;
     b_.CreatePerfEventOutput(ctx_, printf_args, struct_size);
     b_.CreateLifetimeEnd(printf_args);
+
+    if (merge_block)
+    {
+      conditional_depth_--;
+      b_.CreateBr(merge_block);
+      b_.SetInsertPoint(merge_block);
+    }
+    expr_ = nullptr;
+  }
+  else if (call.func == "print" || call.func == "clear")
+  {
+    // Maps are printed and cleared by userspace, which is sent the map's
+    // index and something identifying this run of the probe, so it can tell
+    // when a clear() follows a print() of the same map
+    Map &map = static_cast<Map&>(*call.vargs->at(0));
+    auto &double_buffered = bpftrace_.double_buffered_maps_;
+    int map_id = std::find(double_buffered.begin(), double_buffered.end(), map.ident) -
+                 double_buffered.begin();
+    AsyncAction action = call.func == "print" ? AsyncAction::print : AsyncAction::clear;
+
+    ArrayType *action_type = ArrayType::get(b_.getInt64Ty(), 3);
+    AllocaInst *action_args = b_.CreateAllocaBPF(action_type, call.func + "_args");
+    b_.CreateStore(b_.getInt64(static_cast<uint64_t>(action)),
+        b_.CreateGEP(action_args, {b_.getInt64(0), b_.getInt64(0)}));
+    b_.CreateStore(b_.getInt64(map_id),
+        b_.CreateGEP(action_args, {b_.getInt64(0), b_.getInt64(1)}));
+    b_.CreateStore(getCachedBuiltin("run_id", [&]() { return b_.CreateGetNs(); }),
+        b_.CreateGEP(action_args, {b_.getInt64(0), b_.getInt64(2)}));
+    b_.CreatePerfEventOutput(ctx_, action_args, 3 * sizeof(uint64_t));
+    b_.CreateLifetimeEnd(action_args);
     expr_ = nullptr;
   }
+  else if (call.func == "sample")
+  {
+    // Keep one in every N events, chosen at random, and count the rest so
+    // results can be scaled back up
+    int rate = static_cast<Integer&>(*call.vargs->at(0)).n;
+    Value *random = b_.CreateZExt(b_.CreateGetRandom(), b_.getInt64Ty());
+    Value *keep = b_.CreateICmpEQ(
+        b_.CreateURem(random, b_.getInt64(rate)), b_.getInt64(0), "sample_cond");
+
+    Function *parent = b_.GetInsertBlock()->getParent();
+    BasicBlock *drop_block = BasicBlock::Create(module_->getContext(), "sample_drop", parent);
+    BasicBlock *merge_block = BasicBlock::Create(module_->getContext(), "sample_merge", parent);
+    b_.CreateCondBr(keep, merge_block, drop_block);
+
+    b_.SetInsertPoint(drop_block);
+    createDropCount(0);
+    b_.CreateBr(merge_block);
+
+    b_.SetInsertPoint(merge_block);
+    expr_ = b_.CreateZExt(keep, b_.getInt64Ty());
+  }
   else
   {
     abort();
@@ -215,6 +527,12 @@ void CodegenLLVM::visit(Call &call)
 
 void CodegenLLVM::visit(Map &map)
 {
+  if (isTaskStorageMap(map))
+  {
+    expr_ = b_.CreateTaskStorageLookup(map, getCurrentTask());
+    return;
+  }
+
   AllocaInst *key = getMapKey(map);
   expr_ = b_.CreateMapLookupElem(map, key);
   b_.CreateLifetimeEnd(key);
@@ -259,9 +577,9 @@ void CodegenLLVM::visit(Binop &binop)
       default:
         abort();
     }
-    if (!binop.left->is_variable)
+    if (!binop.left->is_variable && !isCachedBuiltin(lhs))
       b_.CreateLifetimeEnd(lhs);
-    if (!binop.right->is_variable)
+    if (!binop.right->is_variable && !isCachedBuiltin(rhs))
       b_.CreateLifetimeEnd(rhs);
   }
   else
@@ -335,6 +653,15 @@ void CodegenLLVM::visit(AssignMapStatement &assignment)
 
   Value *val, *expr;
   expr = expr_;
+  if (isTaskStorageMap(map))
+  {
+    val = b_.CreateAllocaBPF(map.type, map.ident + "_val");
+    b_.CreateStore(expr, val);
+    b_.CreateTaskStorageUpdate(map, getCurrentTask(), val);
+    b_.CreateLifetimeEnd(val);
+    return;
+  }
+
   AllocaInst *key = getMapKey(map);
   if (assignment.expr->type.type == Type::string)
   {
@@ -347,7 +674,7 @@ void CodegenLLVM::visit(AssignMapStatement &assignment)
   }
   b_.CreateMapUpdateElem(map, key, val);
   b_.CreateLifetimeEnd(key);
-  if (!assignment.expr->is_variable)
+  if (!assignment.expr->is_variable && !isCachedBuiltin(val))
     b_.CreateLifetimeEnd(val);
 }
 
@@ -399,6 +726,13 @@ void CodegenLLVM::visit(Probe &probe)
   b_.SetInsertPoint(entry);
 
   ctx_ = func->arg_begin();
+  builtin_cache_.clear();
+  b_.ClearMapPtrs();
+  // The semantic analyser ensures all attach points share a context layout
+  probe_type_ = probetype(probe.attach_points->at(0)->provider);
+
+  if (probe_type_ == ProbeType::syscall)
+    createSyscallFilter(probe);
 
   if (probe.pred) {
     probe.pred->accept(*this);
@@ -418,14 +752,88 @@ void CodegenLLVM::visit(Program &program)
 {
   for (Include *include : *program.includes)
     include->accept(*this);
+  probe_index_ = 0;
   for (Probe *probe : *program.probes)
+  {
     probe->accept(*this);
+    probe_index_++;
+  }
+}
+
+Value *CodegenLLVM::getCachedBuiltin(const std::string &name, std::function<Value *()> create)
+{
+  // Builtins which can't change while a probe is running only need to be
+  // fetched once. The first fetch must dominate every later use though, so
+  // don't cache anything fetched inside a short-circuited expression.
+  auto search = builtin_cache_.find(name);
+  if (search != builtin_cache_.end())
+    return search->second;
+
+  Value *val = create();
+  if (conditional_depth_ == 0)
+    builtin_cache_[name] = val;
+  return val;
+}
+
+bool CodegenLLVM::isCachedBuiltin(Value *val) const
+{
+  for (auto &cached : builtin_cache_)
+  {
+    if (cached.second == val)
+      return true;
+  }
+  return false;
+}
+
+void CodegenLLVM::createSyscallFilter(Probe &probe)
+{
+  // Every syscall passes through the raw_syscalls tracepoint, so jump
+  // straight to the probe body for the ones we're tracing and return early
+  // for everything else.
+  std::set<int> nrs;
+  for (AttachPoint *ap : *probe.attach_points)
+  {
+    if (ap->func == "*")
+      return;
+    for (int nr : bpftrace_.find_syscalls(ap->func))
+      nrs.insert(nr);
+  }
+
+  Function *parent = b_.GetInsertBlock()->getParent();
+  BasicBlock *syscall_miss_block = BasicBlock::Create(
+      module_->getContext(),
+      "syscall_miss",
+      parent);
+  BasicBlock *syscall_match_block = BasicBlock::Create(
+      module_->getContext(),
+      "syscall_match",
+      parent);
+
+  Value *src = b_.CreateGEP(ctx_, b_.getInt64(8));
+  Value *nr = b_.CreateLoad(b_.getInt64Ty(),
+      b_.CreatePointerCast(src, b_.getInt64Ty()->getPointerTo()),
+      "syscall_nr");
+  SwitchInst *dispatch = b_.CreateSwitch(nr, syscall_miss_block, nrs.size());
+  for (int n : nrs)
+    dispatch->addCase(b_.getInt64(n), syscall_match_block);
+
+  b_.SetInsertPoint(syscall_miss_block);
+  b_.CreateRet(ConstantInt::get(module_->getContext(), APInt(64, 0)));
+
+  b_.SetInsertPoint(syscall_match_block);
 }
 
 AllocaInst *CodegenLLVM::getMapKey(Map &map)
 {
   AllocaInst *key;
-  if (map.vargs) {
+  if (map.vargs && isArrayMap(map)) {
+    // Bounded integer keys index the array directly. Out of range indexes are
+    // rejected by the kernel's own bounds check.
+    key = b_.CreateAllocaBPF(SizedType(Type::integer, 4), map.ident + "_key");
+    map.vargs->front()->accept(*this);
+    b_.CreateStore(b_.CreateTrunc(expr_, b_.getInt32Ty()), key);
+  }
+  else if (map.vargs) {
     size_t size = 0;
     for (Expression *expr : *map.vargs)
     {
@@ -444,6 +852,11 @@ AllocaInst *CodegenLLVM::getMapKey(Map &map)
       offset += expr->type.size;
     }
   }
+  else if (isArrayMap(map))
+  {
+    key = b_.CreateAllocaBPF(SizedType(Type::integer, 4), map.ident + "_key");
+    b_.CreateStore(b_.getInt32(0), key);
+  }
   else
   {
     key = b_.CreateAllocaBPF(SizedType(Type::integer, 8), map.ident + "_key");
@@ -476,6 +889,12 @@ AllocaInst *CodegenLLVM::getQuantizeMapKey(Map &map, Value *log2)
     Value *offset_val = b_.CreateGEP(key, {b_.getInt64(0), b_.getInt64(offset)});
     b_.CreateStore(log2, offset_val);
   }
+  else if (isArrayMap(map))
+  {
+    // Keyless quantize maps are indexed directly by bucket number
+    key = b_.CreateAllocaBPF(SizedType(Type::integer, 4), map.ident + "_key");
+    b_.CreateStore(b_.CreateTrunc(log2, b_.getInt32Ty()), key);
+  }
   else
   {
     key = b_.CreateAllocaBPF(SizedType(Type::integer, 8), map.ident + "_key");
@@ -484,6 +903,235 @@ AllocaInst *CodegenLLVM::getQuantizeMapKey(Map &map, Value *log2)
   return key;
 }
 
+Value *CodegenLLVM::getHistBucket(const SizedType &type, Value *val)
+{
+  // Both histograms are computed without branches, then clamped to the last
+  // bucket so the verifier can see the index is in range
+  Value *last = b_.getInt64(type.size / sizeof(uint64_t) - 1);
+  Value *bucket;
+  if (type.type == Type::lhist)
+  {
+    // Bucket 0 holds values below min and the last bucket values at or above
+    // max, with a bucket for each step in between
+    Value *offset = b_.CreateSub(val, b_.getInt64(type.hist_min));
+    Value *linear = b_.CreateAdd(
+        b_.CreateUDiv(offset, b_.getInt64(type.hist_step)), b_.getInt64(1));
+    Value *below = b_.CreateICmpSLT(val, b_.getInt64(type.hist_min));
+    bucket = b_.CreateSelect(below, b_.getInt64(0), linear);
+  }
+  else
+  {
+    // Values below the number of sub-buckets N have a bucket each. Larger
+    // values v are shifted right until they're in [N, 2N), which leaves the
+    // sub-bucket within their power of two, and each extra shift moves along
+    // by another N buckets:
+    //   shift = max(log2(v) - log2(N), 0)
+    //   bucket = shift * N + (v >> shift)
+    int sub_shift = __builtin_ctzll(type.hist_step);
+    Value *n = b_.CreateSelect(b_.CreateICmpSLT(val, b_.getInt64(0)), b_.getInt64(0), val);
+    Value *excess = b_.CreateSub(getLog2(n), b_.getInt64(sub_shift));
+    Value *shift = b_.CreateSelect(b_.CreateICmpSGT(excess, b_.getInt64(0)), excess, b_.getInt64(0));
+    bucket = b_.CreateAdd(b_.CreateShl(shift, sub_shift), b_.CreateLShr(n, shift));
+  }
+  return b_.CreateSelect(b_.CreateICmpUGT(bucket, last), last, bucket);
+}
+
+Value *CodegenLLVM::getLog2(Value *val)
+{
+  // Like the log2 helper function, but covering all 64 bits:
+  // floor(log2(val)), or 0 if val is 0
+  Value *rest = val;
+  Value *log2 = b_.getInt64(0);
+  for (int i = 5; i >= 0; i--)
+  {
+    Value *step = b_.CreateShl(b_.CreateZExt(
+        b_.CreateICmpUGE(rest, b_.getInt64(1ULL << (1 << i))), b_.getInt64Ty()), i);
+    rest = b_.CreateLShr(rest, step);
+    log2 = b_.CreateAdd(log2, step);
+  }
+  return log2;
+}
+
+Value *CodegenLLVM::getHash(const SizedType &type, Value *val)
+{
+  // Mixes each 64-bit word of the value into the hash with the splitmix64
+  // finaliser, so every input bit affects every output bit
+  auto mix = [&](Value *h)
+  {
+    h = b_.CreateXor(h, b_.CreateLShr(h, 30));
+    h = b_.CreateMul(h, b_.getInt64(0xbf58476d1ce4e5b9ULL));
+    h = b_.CreateXor(h, b_.CreateLShr(h, 27));
+    h = b_.CreateMul(h, b_.getInt64(0x94d049bb133111ebULL));
+    return b_.CreateXor(h, b_.CreateLShr(h, 31));
+  };
+
+  Value *hash = b_.getInt64(0x9e3779b97f4a7c15ULL);
+  if (type.type == Type::string)
+  {
+    // Strings are zero padded, so can be hashed a word at a time
+    Value *words = b_.CreatePointerCast(val, b_.getInt64Ty()->getPointerTo());
+    for (size_t i = 0; i < type.size / sizeof(uint64_t); i++)
+      hash = mix(b_.CreateXor(hash, b_.CreateLoad(b_.CreateGEP(words, b_.getInt64(i)))));
+  }
+  else
+  {
+    hash = mix(b_.CreateXor(hash, val));
+  }
+  return hash;
+}
+
+Value *CodegenLLVM::createZeroedMapLookup(Map &map, AllocaInst *key,
+    const std::string &name, BasicBlock *failure_block)
+{
+  // Returns this CPU's value for the key, first adding it with every byte
+  // zeroed if it's missing. The value is too big to build on the stack, so it
+  // is copied from the zero map. If the value can't be found or added, this
+  // branches to failure_block instead.
+  Function *parent = b_.GetInsertBlock()->getParent();
+  BasicBlock *init_block = BasicBlock::Create(module_->getContext(), name + "_init", parent);
+  BasicBlock *create_block = BasicBlock::Create(module_->getContext(), name + "_create", parent);
+  BasicBlock *update_block = BasicBlock::Create(module_->getContext(), name + "_update", parent);
+  Value *null_ptr = ConstantPointerNull::get(b_.getInt8PtrTy());
+
+  CallInst *lookup = b_.CreateMapLookup(map, key);
+  BasicBlock *lookup_block = b_.GetInsertBlock();
+  b_.CreateCondBr(b_.CreateICmpNE(lookup, null_ptr, "lookup_cond"),
+                  update_block, init_block);
+
+  b_.SetInsertPoint(init_block);
+  AllocaInst *zero_key = b_.CreateAllocaBPF(SizedType(Type::integer, 4), "zero_key");
+  b_.CreateStore(b_.getInt32(0), zero_key);
+  CallInst *zero = b_.CreateMapLookup(bpftrace_.zero_map_->mapfd_, zero_key);
+  b_.CreateLifetimeEnd(zero_key);
+  b_.CreateCondBr(b_.CreateICmpNE(zero, null_ptr, "zero_cond"),
+                  create_block, failure_block);
+
+  b_.SetInsertPoint(create_block);
+  b_.CreateMapUpdateElem(map, key, zero);
+  CallInst *created = b_.CreateMapLookup(map, key);
+  BasicBlock *created_block = b_.GetInsertBlock();
+  b_.CreateCondBr(b_.CreateICmpNE(created, null_ptr, "created_cond"),
+                  update_block, failure_block);
+
+  b_.SetInsertPoint(update_block);
+  PHINode *value = b_.CreatePHI(b_.getInt8PtrTy(), 2, name + "_value");
+  value->addIncoming(lookup, lookup_block);
+  value->addIncoming(created, created_block);
+  return value;
+}
+
+void CodegenLLVM::createDropCount(int kind)
+{
+  // Slot 0 of each probe counts events dropped by sample(), and slot 1
+  // printf() calls dropped by rate limiting
+  Function *parent = b_.GetInsertBlock()->getParent();
+  BasicBlock *update_block = BasicBlock::Create(module_->getContext(), "drops_update", parent);
+  BasicBlock *merge_block = BasicBlock::Create(module_->getContext(), "drops_merge", parent);
+
+  AllocaInst *key = b_.CreateAllocaBPF(SizedType(Type::integer, 4), "drops_key");
+  b_.CreateStore(b_.getInt32(probe_index_ * 2 + kind), key);
+  CallInst *count = b_.CreateMapLookup(bpftrace_.drops_map_->mapfd_, key);
+  b_.CreateLifetimeEnd(key);
+  b_.CreateCondBr(b_.CreateICmpNE(count,
+        ConstantPointerNull::get(b_.getInt8PtrTy()), "lookup_cond"),
+      update_block, merge_block);
+
+  b_.SetInsertPoint(update_block);
+  Value *slot = b_.CreatePointerCast(count, b_.getInt64Ty()->getPointerTo());
+  b_.CreateStore(b_.CreateAdd(b_.CreateLoad(slot), b_.getInt64(1)), slot);
+  b_.CreateBr(merge_block);
+
+  b_.SetInsertPoint(merge_block);
+}
+
+Value *CodegenLLVM::createRateLimit()
+{
+  // Each CPU gets an even share of the probe's rate, enforced with the
+  // generic cell rate algorithm: a line is allowed if the CPU isn't more than
+  // a second's worth of lines ahead of schedule. Returns whether it is.
+  const uint64_t second = 1000000000;
+  uint64_t interval = second * bpftrace_.num_cpus() / bpftrace_.printf_rate_;
+  uint64_t tolerance = interval < second ? second - interval : 0;
+
+  Function *parent = b_.GetInsertBlock()->getParent();
+  BasicBlock *check_block = BasicBlock::Create(module_->getContext(), "ratelimit_check", parent);
+  BasicBlock *merge_block = BasicBlock::Create(module_->getContext(), "ratelimit_merge", parent);
+
+  AllocaInst *key = b_.CreateAllocaBPF(SizedType(Type::integer, 4), "ratelimit_key");
+  b_.CreateStore(b_.getInt32(probe_index_), key);
+  CallInst *state = b_.CreateMapLookup(bpftrace_.ratelimit_map_->mapfd_, key);
+  b_.CreateLifetimeEnd(key);
+  BasicBlock *lookup_block = b_.GetInsertBlock();
+  b_.CreateCondBr(b_.CreateICmpNE(state,
+        ConstantPointerNull::get(b_.getInt8PtrTy()), "lookup_cond"),
+      check_block, merge_block);
+
+  // The state is the time at which the CPU is next allowed a line
+  b_.SetInsertPoint(check_block);
+  Value *next_ptr = b_.CreatePointerCast(state, b_.getInt64Ty()->getPointerTo());
+  Value *scheduled = b_.CreateLoad(next_ptr);
+  Value *now = b_.CreateGetNs();
+  Value *next = b_.CreateSelect(b_.CreateICmpUGT(scheduled, now), scheduled, now);
+  Value *allowed = b_.CreateICmpULE(b_.CreateSub(next, now), b_.getInt64(tolerance));
+  b_.CreateStore(b_.CreateSelect(allowed,
+        b_.CreateAdd(next, b_.getInt64(interval)), scheduled), next_ptr);
+  b_.CreateBr(merge_block);
+
+  b_.SetInsertPoint(merge_block);
+  PHINode *result = b_.CreatePHI(b_.getInt1Ty(), 2, "ratelimit_allowed");
+  result->addIncoming(b_.getInt1(true), lookup_block);
+  result->addIncoming(allowed, check_block);
+  return result;
+}
+
+std::vector<Value *> CodegenLLVM::updateAggregation(const std::string &func,
+    const std::vector<Value *> &fields, Value *val)
+{
+  // See SemanticAnalyser::visit(Call) for the layout of each aggregation
+  if (func == "sum")
+  {
+    return { b_.CreateAdd(fields.at(0), val) };
+  }
+  else if (func == "min" || func == "max")
+  {
+    Value *better = func == "min" ? b_.CreateICmpSLT(val, fields.at(0))
+                                  : b_.CreateICmpSGT(val, fields.at(0));
+    Value *replace = b_.CreateOr(b_.CreateICmpEQ(fields.at(1), b_.getInt64(0)), better);
+    return { b_.CreateSelect(replace, val, fields.at(0)), b_.getInt64(1) };
+  }
+  else if (func == "avg")
+  {
+    return { b_.CreateAdd(fields.at(0), b_.getInt64(1)),
+             b_.CreateAdd(fields.at(1), val) };
+  }
+  else if (func == "stats")
+  {
+    Value *first = b_.CreateICmpEQ(fields.at(0), b_.getInt64(0));
+    Value *replace_min = b_.CreateOr(first, b_.CreateICmpSLT(val, fields.at(2)));
+    Value *replace_max = b_.CreateOr(first, b_.CreateICmpSGT(val, fields.at(3)));
+    return { b_.CreateAdd(fields.at(0), b_.getInt64(1)),
+             b_.CreateAdd(fields.at(1), val),
+             b_.CreateSelect(replace_min, val, fields.at(2)),
+             b_.CreateSelect(replace_max, val, fields.at(3)) };
+  }
+  abort();
+}
+
+bool CodegenLLVM::isTaskStorageMap(Map &map) const
+{
+  return bpftrace_.maps_.at(map.ident)->map_type_ == BPF_MAP_TYPE_TASK_STORAGE;
+}
+
+Value *CodegenLLVM::getCurrentTask()
+{
+  return getCachedBuiltin("task", [&]() { return b_.CreateGetCurrentTaskBtf(); });
+}
+
+bool CodegenLLVM::isArrayMap(Map &map) const
+{
+  return bpftrace_.maps_.at(map.ident)->is_array();
+}
+
 Value *CodegenLLVM::createLogicalAnd(Binop &binop)
 {
   assert(binop.left->type.type == Type::integer);
@@ -504,8 +1152,12 @@ Value *CodegenLLVM::createLogicalAnd(Binop &binop)
                   false_block);
 
   b_.SetInsertPoint(lhs_true_block);
+  // The right hand side isn't always evaluated, so anything it fetches can't
+  // be reused by later expressions
   Value *rhs;
+  conditional_depth_++;
   binop.right->accept(*this);
+  conditional_depth_--;
   rhs = expr_;
   b_.CreateCondBr(b_.CreateICmpNE(rhs, b_.getInt64(0), "rhs_true_cond"),
                   true_block,
@@ -543,8 +1195,12 @@ Value *CodegenLLVM::createLogicalOr(Binop &binop)
                   lhs_false_block);
 
   b_.SetInsertPoint(lhs_false_block);
+  // The right hand side isn't always evaluated, so anything it fetches can't
+  // be reused by later expressions
   Value *rhs;
+  conditional_depth_++;
   binop.right->accept(*this);
+  conditional_depth_--;
   rhs = expr_;
   b_.CreateCondBr(b_.CreateICmpNE(rhs, b_.getInt64(0), "rhs_true_cond"),
                   true_block,
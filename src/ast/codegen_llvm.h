@@ -1,5 +1,6 @@
 #pragma once
 
+#include <functional>
 #include <iostream>
 #include <ostream>
 
@@ -47,8 +48,23 @@ public:
   void visit(Program &program) override;
   AllocaInst *getMapKey(Map &map);
   AllocaInst *getQuantizeMapKey(Map &map, Value *log2);
+  Value *getHistBucket(const SizedType &type, Value *val);
+  Value *getLog2(Value *val);
+  Value *getHash(const SizedType &type, Value *val);
+  Value *createZeroedMapLookup(Map &map, AllocaInst *key,
+      const std::string &name, BasicBlock *failure_block);
+  bool isArrayMap(Map &map) const;
+  bool isTaskStorageMap(Map &map) const;
+  std::vector<Value *> updateAggregation(const std::string &func,
+      const std::vector<Value *> &fields, Value *val);
+  Value *getCurrentTask();
+  Value      *getCachedBuiltin(const std::string &name, std::function<Value *()> create);
+  bool        isCachedBuiltin(Value *val) const;
   Value      *createLogicalAnd(Binop &binop);
   Value      *createLogicalOr(Binop &binop);
+  void        createSyscallFilter(Probe &probe);
+  void        createDropCount(int kind);
+  Value      *createRateLimit();
 
   void createLog2Function();
   void createStrcmpFunction();
@@ -63,9 +79,13 @@ private:
   DataLayout layout_;
   Value *expr_ = nullptr;
   Value *ctx_;
+  ProbeType probe_type_;
   BPFtrace &bpftrace_;
 
   std::map<std::string, Value *> variables_;
+  std::map<std::string, Value *> builtin_cache_;
+  int conditional_depth_ = 0;
+  int probe_index_ = 0;
 };
 
 } // namespace ast
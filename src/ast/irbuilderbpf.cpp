@@ -1,3 +1,5 @@
+#include <algorithm>
+
 #include "irbuilderbpf.h"
 #include "libbpf.h"
 
@@ -84,16 +86,69 @@ CallInst *IRBuilderBPF::CreateBpfPseudoCall(int mapfd)
   return CreateCall(pseudo_func, {getInt64(BPF_PSEUDO_MAP_FD), getInt64(mapfd)}, "pseudo");
 }
 
-CallInst *IRBuilderBPF::CreateBpfPseudoCall(Map &map)
+Value *IRBuilderBPF::CreateBpfPseudoCall(Map &map)
 {
   int mapfd = bpftrace_.maps_[map.ident]->mapfd_;
-  return CreateBpfPseudoCall(mapfd);
+  auto &double_buffered = bpftrace_.double_buffered_maps_;
+  auto search = std::find(double_buffered.begin(), double_buffered.end(), map.ident);
+  if (search == double_buffered.end())
+    return CreateBpfPseudoCall(mapfd);
+  auto cached = map_ptrs_.find(map.ident);
+  if (cached != map_ptrs_.end())
+    return cached->second;
+
+  // Double-buffered maps are written to whichever copy their generation
+  // selects. Userspace bumps it to take the other copy out of use.
+  AllocaInst *key = CreateAllocaBPF(getInt32Ty(), "generation_key");
+  CreateStore(getInt32(search - double_buffered.begin()), key);
+  CallInst *lookup = CreateMapLookup(bpftrace_.generation_map_->mapfd_, key);
+
+  Function *parent = GetInsertBlock()->getParent();
+  BasicBlock *lookup_block = GetInsertBlock();
+  BasicBlock *found_block = BasicBlock::Create(module_.getContext(), "generation_found", parent);
+  BasicBlock *merge_block = BasicBlock::Create(module_.getContext(), "generation_merge", parent);
+  Value *condition = CreateICmpNE(
+      CreateIntCast(lookup, getInt8PtrTy(), true),
+      ConstantExpr::getCast(Instruction::IntToPtr, getInt64(0), getInt8PtrTy()),
+      "generation_cond");
+  CreateCondBr(condition, found_block, merge_block);
+
+  SetInsertPoint(found_block);
+  Value *found = CreateLoad(getInt64Ty(), CreatePointerCast(lookup, getInt64Ty()->getPointerTo()));
+  CreateBr(merge_block);
+
+  SetInsertPoint(merge_block);
+  PHINode *generation = CreatePHI(getInt64Ty(), 2, "generation");
+  generation->addIncoming(getInt64(0), lookup_block);
+  generation->addIncoming(found, found_block);
+  CreateLifetimeEnd(key);
+
+  int backbuffer_fd = bpftrace_.backbuffer_maps_.at(map.ident)->mapfd_;
+  Value *odd = CreateICmpNE(CreateAnd(generation, getInt64(1)), getInt64(0));
+  Value *map_ptr = CreateSelect(odd, CreateBpfPseudoCall(backbuffer_fd),
+                                CreateBpfPseudoCall(mapfd), "pseudo");
+  map_ptrs_[map.ident] = map_ptr;
+  return map_ptr;
 }
 
 Value *IRBuilderBPF::CreateMapLookupElem(Map &map, AllocaInst *key)
 {
-  Value *map_ptr = CreateBpfPseudoCall(map);
+  CallInst *call = CreateMapLookup(map, key);
+  return CreateLoadMapValue(map, call);
+}
 
+CallInst *IRBuilderBPF::CreateMapLookup(Map &map, AllocaInst *key)
+{
+  return CreateMapLookup(CreateBpfPseudoCall(map), key);
+}
+
+CallInst *IRBuilderBPF::CreateMapLookup(int mapfd, AllocaInst *key)
+{
+  return CreateMapLookup(CreateBpfPseudoCall(mapfd), key);
+}
+
+CallInst *IRBuilderBPF::CreateMapLookup(Value *map_ptr, AllocaInst *key)
+{
   // void *map_lookup_elem(&map, &key)
   // Return: Map value or NULL
   FunctionType *lookup_func_type = FunctionType::get(
@@ -105,8 +160,11 @@ Value *IRBuilderBPF::CreateMapLookupElem(Map &map, AllocaInst *key)
       Instruction::IntToPtr,
       getInt64(BPF_FUNC_map_lookup_elem),
       lookup_func_ptr_type);
-  CallInst *call = CreateCall(lookup_func, {map_ptr, key}, "lookup_elem");
+  return CreateCall(lookup_func, {map_ptr, key}, "lookup_elem");
+}
 
+Value *IRBuilderBPF::CreateLoadMapValue(Map &map, Value *call)
+{
   // Check if result == 0
   Function *parent = GetInsertBlock()->getParent();
   BasicBlock *lookup_success_block = BasicBlock::Create(module_.getContext(), "lookup_success", parent);
@@ -142,7 +200,16 @@ Value *IRBuilderBPF::CreateMapLookupElem(Map &map, AllocaInst *key)
 
 void IRBuilderBPF::CreateMapUpdateElem(Map &map, AllocaInst *key, Value *val)
 {
-  Value *map_ptr = CreateBpfPseudoCall(map);
+  CreateMapUpdateElem(CreateBpfPseudoCall(map), key, val);
+}
+
+void IRBuilderBPF::CreateMapUpdateElem(int mapfd, AllocaInst *key, Value *val)
+{
+  CreateMapUpdateElem(CreateBpfPseudoCall(mapfd), key, val);
+}
+
+void IRBuilderBPF::CreateMapUpdateElem(Value *map_ptr, AllocaInst *key, Value *val)
+{
   Value *flags = getInt64(0);
 
   // int map_update_elem(&map, &key, &value, flags)
@@ -178,6 +245,73 @@ void IRBuilderBPF::CreateMapDeleteElem(Map &map, AllocaInst *key)
   CallInst *call = CreateCall(delete_func, {map_ptr, key}, "delete_elem");
 }
 
+CallInst *IRBuilderBPF::CreateTaskStorageGet(Map &map, Value *task, bool create)
+{
+  Value *map_ptr = CreateBpfPseudoCall(map);
+  Value *value = ConstantExpr::getCast(Instruction::IntToPtr, getInt64(0), getInt8PtrTy());
+  Value *flags = getInt64(create ? BPF_LOCAL_STORAGE_GET_F_CREATE : 0);
+
+  // void *task_storage_get(&map, task, value, flags)
+  // Return: Task's storage or NULL
+  FunctionType *storageget_func_type = FunctionType::get(
+      getInt8PtrTy(),
+      {getInt8PtrTy(), getInt8PtrTy(), getInt8PtrTy(), getInt64Ty()},
+      false);
+  PointerType *storageget_func_ptr_type = PointerType::get(storageget_func_type, 0);
+  Constant *storageget_func = ConstantExpr::getCast(
+      Instruction::IntToPtr,
+      getInt64(BPF_FUNC_task_storage_get),
+      storageget_func_ptr_type);
+  return CreateCall(storageget_func, {map_ptr, task, value, flags}, "task_storage_get");
+}
+
+Value *IRBuilderBPF::CreateTaskStorageLookup(Map &map, Value *task)
+{
+  CallInst *call = CreateTaskStorageGet(map, task, false);
+  return CreateLoadMapValue(map, call);
+}
+
+void IRBuilderBPF::CreateTaskStorageUpdate(Map &map, Value *task, Value *val)
+{
+  CallInst *call = CreateTaskStorageGet(map, task, true);
+
+  // Storage can fail to be created under memory pressure
+  Function *parent = GetInsertBlock()->getParent();
+  BasicBlock *create_success_block = BasicBlock::Create(module_.getContext(), "storage_create_success", parent);
+  BasicBlock *create_merge_block = BasicBlock::Create(module_.getContext(), "storage_create_merge", parent);
+
+  Value *condition = CreateICmpNE(
+      CreateIntCast(call, getInt8PtrTy(), true),
+      ConstantExpr::getCast(Instruction::IntToPtr, getInt64(0), getInt8PtrTy()),
+      "storage_create_cond");
+  CreateCondBr(condition, create_success_block, create_merge_block);
+
+  SetInsertPoint(create_success_block);
+  CreateStore(CreateLoad(getInt64Ty(), val),
+              CreatePointerCast(call, getInt64Ty()->getPointerTo()));
+  CreateBr(create_merge_block);
+
+  SetInsertPoint(create_merge_block);
+}
+
+void IRBuilderBPF::CreateTaskStorageDelete(Map &map, Value *task)
+{
+  Value *map_ptr = CreateBpfPseudoCall(map);
+
+  // int task_storage_delete(&map, task)
+  // Return: 0 on success or negative error
+  FunctionType *storagedelete_func_type = FunctionType::get(
+      getInt64Ty(),
+      {getInt8PtrTy(), getInt8PtrTy()},
+      false);
+  PointerType *storagedelete_func_ptr_type = PointerType::get(storagedelete_func_type, 0);
+  Constant *storagedelete_func = ConstantExpr::getCast(
+      Instruction::IntToPtr,
+      getInt64(BPF_FUNC_task_storage_delete),
+      storagedelete_func_ptr_type);
+  CreateCall(storagedelete_func, {map_ptr, task}, "task_storage_delete");
+}
+
 void IRBuilderBPF::CreateProbeRead(AllocaInst *dst, size_t size, Value *src)
 {
   // int bpf_probe_read(void *dst, int size, void *src)
@@ -222,6 +356,19 @@ CallInst *IRBuilderBPF::CreateGetNs()
   return CreateCall(gettime_func, {}, "get_ns");
 }
 
+CallInst *IRBuilderBPF::CreateGetRandom()
+{
+  // u32 get_prandom_u32()
+  // Return: pseudo-random number
+  FunctionType *getrandom_func_type = FunctionType::get(getInt32Ty(), false);
+  PointerType *getrandom_func_ptr_type = PointerType::get(getrandom_func_type, 0);
+  Constant *getrandom_func = ConstantExpr::getCast(
+      Instruction::IntToPtr,
+      getInt64(BPF_FUNC_get_prandom_u32),
+      getrandom_func_ptr_type);
+  return CreateCall(getrandom_func, {}, "get_random");
+}
+
 CallInst *IRBuilderBPF::CreateGetPidTgid()
 {
   // u64 bpf_get_current_pid_tgid(void)
@@ -261,6 +408,19 @@ CallInst *IRBuilderBPF::CreateGetCpuId()
   return CreateCall(getcpuid_func, {}, "get_cpu_id");
 }
 
+CallInst *IRBuilderBPF::CreateGetCurrentTaskBtf()
+{
+  // struct task_struct *bpf_get_current_task_btf(void)
+  // Return: Pointer to the current task
+  FunctionType *getcurtask_func_type = FunctionType::get(getInt8PtrTy(), false);
+  PointerType *getcurtask_func_ptr_type = PointerType::get(getcurtask_func_type, 0);
+  Constant *getcurtask_func = ConstantExpr::getCast(
+      Instruction::IntToPtr,
+      getInt64(BPF_FUNC_get_current_task_btf),
+      getcurtask_func_ptr_type);
+  return CreateCall(getcurtask_func, {}, "get_current_task");
+}
+
 CallInst *IRBuilderBPF::CreateGetStackId(Value *ctx, bool ustack)
 {
   Value *map_ptr = CreateBpfPseudoCall(bpftrace_.stackid_map_->mapfd_);
@@ -300,6 +460,55 @@ void IRBuilderBPF::CreateGetCurrentComm(AllocaInst *buf, size_t size)
   CreateCall(getcomm_func, {buf, getInt64(size)}, "get_comm");
 }
 
+Value *IRBuilderBPF::CreateGetFuncId(Value *ctx, bool from_cookie)
+{
+  // Placeholder which is patched with the ID of the traced function when the
+  // program is loaded
+  Function *pseudo_func = module_.getFunction("llvm.bpf.pseudo");
+  Value *func_id = CreateCall(pseudo_func,
+      {getInt64(FUNC_ID_PSEUDO_SRC), getInt64(0)}, "func_id");
+  if (!from_cookie)
+    return func_id;
+
+  // u64 bpf_get_attach_cookie(void *ctx)
+  // Return: cookie which was given when the program was attached
+  FunctionType *getcookie_func_type = FunctionType::get(
+      getInt64Ty(),
+      {getInt8PtrTy()},
+      false);
+  PointerType *getcookie_func_ptr_type = PointerType::get(getcookie_func_type, 0);
+  Constant *getcookie_func = ConstantExpr::getCast(
+      Instruction::IntToPtr,
+      getInt64(BPF_FUNC_get_attach_cookie),
+      getcookie_func_ptr_type);
+  Value *cookie = CreateCall(getcookie_func, {ctx}, "get_attach_cookie");
+
+  Value *use_cookie = CreateICmpEQ(func_id, getInt64(FUNC_ID_FROM_COOKIE));
+  return CreateSelect(use_cookie, cookie, func_id);
+}
+
+Value *IRBuilderBPF::CreateGetFuncRet(Value *ctx)
+{
+  AllocaInst *retval = CreateAllocaBPF(getInt64Ty(), "retval");
+
+  // int bpf_get_func_ret(void *ctx, u64 *value)
+  // Return: 0 on success or negative error
+  FunctionType *getfuncret_func_type = FunctionType::get(
+      getInt64Ty(),
+      {getInt8PtrTy(), retval->getType()},
+      false);
+  PointerType *getfuncret_func_ptr_type = PointerType::get(getfuncret_func_type, 0);
+  Constant *getfuncret_func = ConstantExpr::getCast(
+      Instruction::IntToPtr,
+      getInt64(BPF_FUNC_get_func_ret),
+      getfuncret_func_ptr_type);
+  CreateCall(getfuncret_func, {ctx, retval}, "get_func_ret");
+
+  Value *value = CreateLoad(retval);
+  CreateLifetimeEnd(retval);
+  return value;
+}
+
 void IRBuilderBPF::CreatePerfEventOutput(Value *ctx, Value *data, size_t size)
 {
   Value *map_ptr = CreateBpfPseudoCall(bpftrace_.perf_event_map_->mapfd_);
@@ -23,23 +23,44 @@ public:
   AllocaInst *CreateAllocaMapKey(int bytes, const std::string &name="");
   llvm::Type *GetType(const SizedType &stype);
   CallInst   *CreateBpfPseudoCall(int mapfd);
-  CallInst   *CreateBpfPseudoCall(Map &map);
+  Value      *CreateBpfPseudoCall(Map &map);
   Value      *CreateMapLookupElem(Map &map, AllocaInst *key);
+  CallInst   *CreateMapLookup(int mapfd, AllocaInst *key);
+  CallInst   *CreateMapLookup(Value *map_ptr, AllocaInst *key);
+  CallInst   *CreateMapLookup(Map &map, AllocaInst *key);
+  void        CreateMapUpdateElem(int mapfd, AllocaInst *key, Value *val);
+  void        CreateMapUpdateElem(Value *map_ptr, AllocaInst *key, Value *val);
   void        CreateMapUpdateElem(Map &map, AllocaInst *key, Value *val);
   void        CreateMapDeleteElem(Map &map, AllocaInst *key);
+  Value      *CreateTaskStorageLookup(Map &map, Value *task);
+  void        CreateTaskStorageUpdate(Map &map, Value *task, Value *val);
+  void        CreateTaskStorageDelete(Map &map, Value *task);
   void        CreateProbeRead(AllocaInst *dst, size_t size, Value *src);
   void        CreateProbeReadStr(AllocaInst *dst, size_t size, Value *src);
   CallInst   *CreateGetNs();
+  CallInst   *CreateGetRandom();
   CallInst   *CreateGetPidTgid();
   CallInst   *CreateGetUidGid();
   CallInst   *CreateGetCpuId();
+  CallInst   *CreateGetCurrentTaskBtf();
   CallInst   *CreateGetStackId(Value *ctx, bool ustack);
   void        CreateGetCurrentComm(AllocaInst *buf, size_t size);
+  Value      *CreateGetFuncId(Value *ctx, bool from_cookie);
+  Value      *CreateGetFuncRet(Value *ctx);
   void        CreatePerfEventOutput(Value *ctx, Value *data, size_t size);
+  void        ClearMapPtrs() { map_ptrs_.clear(); }
 
 private:
+  Value      *CreateLoadMapValue(Map &map, Value *call);
+  CallInst   *CreateTaskStorageGet(Map &map, Value *task, bool create);
+
   Module &module_;
   BPFtrace &bpftrace_;
+
+  // The copy of each double-buffered map chosen by the current probe. A
+  // probe must stick to one copy, or it could read a value from one and
+  // write it back to the other.
+  std::map<std::string, Value *> map_ptrs_;
 };
 
 } // namespace ast
@@ -5,6 +5,8 @@
 #include "printf.h"
 #include "arch/arch.h"
 
+#include <linux/version.h>
+
 #include "libbpf.h"
 
 namespace bpftrace {
@@ -13,6 +15,8 @@ namespace ast {
 void SemanticAnalyser::visit(Integer &integer)
 {
   integer.type = SizedType(Type::integer, 8);
+  if (integer.n >= 0)
+    integer.bound = integer.n + 1;
 }
 
 void SemanticAnalyser::visit(String &string)
@@ -30,8 +34,21 @@ void SemanticAnalyser::visit(Builtin &builtin)
       builtin.ident == "tid" ||
       builtin.ident == "uid" ||
       builtin.ident == "gid" ||
-      builtin.ident == "cpu" ||
-      builtin.ident == "retval") {
+      builtin.ident == "cpu") {
+    builtin.type = SizedType(Type::integer, 8);
+    if (builtin.ident == "cpu")
+      builtin.bound = bpftrace_.num_cpus();
+  }
+  else if (builtin.ident == "retval") {
+    for (auto &attach_point : *probe_->attach_points)
+    {
+      if (attach_point->provider == "kfunc")
+        err_ << "The retval builtin can not be used with '" << attach_point->provider
+             << "' probes" << std::endl;
+      else if (attach_point->provider == "syscall" && attach_point->target != "exit")
+        err_ << "The retval builtin can only be used with 'syscall:exit' probes"
+             << std::endl;
+    }
     builtin.type = SizedType(Type::integer, 8);
   }
   else if (builtin.ident == "stack") {
@@ -51,8 +68,13 @@ void SemanticAnalyser::visit(Builtin &builtin)
       ProbeType type = probetype(attach_point->provider);
       if (type == ProbeType::kprobe ||
           type == ProbeType::kretprobe ||
-          type == ProbeType::tracepoint)
+          type == ProbeType::kfunc ||
+          type == ProbeType::kretfunc)
+        builtin.type = SizedType(Type::func, 8);
+      else if (type == ProbeType::tracepoint)
         builtin.type = SizedType(Type::sym, 8);
+      else if (type == ProbeType::syscall)
+        builtin.type = SizedType(Type::syscall, 8);
       else if (type == ProbeType::uprobe || type == ProbeType::uretprobe)
         builtin.type = SizedType(Type::usym, 8);
       else
@@ -65,6 +87,12 @@ void SemanticAnalyser::visit(Builtin &builtin)
     int arg_num = atoi(builtin.ident.substr(3).c_str());
     if (arg_num > arch::max_arg())
       err_ << arch::name() << " doesn't support " << builtin.ident << std::endl;
+    for (auto &attach_point : *probe_->attach_points)
+    {
+      if (attach_point->provider == "syscall" && attach_point->target != "enter")
+        err_ << "The " << builtin.ident << " builtin can only be used with "
+             << "'syscall:enter' probes" << std::endl;
+    }
     builtin.type = SizedType(Type::integer, 8);
   }
   else {
@@ -75,11 +103,19 @@ void SemanticAnalyser::visit(Builtin &builtin)
 
 void SemanticAnalyser::visit(Call &call)
 {
-  if (call.vargs) {
+  // Deleting a map element doesn't read its value
+  if (call.func == "delete")
+    map_target_ = true;
+
+  // print() and clear() take a whole map, not one of its elements
+  bool whole_map = call.func == "print" || call.func == "clear";
+
+  if (call.vargs && !whole_map) {
     for (Expression *expr : *call.vargs) {
       expr->accept(*this);
     }
   }
+  map_target_ = false;
 
   if (call.func == "quantize") {
     check_assignment(call, true, false);
@@ -88,22 +124,175 @@ void SemanticAnalyser::visit(Call &call)
 
     call.type = SizedType(Type::quantize, 8);
   }
+  else if (call.func == "lhist") {
+    check_assignment(call, true, false);
+    call.type = SizedType(Type::lhist, 0);
+    if (check_nargs(call, 4)) {
+      check_arg(call, Type::integer, 0);
+      bool literals = check_arg(call, Type::integer, 1, true) &&
+                      check_arg(call, Type::integer, 2, true) &&
+                      check_arg(call, Type::integer, 3, true);
+      if (literals) {
+        int64_t min = static_cast<Integer&>(*call.vargs->at(1)).n;
+        int64_t max = static_cast<Integer&>(*call.vargs->at(2)).n;
+        int64_t step = static_cast<Integer&>(*call.vargs->at(3)).n;
+        if (step <= 0)
+          err_ << "lhist() step must be positive" << std::endl;
+        else if (max <= min)
+          err_ << "lhist() max must be greater than min" << std::endl;
+        else if ((max - min) % step != 0)
+          err_ << "lhist() max - min must be a multiple of step" << std::endl;
+        else if ((max - min) / step > MAX_HIST_BUCKETS)
+          err_ << "lhist() can not have more than " << MAX_HIST_BUCKETS
+               << " buckets" << std::endl;
+        else {
+          // One bucket per step, plus one each for values below min and at or
+          // above max
+          call.type.size = ((max - min) / step + 2) * sizeof(uint64_t);
+          call.type.hist_min = min;
+          call.type.hist_max = max;
+          call.type.hist_step = step;
+        }
+      }
+    }
+  }
+  else if (call.func == "llhist") {
+    check_assignment(call, true, false);
+    call.type = SizedType(Type::llhist, 0);
+    if (check_varargs(call, 1, 2)) {
+      check_arg(call, Type::integer, 0);
+      int64_t sub_buckets = 16;
+      if (call.vargs->size() == 2 && check_arg(call, Type::integer, 1, true))
+        sub_buckets = static_cast<Integer&>(*call.vargs->at(1)).n;
+
+      if (sub_buckets < 1 || sub_buckets > 64 ||
+          (sub_buckets & (sub_buckets - 1)) != 0) {
+        err_ << "llhist() sub-buckets must be a power of two between 1 and 64"
+             << std::endl;
+      }
+      else {
+        // Values below sub_buckets get a bucket each, then every power of two
+        // up to 2^62 is split into sub_buckets buckets
+        int shift = __builtin_ctzll(sub_buckets);
+        call.type.size = (64 - shift) * sub_buckets * sizeof(uint64_t);
+        call.type.hist_step = sub_buckets;
+      }
+    }
+  }
   else if (call.func == "count") {
     check_assignment(call, true, false);
     check_nargs(call, 0);
 
     call.type = SizedType(Type::count, 8);
   }
+  else if (call.func == "sum" || call.func == "min" || call.func == "max" ||
+           call.func == "avg" || call.func == "stats") {
+    check_assignment(call, true, false);
+    check_nargs(call, 1);
+    check_arg(call, Type::integer, 0);
+
+    // Value layouts, with one copy per CPU:
+    //   sum:   total
+    //   min:   minimum, set
+    //   max:   maximum, set
+    //   avg:   count, total
+    //   stats: count, total, minimum, maximum
+    if (call.func == "sum")
+      call.type = SizedType(Type::sum, 8);
+    else if (call.func == "min")
+      call.type = SizedType(Type::min, 16);
+    else if (call.func == "max")
+      call.type = SizedType(Type::max, 16);
+    else if (call.func == "avg")
+      call.type = SizedType(Type::avg, 16);
+    else
+      call.type = SizedType(Type::stats, 32);
+  }
+  else if (call.func == "distinct") {
+    check_assignment(call, true, false);
+    if (check_nargs(call, 1) && is_final_pass()) {
+      auto &arg = *call.vargs->at(0);
+      if (arg.type.type != Type::integer && arg.type.type != Type::string)
+        err_ << "distinct() only supports integer and string arguments ("
+             << arg.type.type << " provided)" << std::endl;
+    }
+
+    // A HyperLogLog sketch of 2^10 one byte registers, giving a standard
+    // error of about 3%
+    call.type = SizedType(Type::distinct, 1 << 10);
+  }
+  else if (call.func == "topk") {
+    check_assignment(call, true, false);
+    call.type = SizedType(Type::topk, TOPK_SKETCH_WIDTH * sizeof(uint64_t));
+    call.type.topk = 20;
+    if (check_varargs(call, 1, 2)) {
+      auto &arg = *call.vargs->at(0);
+      if (is_final_pass() && arg.type.type != Type::integer && arg.type.type != Type::string)
+        err_ << "topk() only supports integer and string arguments ("
+             << arg.type.type << " provided)" << std::endl;
+
+      if (call.vargs->size() == 2 && check_arg(call, Type::integer, 1, true)) {
+        call.type.topk = static_cast<Integer&>(*call.vargs->at(1)).n;
+        if (call.type.topk < 1 || call.type.topk > MAX_TOPK)
+          err_ << "topk() can only report between 1 and " << MAX_TOPK
+               << " elements" << std::endl;
+      }
+
+      // The elements counted make up the key of the candidates table
+      if (call.map) {
+        MapKey key;
+        key.args_.push_back({arg.type.type, arg.type.size});
+        topk_keys_[call.map->ident] = key;
+      }
+    }
+    if (call.map && call.map->vargs)
+      err_ << "topk() can only be assigned to a map without a key" << std::endl;
+  }
   else if (call.func == "delete") {
     check_assignment(call, false, false);
     if (check_nargs(call, 1)) {
       auto &arg = *call.vargs->at(0);
       if (!arg.is_map)
         err_ << "delete() expects a map to be provided" << std::endl;
+      else
+        deleted_maps_.insert(static_cast<Map&>(arg).ident);
+    }
+
+    call.type = SizedType(Type::none, 0);
+  }
+  else if (call.func == "print" || call.func == "clear") {
+    check_assignment(call, false, false);
+    if (check_nargs(call, 1)) {
+      auto &arg = *call.vargs->at(0);
+      if (!arg.is_map) {
+        err_ << call.func << "() expects a map to be provided" << std::endl;
+      }
+      else {
+        auto &map = static_cast<Map&>(arg);
+        if (map.vargs)
+          err_ << call.func << "() expects a whole map, without a key" << std::endl;
+        else if (is_final_pass() && map_val_.find(map.ident) == map_val_.end())
+          err_ << "Undefined map: " << map.ident << std::endl;
+        else
+          double_buffered_maps_.insert(map.ident);
+      }
     }
 
     call.type = SizedType(Type::none, 0);
   }
+  else if (call.func == "take") {
+    call.type = SizedType(Type::none, 0);
+    if (check_nargs(call, 1)) {
+      auto &arg = *call.vargs->at(0);
+      if (!arg.is_map) {
+        err_ << "take() expects a map to be provided" << std::endl;
+      }
+      else {
+        deleted_maps_.insert(static_cast<Map&>(arg).ident);
+        call.type = arg.type;
+      }
+    }
+  }
   else if (call.func == "str" || call.func == "sym" || call.func == "usym") {
     check_nargs(call, 1);
     check_arg(call, Type::integer, 0);
@@ -116,6 +305,14 @@ void SemanticAnalyser::visit(Call &call)
       call.type = SizedType(Type::usym, 8);
   }
   else if (call.func == "reg") {
+    for (auto &attach_point : *probe_->attach_points)
+    {
+      if (attach_point->provider == "kfunc" ||
+          attach_point->provider == "kretfunc" ||
+          attach_point->provider == "syscall")
+        err_ << "reg() can not be used with '" << attach_point->provider
+             << "' probes" << std::endl;
+    }
     if (check_nargs(call, 1)) {
       if (check_arg(call, Type::string, 0, true)) {
         auto &arg = *call.vargs->at(0);
@@ -130,8 +327,19 @@ void SemanticAnalyser::visit(Call &call)
 
     call.type = SizedType(Type::integer, 8);
   }
+  else if (call.func == "sample") {
+    if (check_nargs(call, 1) && check_arg(call, Type::integer, 0, true)) {
+      if (static_cast<Integer&>(*call.vargs->at(0)).n < 1)
+        err_ << "sample() expects a positive rate" << std::endl;
+    }
+    needs_drops_map_ = true;
+
+    call.type = SizedType(Type::integer, 8);
+  }
   else if (call.func == "printf") {
     check_assignment(call, false, false);
+    if (bpftrace_.printf_rate_ > 0)
+      needs_drops_map_ = needs_ratelimit_map_ = true;
     if (check_varargs(call, 1, 7)) {
       check_arg(call, Type::string, 0, true);
       if (is_final_pass()) {
@@ -157,6 +365,11 @@ void SemanticAnalyser::visit(Call &call)
 
 void SemanticAnalyser::visit(Map &map)
 {
+  bool is_read = !map_target_;
+  map_target_ = false;
+  if (is_read)
+    read_maps_.insert(map.ident);
+
   MapKey key;
   if (map.vargs) {
     for (Expression *expr : *map.vargs) {
@@ -180,9 +393,37 @@ void SemanticAnalyser::visit(Map &map)
     map_key_.insert({map.ident, key});
   }
 
+  // Track the range of maps indexed by a single small integer, so they can be
+  // backed by arrays instead of hash tables
+  int bound = 0;
+  if (map.vargs && map.vargs->size() == 1 &&
+      map.vargs->front()->type.type == Type::integer)
+    bound = map.vargs->front()->bound;
+  if (bound <= 0 || bound > MAX_ARRAY_MAP_ENTRIES)
+    bound = -1;
+
+  // Maps only ever indexed by the current thread can live in task storage
+  bool tid_key = map.vargs && map.vargs->size() == 1 &&
+                 map.vargs->front()->is_builtin &&
+                 static_cast<Builtin&>(*map.vargs->front()).ident == "tid";
+  if (!tid_key)
+    non_tid_maps_.insert(map.ident);
+
+  auto search_bound = map_bounds_.find(map.ident);
+  if (search_bound == map_bounds_.end())
+    map_bounds_.insert({map.ident, bound});
+  else if (search_bound->second != -1)
+    search_bound->second = bound == -1 ? -1 : std::max(search_bound->second, bound);
+
   auto search_val = map_val_.find(map.ident);
   if (search_val != map_val_.end()) {
     map.type = search_val->second;
+
+    // Aggregations made up of several values can only be printed
+    if (is_read && is_aggregation(map.type.type) && map.type.size > 8) {
+      err_ << "The value of " << map.ident << " can not be read, as it holds a "
+           << map.type << "() aggregation" << std::endl;
+    }
   }
   else {
     if (is_final_pass()) {
@@ -225,6 +466,15 @@ void SemanticAnalyser::visit(Binop &binop)
   }
 
   binop.type = SizedType(Type::integer, 8);
+
+  // "x % N" and "x & M" with a literal right-hand side are known to be small
+  if (binop.right->is_literal && binop.right->type.type == Type::integer) {
+    int n = static_cast<Integer&>(*binop.right).n;
+    if (binop.op == Parser::token::MOD && n > 0)
+      binop.bound = n;
+    else if (binop.op == Parser::token::BAND && n >= 0)
+      binop.bound = n + 1;
+  }
 }
 
 void SemanticAnalyser::visit(Unop &unop)
@@ -314,6 +564,7 @@ void SemanticAnalyser::visit(ExprStatement &expr)
 
 void SemanticAnalyser::visit(AssignMapStatement &assignment)
 {
+  map_target_ = true;
   assignment.map->accept(*this);
   assignment.expr->accept(*this);
 
@@ -334,6 +585,14 @@ void SemanticAnalyser::visit(AssignMapStatement &assignment)
       err_ << "'\n\twhen map already contains a value of type '";
       err_ << search->second << "'\n" << std::endl;
     }
+    else if (search->second.hist_min != assignment.expr->type.hist_min ||
+             search->second.hist_max != assignment.expr->type.hist_max ||
+             search->second.hist_step != assignment.expr->type.hist_step ||
+             search->second.topk != assignment.expr->type.topk) {
+      err_ << "Parameter mismatch for " << map_ident << ": ";
+      err_ << "all " << assignment.expr->type << "() calls assigned to a map ";
+      err_ << "must use the same parameters" << std::endl;
+    }
   }
   else {
     // This map hasn't been seen before
@@ -414,6 +673,12 @@ void SemanticAnalyser::visit(AttachPoint &ap)
     if (ap.func == "")
       err_ << "kprobes should be attached to a function" << std::endl;
   }
+  else if (ap.provider == "kfunc" || ap.provider == "kretfunc") {
+    if (ap.target != "")
+      err_ << "kfuncs should not have a target" << std::endl;
+    if (ap.func == "")
+      err_ << "kfuncs should be attached to a function" << std::endl;
+  }
   else if (ap.provider == "uprobe" || ap.provider == "uretprobe") {
     if (ap.target == "")
       err_ << "uprobes should have a target" << std::endl;
@@ -424,6 +689,15 @@ void SemanticAnalyser::visit(AttachPoint &ap)
     if (ap.target == "" || ap.func == "")
       err_ << "tracepoint probe must have a target" << std::endl;
   }
+  else if (ap.provider == "syscall") {
+    if (ap.target != "enter" && ap.target != "exit")
+      err_ << "syscall probe must be either 'syscall:enter' or 'syscall:exit'" << std::endl;
+    if (ap.func == "")
+      err_ << "syscall probe must name a syscall" << std::endl;
+    else if (bpftrace_.find_syscalls(ap.func).empty())
+      err_ << "No syscalls match '" << ap.func << "' on this architecture"
+           << " (" << arch::name() << ")" << std::endl;
+  }
   else if (ap.provider == "profile") {
     if (ap.target == "")
       err_ << "profile probe must have unit of time" << std::endl;
@@ -437,6 +711,17 @@ void SemanticAnalyser::visit(AttachPoint &ap)
     else if (ap.freq <= 0)
       err_ << "profile frequency should be a positive integer" << std::endl;
   }
+  else if (ap.provider == "interval") {
+    if (ap.target == "")
+      err_ << "interval probe must have unit of time" << std::endl;
+    else if (ap.target != "ms" &&
+             ap.target != "s")
+      err_ << ap.target << " is not an accepted unit of time" << std::endl;
+    if (ap.func != "")
+      err_ << "interval probe must have an integer period" << std::endl;
+    else if (ap.freq <= 0)
+      err_ << "interval period should be a positive integer" << std::endl;
+  }
   else if (ap.provider == "BEGIN" || ap.provider == "END") {
     if (ap.target != "" || ap.func != "")
       err_ << "BEGIN/END probes should not have a target" << std::endl;
@@ -464,8 +749,30 @@ void SemanticAnalyser::visit(Probe &probe)
   variable_val_.clear();
   probe_ = &probe;
 
+  int num_kfuncs = 0;
+  int num_syscall_enter = 0, num_syscall_exit = 0;
   for (AttachPoint *ap : *probe.attach_points) {
     ap->accept(*this);
+    if (ap->provider == "kfunc" || ap->provider == "kretfunc")
+      num_kfuncs++;
+    else if (ap->provider == "syscall" && ap->target == "enter")
+      num_syscall_enter++;
+    else if (ap->provider == "syscall")
+      num_syscall_exit++;
+  }
+  // kfunc and syscall programs don't see their arguments through pt_regs, so
+  // they can't share a program with other probe types
+  int num_attach_points = probe.attach_points->size();
+  if (num_kfuncs > 0 && num_kfuncs != num_attach_points) {
+    err_ << "kfunc/kretfunc probes can not be combined with other probe types" << std::endl;
+  }
+  if (num_syscall_enter + num_syscall_exit > 0 &&
+      num_syscall_enter + num_syscall_exit != num_attach_points) {
+    err_ << "syscall probes can not be combined with other probe types" << std::endl;
+  }
+  // A syscall program can't tell whether it was run on entry or exit
+  else if (num_syscall_enter > 0 && num_syscall_exit > 0) {
+    err_ << "syscall:enter and syscall:exit probes can not be combined" << std::endl;
   }
   if (probe.pred) {
     probe.pred->accept(*this);
@@ -476,6 +783,7 @@ void SemanticAnalyser::visit(Probe &probe)
 
   if (is_final_pass()) {
     bpftrace_.add_probe(probe);
+    bpftrace_.probe_names_.push_back(probe.name());
   }
 }
 
@@ -489,6 +797,19 @@ void SemanticAnalyser::visit(Program &program)
     include->accept(*this);
   for (Probe *probe : *program.probes)
     probe->accept(*this);
+
+  // Probes only see the copy of a double-buffered map that they're currently
+  // writing to, which doesn't hold anything from before the last swap
+  if (is_final_pass()) {
+    for (auto &map_ident : double_buffered_maps_) {
+      if (read_maps_.find(map_ident) != read_maps_.end())
+        err_ << map_ident << " can not be passed to print() or clear(), "
+             << "as its value is read by a probe" << std::endl;
+      else if (deleted_maps_.find(map_ident) != deleted_maps_.end())
+        err_ << map_ident << " can not be passed to print() or clear(), "
+             << "as its elements are deleted by a probe" << std::endl;
+    }
+  }
 }
 
 int SemanticAnalyser::analyse()
@@ -510,20 +831,105 @@ int SemanticAnalyser::analyse()
 
 int SemanticAnalyser::create_maps(bool debug)
 {
+  size_t zero_value_size = 0;
   for (auto &map_val : map_val_)
   {
     std::string map_name = map_val.first;
     SizedType type = map_val.second;
+    if (type.type == Type::lhist || type.type == Type::llhist ||
+        type.type == Type::distinct)
+      zero_value_size = std::max(zero_value_size, type.size);
 
     auto search_args = map_key_.find(map_name);
     if (search_args == map_key_.end())
       abort();
     auto &key = search_args->second;
 
+    enum bpf_map_type map_type = get_map_type(map_name, type, key);
+    int max_entries = get_max_entries(map_name, type, map_type);
     if (debug)
-      bpftrace_.maps_[map_name] = std::make_unique<bpftrace::FakeMap>(map_name, type, key);
+      bpftrace_.maps_[map_name] = std::make_unique<bpftrace::FakeMap>(map_name, type, key, map_type, max_entries);
     else
-      bpftrace_.maps_[map_name] = std::make_unique<bpftrace::Map>(map_name, type, key);
+      bpftrace_.maps_[map_name] = std::make_unique<bpftrace::Map>(map_name, type, key, map_type, max_entries);
+
+    // Maps passed to print() and clear() get a second copy, so userspace can
+    // read and reset one while probes write to the other. So do aggregations
+    // which are drained into userspace periodically, unless probes read them.
+    bool drained = bpftrace_.drain_interval_ms_ > 0 &&
+                   is_aggregation(type.type) && type.type != Type::topk &&
+                   read_maps_.find(map_name) == read_maps_.end() &&
+                   deleted_maps_.find(map_name) == deleted_maps_.end();
+    if (drained || double_buffered_maps_.find(map_name) != double_buffered_maps_.end())
+    {
+      bpftrace_.double_buffered_maps_.push_back(map_name);
+      if (debug)
+        bpftrace_.backbuffer_maps_[map_name] = std::make_unique<bpftrace::FakeMap>(map_name, type, key, map_type, max_entries);
+      else
+        bpftrace_.backbuffer_maps_[map_name] = std::make_unique<bpftrace::Map>(map_name, type, key, map_type, max_entries);
+    }
+
+    // topk() maps hold the rows of a count-min sketch, and keep the elements
+    // which might be the most common in a separate table. LRU eviction keeps
+    // frequent elements in it without having to compare counts.
+    if (type.type == Type::topk)
+    {
+      std::string candidates_name = map_name + "_candidates";
+      SizedType candidates_type(Type::integer, 8);
+      auto &candidates_key = topk_keys_.at(map_name);
+      int candidates_entries = type.topk * 16;
+      if (debug)
+        bpftrace_.topk_candidates_[map_name] = std::make_unique<bpftrace::FakeMap>(
+            candidates_name, candidates_type, candidates_key,
+            BPF_MAP_TYPE_LRU_HASH, candidates_entries);
+      else
+        bpftrace_.topk_candidates_[map_name] = std::make_unique<bpftrace::Map>(
+            candidates_name, candidates_type, candidates_key,
+            BPF_MAP_TYPE_LRU_HASH, candidates_entries);
+    }
+  }
+
+  // Histogram bucket arrays and HyperLogLog registers are too big to build on
+  // the BPF stack, so new entries are copied from a zeroed array map instead
+  if (zero_value_size > 0)
+  {
+    SizedType zero_type(Type::none, zero_value_size);
+    if (debug)
+      bpftrace_.zero_map_ = std::make_unique<bpftrace::FakeMap>("zero", zero_type, MapKey(), BPF_MAP_TYPE_ARRAY, 1);
+    else
+      bpftrace_.zero_map_ = std::make_unique<bpftrace::Map>("zero", zero_type, MapKey(), BPF_MAP_TYPE_ARRAY, 1);
+  }
+
+  // How many times each double-buffered map has been swapped. Probes write to
+  // its second copy while this is odd.
+  int num_double_buffered = bpftrace_.double_buffered_maps_.size();
+  if (num_double_buffered > 0)
+  {
+    SizedType generation_type(Type::integer, 8);
+    if (debug)
+      bpftrace_.generation_map_ = std::make_unique<bpftrace::FakeMap>("generation", generation_type, MapKey(), BPF_MAP_TYPE_ARRAY, num_double_buffered);
+    else
+      bpftrace_.generation_map_ = std::make_unique<bpftrace::Map>("generation", generation_type, MapKey(), BPF_MAP_TYPE_ARRAY, num_double_buffered);
+  }
+
+  // Counts of events dropped by sample() and printf() calls dropped by rate
+  // limiting, with two slots per probe
+  int num_probes = bpftrace_.probe_names_.size();
+  SizedType counter_type(Type::integer, 8);
+  if (needs_drops_map_)
+  {
+    if (debug)
+      bpftrace_.drops_map_ = std::make_unique<bpftrace::FakeMap>("drops", counter_type, MapKey(), BPF_MAP_TYPE_PERCPU_ARRAY, num_probes * 2);
+    else
+      bpftrace_.drops_map_ = std::make_unique<bpftrace::Map>("drops", counter_type, MapKey(), BPF_MAP_TYPE_PERCPU_ARRAY, num_probes * 2);
+  }
+
+  // The time at which each probe's printf() rate limit is next reached
+  if (needs_ratelimit_map_)
+  {
+    if (debug)
+      bpftrace_.ratelimit_map_ = std::make_unique<bpftrace::FakeMap>("ratelimit", counter_type, MapKey(), BPF_MAP_TYPE_PERCPU_ARRAY, num_probes);
+    else
+      bpftrace_.ratelimit_map_ = std::make_unique<bpftrace::Map>("ratelimit", counter_type, MapKey(), BPF_MAP_TYPE_PERCPU_ARRAY, num_probes);
   }
 
   if (debug)
@@ -542,6 +948,63 @@ int SemanticAnalyser::create_maps(bool debug)
   return 0;
 }
 
+enum bpf_map_type SemanticAnalyser::get_map_type(const std::string &map_name,
+    const SizedType &type, const MapKey &key) const
+{
+  bool per_cpu = is_aggregation(type.type) &&
+                 LINUX_VERSION_CODE >= KERNEL_VERSION(4, 6, 0);
+
+  // Array slots can't be removed, so maps which get deleted stay as hashes
+  bool deleted = deleted_maps_.find(map_name) != deleted_maps_.end();
+
+  // A topk() sketch is a fixed number of rows, looked up by row number
+  if (type.type == Type::topk)
+    return BPF_MAP_TYPE_PERCPU_ARRAY;
+
+  // Per-thread values, such as start timestamps, are held in the thread's own
+  // task storage. This avoids contention on a shared hash, and the kernel
+  // frees the values when threads exit. Task storage can't be printed, so
+  // this is only done for scratch values which the script deletes once
+  // they're used, not for totals kept until exit.
+  if (bpftrace_.task_storage_ && type.type == Type::integer && deleted &&
+      non_tid_maps_.find(map_name) == non_tid_maps_.end() &&
+      double_buffered_maps_.find(map_name) == double_buffered_maps_.end())
+    return BPF_MAP_TYPE_TASK_STORAGE;
+
+  // Array slots all exist, and zeroed ones are skipped as if they were
+  // missing. That's only right for aggregations where a zero value means no
+  // events: a sum() can total 0, and a value set to 0 must still be printed.
+  bool zero_is_empty = per_cpu && type.type != Type::sum && !deleted;
+
+  // Keyless aggregations don't need a hash table: their slots can be looked up
+  // by constant index
+  if (zero_is_empty && key.size() == 0)
+    return BPF_MAP_TYPE_PERCPU_ARRAY;
+
+  // Neither do aggregations which are only ever indexed by a small integer
+  if (zero_is_empty && map_bounds_.at(map_name) > 0 && type.type != Type::quantize)
+    return BPF_MAP_TYPE_PERCPU_ARRAY;
+
+  return per_cpu ? BPF_MAP_TYPE_PERCPU_HASH : BPF_MAP_TYPE_HASH;
+}
+
+int SemanticAnalyser::get_max_entries(const std::string &map_name,
+    const SizedType &type, enum bpf_map_type map_type) const
+{
+  if (map_type != BPF_MAP_TYPE_ARRAY && map_type != BPF_MAP_TYPE_PERCPU_ARRAY)
+    return 128;
+
+  if (type.type == Type::topk)
+    return TOPK_SKETCH_DEPTH;
+
+  int bound = map_bounds_.at(map_name);
+  if (bound > 0)
+    return bound;
+
+  // Keyless: a single slot, or one slot per bucket for quantize
+  return type.type == Type::quantize ? 65 : 1;
+}
+
 bool SemanticAnalyser::is_final_pass() const
 {
   return pass_ == num_passes_;
@@ -1,6 +1,7 @@
 #pragma once
 
 #include <iostream>
+#include <set>
 #include <sstream>
 
 #include "ast.h"
@@ -49,6 +50,10 @@ private:
   const int num_passes_ = 10;
 
   bool is_final_pass() const;
+  enum bpf_map_type get_map_type(const std::string &map_name,
+      const SizedType &type, const MapKey &key) const;
+  int get_max_entries(const std::string &map_name,
+      const SizedType &type, enum bpf_map_type map_type) const;
   std::string get_cast_type(Expression *expr);
 
   bool check_assignment(const Call &call, bool want_map, bool want_var);
@@ -60,7 +65,16 @@ private:
   std::map<std::string, SizedType> variable_val_;
   std::map<std::string, SizedType> map_val_;
   std::map<std::string, MapKey> map_key_;
+  std::map<std::string, MapKey> topk_keys_;
+  std::map<std::string, int> map_bounds_; // -1 if unbounded
+  std::set<std::string> deleted_maps_;
+  std::set<std::string> non_tid_maps_;
+  std::set<std::string> read_maps_;
+  std::set<std::string> double_buffered_maps_; // Passed to print() or clear()
+  bool map_target_ = false; // The next map visited is written to, not read
   bool needs_stackid_map_ = false;
+  bool needs_drops_map_ = false;
+  bool needs_ratelimit_map_ = false;
   bool has_begin_probe_ = false;
   bool has_end_probe_ = false;
 };
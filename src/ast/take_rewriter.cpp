@@ -0,0 +1,240 @@
+#include <sstream>
+
+#include "take_rewriter.h"
+#include "parser.tab.hh"
+#include "printer.h"
+
+namespace bpftrace {
+namespace ast {
+
+void TakeRewriter::visit(Integer &integer)
+{
+}
+
+void TakeRewriter::visit(String &string)
+{
+}
+
+void TakeRewriter::visit(Builtin &builtin)
+{
+  // These give a different value each time they're evaluated
+  if (builtin.ident == "nsecs" ||
+      builtin.ident == "stack" ||
+      builtin.ident == "ustack")
+    unstable_ = true;
+}
+
+void TakeRewriter::visit(Call &call)
+{
+  // Function results may depend on memory which can change, e.g. str()
+  unstable_ = true;
+
+  if (slot_ == stmt_slot_ && call.func == "delete")
+    delete_call_ = &call;
+
+  if (!call.vargs)
+    return;
+
+  if ((call.func == "delete" || call.func == "take") &&
+      call.vargs->size() == 1 && call.vargs->front()->is_map)
+  {
+    auto &map = static_cast<Map&>(*call.vargs->front());
+    if (map.ident == map_ident_)
+      writes_++;
+    if (map.vargs)
+      for (Expression *&expr : *map.vargs)
+        visit_expr(expr);
+    return;
+  }
+
+  for (Expression *&expr : *call.vargs)
+    visit_expr(expr);
+}
+
+void TakeRewriter::visit(Map &map)
+{
+  unstable_ = true;
+  if (map.ident == map_ident_)
+    reads_.push_back({ slot_, &map, conditional_ });
+
+  if (map.vargs)
+    for (Expression *&expr : *map.vargs)
+      visit_expr(expr);
+}
+
+void TakeRewriter::visit(Variable &var)
+{
+  used_vars_.insert(var.ident);
+}
+
+void TakeRewriter::visit(Binop &binop)
+{
+  visit_expr(binop.left);
+
+  // The right-hand side of && and || is only evaluated sometimes
+  bool old_conditional = conditional_;
+  if (binop.op == Parser::token::LAND || binop.op == Parser::token::LOR)
+    conditional_ = true;
+  visit_expr(binop.right);
+  conditional_ = old_conditional;
+}
+
+void TakeRewriter::visit(Unop &unop)
+{
+  // Dereferences read memory which can change
+  if (unop.op == Parser::token::MUL)
+    unstable_ = true;
+  visit_expr(unop.expr);
+}
+
+void TakeRewriter::visit(FieldAccess &acc)
+{
+  unstable_ = true;
+  visit_expr(acc.expr);
+}
+
+void TakeRewriter::visit(Cast &cast)
+{
+  visit_expr(cast.expr);
+}
+
+void TakeRewriter::visit(ExprStatement &expr)
+{
+  stmt_slot_ = &expr.expr;
+  visit_expr(expr.expr);
+}
+
+void TakeRewriter::visit(AssignMapStatement &assignment)
+{
+  visit_expr(assignment.expr);
+
+  Map &map = *assignment.map;
+  if (map.ident == map_ident_)
+    writes_++;
+  if (map.vargs)
+    for (Expression *&expr : *map.vargs)
+      visit_expr(expr);
+}
+
+void TakeRewriter::visit(AssignVarStatement &assignment)
+{
+  visit_expr(assignment.expr);
+  assigned_vars_.insert(assignment.var->ident);
+}
+
+void TakeRewriter::visit(Predicate &pred)
+{
+}
+
+void TakeRewriter::visit(AttachPoint &ap)
+{
+}
+
+void TakeRewriter::visit(Probe &probe)
+{
+  auto &stmts = *probe.stmts;
+  size_t i = 0;
+  while (i < stmts.size())
+  {
+    // Look for statements of the form: delete(@map[key])
+    reset("");
+    stmts.at(i)->accept(*this);
+    Call *call = delete_call_;
+    if (call && call->vargs && call->vargs->size() == 1 &&
+        call->vargs->front()->is_map &&
+        fuse_delete(stmts, i, static_cast<Map&>(*call->vargs->front())))
+      continue;
+    i++;
+  }
+}
+
+void TakeRewriter::visit(Include &include)
+{
+}
+
+void TakeRewriter::visit(Program &program)
+{
+  for (Probe *probe : *program.probes)
+    probe->accept(*this);
+}
+
+void TakeRewriter::rewrite()
+{
+  root_->accept(*this);
+}
+
+void TakeRewriter::reset(const std::string &map_ident)
+{
+  map_ident_ = map_ident;
+  slot_ = nullptr;
+  stmt_slot_ = nullptr;
+  conditional_ = false;
+  reads_.clear();
+  writes_ = 0;
+  unstable_ = false;
+  delete_call_ = nullptr;
+  used_vars_.clear();
+  assigned_vars_.clear();
+}
+
+void TakeRewriter::visit_expr(Expression *&expr)
+{
+  Expression **old_slot = slot_;
+  slot_ = &expr;
+  expr->accept(*this);
+  slot_ = old_slot;
+}
+
+bool TakeRewriter::fuse_delete(StatementList &stmts, size_t delete_idx, Map &map)
+{
+  // The key must evaluate to the same value at the read as at the delete
+  reset("");
+  if (map.vargs)
+    for (Expression *&expr : *map.vargs)
+      visit_expr(expr);
+  if (unstable_)
+    return false;
+  std::set<std::string> key_vars = used_vars_;
+  std::string key = key_str(map);
+
+  // Find the closest preceding statement which accesses the map
+  for (size_t i = delete_idx; i-- > 0; )
+  {
+    reset(map.ident);
+    stmts.at(i)->accept(*this);
+
+    for (auto &var : assigned_vars_)
+      if (key_vars.find(var) != key_vars.end())
+        return false;
+
+    if (reads_.empty() && writes_ == 0)
+      continue;
+
+    if (writes_ != 0 || reads_.size() != 1)
+      return false;
+
+    MapRead &read = reads_.front();
+    if (read.conditional || key_str(*read.map) != key)
+      return false;
+
+    std::string take = "take";
+    *read.slot = new Call(take, new ExpressionList({ read.map }));
+    stmts.erase(stmts.begin() + delete_idx);
+    return true;
+  }
+
+  return false;
+}
+
+std::string TakeRewriter::key_str(Map &map)
+{
+  std::ostringstream key;
+  Printer printer(key);
+  if (map.vargs)
+    for (Expression *expr : *map.vargs)
+      expr->accept(printer);
+  return key.str();
+}
+
+} // namespace ast
+} // namespace bpftrace
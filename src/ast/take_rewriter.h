@@ -0,0 +1,74 @@
+#pragma once
+
+#include <set>
+#include <string>
+#include <vector>
+
+#include "ast.h"
+
+namespace bpftrace {
+namespace ast {
+
+// Rewrites a read of a map element which is followed by a delete of the same
+// element into a single take(), e.g.
+//   @x = nsecs - @start[tid]; delete(@start[tid])
+// becomes:
+//   @x = nsecs - take(@start[tid])
+//
+// This is only done when the key is guaranteed to evaluate to the same value
+// at the delete, and nothing in between could observe the difference.
+class TakeRewriter : public Visitor {
+public:
+  explicit TakeRewriter(Node *root) : root_(root) { }
+
+  void visit(Integer &integer) override;
+  void visit(String &string) override;
+  void visit(Builtin &builtin) override;
+  void visit(Call &call) override;
+  void visit(Map &map) override;
+  void visit(Variable &var) override;
+  void visit(Binop &binop) override;
+  void visit(Unop &unop) override;
+  void visit(FieldAccess &acc) override;
+  void visit(Cast &cast) override;
+  void visit(ExprStatement &expr) override;
+  void visit(AssignMapStatement &assignment) override;
+  void visit(AssignVarStatement &assignment) override;
+  void visit(Predicate &pred) override;
+  void visit(AttachPoint &ap) override;
+  void visit(Probe &probe) override;
+  void visit(Include &include) override;
+  void visit(Program &program) override;
+
+  void rewrite();
+
+private:
+  struct MapRead
+  {
+    Expression **slot;
+    Map *map;
+    bool conditional;
+  };
+
+  Node *root_;
+
+  // Results of scanning a statement or expression for accesses to map_ident_
+  void reset(const std::string &map_ident);
+  void visit_expr(Expression *&expr);
+  std::string map_ident_;
+  Expression **slot_ = nullptr;
+  Expression **stmt_slot_ = nullptr;
+  bool conditional_ = false;
+  std::vector<MapRead> reads_;
+  int writes_ = 0;
+  bool unstable_ = false;
+  Call *delete_call_ = nullptr;
+  std::set<std::string> used_vars_;
+  std::set<std::string> assigned_vars_;
+
+  bool fuse_delete(StatementList &stmts, size_t delete_idx, Map &map);
+  static std::string key_str(Map &map);
+};
+
+} // namespace ast
+} // namespace bpftrace
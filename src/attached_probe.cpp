@@ -1,15 +1,20 @@
+#include <cerrno>
+#include <cstring>
 #include <fcntl.h>
 #include <fstream>
 #include <iostream>
 #include <regex>
+#include <sys/syscall.h>
 #include <sys/utsname.h>
 #include <tuple>
 #include <unistd.h>
 
 #include "attached_probe.h"
 #include "bcc_syms.h"
+#include "btf.h"
 #include "common.h"
 #include "libbpf.h"
+#include "map.h"
 #include <linux/perf_event.h>
 #include <linux/version.h>
 
@@ -36,7 +41,11 @@ bpf_prog_type progtype(ProbeType t)
     case ProbeType::uprobe:     return BPF_PROG_TYPE_KPROBE; break;
     case ProbeType::uretprobe:  return BPF_PROG_TYPE_KPROBE; break;
     case ProbeType::tracepoint: return BPF_PROG_TYPE_TRACEPOINT; break;
-    case ProbeType::profile:      return BPF_PROG_TYPE_PERF_EVENT; break;
+    case ProbeType::profile:    return BPF_PROG_TYPE_PERF_EVENT; break;
+    case ProbeType::interval:   return BPF_PROG_TYPE_PERF_EVENT; break;
+    case ProbeType::kfunc:      return BPF_PROG_TYPE_TRACING; break;
+    case ProbeType::kretfunc:   return BPF_PROG_TYPE_TRACING; break;
+    case ProbeType::syscall:    return BPF_PROG_TYPE_TRACEPOINT; break;
     default: abort();
   }
 }
@@ -57,11 +66,35 @@ AttachedProbe::AttachedProbe(Probe &probe, std::tuple<uint8_t *, uintptr_t> &fun
       attach_uprobe();
       break;
     case ProbeType::tracepoint:
+    case ProbeType::syscall:
       attach_tracepoint();
       break;
     case ProbeType::profile:
       attach_profile();
       break;
+    case ProbeType::interval:
+      attach_interval();
+      break;
+    case ProbeType::kfunc:
+    case ProbeType::kretfunc:
+      attach_kfunc();
+      break;
+    default:
+      abort();
+  }
+}
+
+AttachedProbe::AttachedProbe(Probe &probe, std::tuple<uint8_t *, uintptr_t> &func,
+    const std::vector<std::string> &funcs, const std::vector<uint64_t> &func_ids)
+  : probe_(probe), func_(func), funcs_(funcs), func_ids_(func_ids)
+{
+  switch (probe_.type)
+  {
+    case ProbeType::kprobe:
+    case ProbeType::kretprobe:
+      load_prog_kprobe_multi();
+      attach_kprobe_multi();
+      break;
     default:
       abort();
   }
@@ -70,6 +103,8 @@ AttachedProbe::AttachedProbe(Probe &probe, std::tuple<uint8_t *, uintptr_t> &fun
 AttachedProbe::~AttachedProbe()
 {
   close(progfd_);
+  if (link_fd_ >= 0)
+    close(link_fd_);
 
   int err = 0;
   for (int perf_event_fd : perf_event_fds_)
@@ -84,16 +119,21 @@ AttachedProbe::~AttachedProbe()
   {
     case ProbeType::kprobe:
     case ProbeType::kretprobe:
-      err = bpf_detach_kprobe(eventname().c_str());
+      if (funcs_.empty())
+        err = bpf_detach_kprobe(eventname().c_str());
       break;
     case ProbeType::uprobe:
     case ProbeType::uretprobe:
       err = bpf_detach_uprobe(eventname().c_str());
       break;
     case ProbeType::tracepoint:
+    case ProbeType::syscall:
       err = bpf_detach_tracepoint(probe_.path.c_str(), eventname().c_str());
       break;
     case ProbeType::profile:
+    case ProbeType::interval:
+    case ProbeType::kfunc:
+    case ProbeType::kretfunc:
       break;
     default:
       abort();
@@ -128,6 +168,7 @@ std::string AttachedProbe::eventname() const
       offset_str << std::hex << offset();
       return eventprefix() + sanitise(probe_.path) + "_" + offset_str.str();
     case ProbeType::tracepoint:
+    case ProbeType::syscall:
       return probe_.attach_point;
     default:
       abort();
@@ -182,10 +223,44 @@ static unsigned kernel_version(int attempt)
   }
 }
 
+static std::vector<uint8_t> patch_func_id(const std::tuple<uint8_t *, uintptr_t> &func,
+    uint64_t func_id)
+{
+  uint8_t *insns = std::get<0>(func);
+  std::vector<uint8_t> patched(insns, insns + std::get<1>(func));
+
+  auto *insn = reinterpret_cast<struct bpf_insn *>(patched.data());
+  size_t insn_cnt = patched.size() / sizeof(struct bpf_insn);
+  for (size_t i = 0; i + 1 < insn_cnt; i++)
+  {
+    if (insn[i].code != (BPF_LD | BPF_DW | BPF_IMM))
+      continue;
+
+    // ld_imm64 takes two instruction slots, with the upper half of the
+    // immediate in the second
+    if (insn[i].src_reg == FUNC_ID_PSEUDO_SRC)
+    {
+      insn[i].src_reg = 0;
+      insn[i].imm = func_id & 0xffffffff;
+      insn[i+1].imm = func_id >> 32;
+    }
+    i++;
+  }
+
+  return patched;
+}
+
 void AttachedProbe::load_prog()
 {
-  uint8_t *insns = std::get<0>(func_);
-  int prog_len = std::get<1>(func_);
+  if (probe_.type == ProbeType::kfunc || probe_.type == ProbeType::kretfunc)
+  {
+    load_prog_tracing();
+    return;
+  }
+
+  auto patched = patch_func_id(func_, probe_.func_id);
+  uint8_t *insns = patched.data();
+  int prog_len = patched.size();
   const char *license = "GPL";
   int log_level = 0;
   char *log_buf = nullptr;
@@ -217,6 +292,138 @@ void AttachedProbe::load_prog()
     throw std::runtime_error("Error loading program: " + probe_.name);
 }
 
+static int load_prog_attr(bpf_prog_type prog_type, bpf_attach_type attach_type,
+    int btf_id, const std::vector<uint8_t> &insns)
+{
+  const char *license = "GPL";
+
+  union bpf_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.prog_type = prog_type;
+  attr.expected_attach_type = attach_type;
+  attr.attach_btf_id = btf_id;
+  attr.insns = reinterpret_cast<uintptr_t>(insns.data());
+  attr.insn_cnt = insns.size() / sizeof(struct bpf_insn);
+  attr.license = reinterpret_cast<uintptr_t>(license);
+
+  return syscall(__NR_bpf, BPF_PROG_LOAD, &attr, sizeof(attr));
+}
+
+bool kprobe_multi_supported()
+{
+  static int supported = -1;
+  if (supported >= 0)
+    return supported;
+
+  // r0 = 0; exit
+  struct bpf_insn insns[] = {
+    { BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_0, 0, 0, 0 },
+    { BPF_JMP | BPF_EXIT, 0, 0, 0, 0 },
+  };
+  std::vector<uint8_t> prog(reinterpret_cast<uint8_t *>(insns),
+      reinterpret_cast<uint8_t *>(insns) + sizeof(insns));
+  int progfd = load_prog_attr(BPF_PROG_TYPE_KPROBE, BPF_TRACE_KPROBE_MULTI, 0, prog);
+  if (progfd < 0)
+  {
+    supported = 0;
+    return supported;
+  }
+
+  // Kernels with multi-kprobe support fail to find the symbol, while older
+  // ones reject the attach type outright
+  const char *sym = "bpftrace_kprobe_multi_probe_nonexistent";
+  union bpf_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.link_create.prog_fd = progfd;
+  attr.link_create.attach_type = BPF_TRACE_KPROBE_MULTI;
+  attr.link_create.kprobe_multi.syms = reinterpret_cast<uintptr_t>(&sym);
+  attr.link_create.kprobe_multi.cnt = 1;
+  int linkfd = syscall(__NR_bpf, BPF_LINK_CREATE, &attr, sizeof(attr));
+  supported = linkfd < 0 && errno == ESRCH;
+
+  if (linkfd >= 0)
+    close(linkfd);
+  close(progfd);
+  return supported;
+}
+
+bool task_storage_supported()
+{
+  static int supported = -1;
+  if (supported >= 0)
+    return supported;
+
+  supported = 0;
+  int mapfd = create_task_storage_map("task_storage", 8);
+  if (mapfd < 0)
+    return supported;
+
+  // Task storage is only usable from kprobes, tracepoints and perf events on
+  // newer kernels than those which can create the maps, so check that a
+  // kprobe program can access one:
+  //   r0 = get_current_task_btf(); r1 = map; r2 = r0; r3 = 0; r4 = 0;
+  //   task_storage_get(); r0 = 0; exit
+  struct bpf_insn insns[] = {
+    { BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_get_current_task_btf },
+    { BPF_LD | BPF_DW | BPF_IMM, BPF_REG_1, BPF_PSEUDO_MAP_FD, 0, mapfd },
+    { 0, 0, 0, 0, 0 },
+    { BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_2, BPF_REG_0, 0, 0 },
+    { BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_3, 0, 0, 0 },
+    { BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_4, 0, 0, 0 },
+    { BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_task_storage_get },
+    { BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_0, 0, 0, 0 },
+    { BPF_JMP | BPF_EXIT, 0, 0, 0, 0 },
+  };
+  std::vector<uint8_t> prog(reinterpret_cast<uint8_t *>(insns),
+      reinterpret_cast<uint8_t *>(insns) + sizeof(insns));
+  int progfd = load_prog_attr(BPF_PROG_TYPE_KPROBE, (bpf_attach_type)0, 0, prog);
+  supported = progfd >= 0;
+
+  if (progfd >= 0)
+    close(progfd);
+  close(mapfd);
+  return supported;
+}
+
+static const BTF &vmlinux_btf()
+{
+  // Parsing the kernel's BTF is relatively expensive, so only do it once
+  static const BTF btf;
+  return btf;
+}
+
+void AttachedProbe::load_prog_tracing()
+{
+  const BTF &btf = vmlinux_btf();
+  if (!btf.has_data())
+    throw std::runtime_error("Error loading program: " + probe_.name +
+        " (kernel BTF is not available)");
+
+  int btf_id = btf.find_func(probe_.attach_point);
+  if (btf_id < 0)
+    throw std::runtime_error("Error loading program: " + probe_.name +
+        " (function not found in kernel BTF)");
+
+  // Trampoline programs are verified against the BTF of the function they
+  // attach to, which older versions of bpf_prog_load() have no way of
+  // passing through, so do the load ourselves.
+  bpf_attach_type attach_type = probe_.type == ProbeType::kfunc ?
+      BPF_TRACE_FENTRY : BPF_TRACE_FEXIT;
+  progfd_ = load_prog_attr(progtype(probe_.type), attach_type, btf_id,
+      patch_func_id(func_, probe_.func_id));
+  if (progfd_ < 0)
+    throw std::runtime_error("Error loading program: " + probe_.name);
+}
+
+void AttachedProbe::load_prog_kprobe_multi()
+{
+  // Each function's ID is passed in its attach cookie instead
+  progfd_ = load_prog_attr(progtype(probe_.type), BPF_TRACE_KPROBE_MULTI, 0,
+      patch_func_id(func_, FUNC_ID_FROM_COOKIE));
+  if (progfd_ < 0)
+    throw std::runtime_error("Error loading program: " + probe_.prog_name);
+}
+
 void AttachedProbe::attach_kprobe()
 {
   int perf_event_fd = bpf_attach_kprobe(progfd_, attachtype(probe_.type),
@@ -228,6 +435,27 @@ void AttachedProbe::attach_kprobe()
   perf_event_fds_.push_back(perf_event_fd);
 }
 
+void AttachedProbe::attach_kprobe_multi()
+{
+  std::vector<const char *> syms;
+  for (auto &func : funcs_)
+    syms.push_back(func.c_str());
+
+  union bpf_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.link_create.prog_fd = progfd_;
+  attr.link_create.attach_type = BPF_TRACE_KPROBE_MULTI;
+  if (probe_.type == ProbeType::kretprobe)
+    attr.link_create.kprobe_multi.flags = BPF_F_KPROBE_MULTI_RETURN;
+  attr.link_create.kprobe_multi.syms = reinterpret_cast<uintptr_t>(syms.data());
+  attr.link_create.kprobe_multi.cookies = reinterpret_cast<uintptr_t>(func_ids_.data());
+  attr.link_create.kprobe_multi.cnt = syms.size();
+
+  link_fd_ = syscall(__NR_bpf, BPF_LINK_CREATE, &attr, sizeof(attr));
+  if (link_fd_ < 0)
+    throw std::runtime_error("Error attaching probe: " + probe_.prog_name);
+}
+
 void AttachedProbe::attach_uprobe()
 {
   int pid = -1;
@@ -296,4 +524,39 @@ void AttachedProbe::attach_profile()
   }
 }
 
+void AttachedProbe::attach_interval()
+{
+  int pid = -1;
+  int group_fd = -1;
+
+  uint64_t period;
+  if (probe_.path == "s")
+    period = probe_.freq * 1e9;
+  else if (probe_.path == "ms")
+    period = probe_.freq * 1e6;
+  else
+    abort();
+
+  // Unlike profile probes, interval probes fire once per period in total, so
+  // they only run on the first CPU
+  int cpu = ebpf::get_online_cpus().at(0);
+  int perf_event_fd = bpf_attach_perf_event(progfd_, PERF_TYPE_SOFTWARE,
+      PERF_COUNT_SW_CPU_CLOCK, period, 0, pid, cpu, group_fd);
+
+  if (perf_event_fd < 0)
+    throw std::runtime_error("Error attaching probe: " + probe_.name);
+
+  perf_event_fds_.push_back(perf_event_fd);
+}
+
+void AttachedProbe::attach_kfunc()
+{
+  // The target function was fixed when the program was loaded, so there is
+  // no tracepoint name to give here
+  link_fd_ = bpf_attach_raw_tracepoint(progfd_, nullptr);
+
+  if (link_fd_ < 0)
+    throw std::runtime_error("Error attaching probe: " + probe_.name);
+}
+
 } // namespace bpftrace
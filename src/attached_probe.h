@@ -8,11 +8,15 @@ namespace bpftrace {
 
 bpf_probe_attach_type attachtype(ProbeType t);
 bpf_prog_type progtype(ProbeType t);
+bool kprobe_multi_supported();
+bool task_storage_supported();
 
 class AttachedProbe
 {
 public:
   AttachedProbe(Probe &probe, std::tuple<uint8_t *, uintptr_t> &func);
+  AttachedProbe(Probe &probe, std::tuple<uint8_t *, uintptr_t> &func,
+      const std::vector<std::string> &funcs, const std::vector<uint64_t> &func_ids);
   ~AttachedProbe();
   AttachedProbe(const AttachedProbe &) = delete;
   AttachedProbe& operator=(const AttachedProbe &) = delete;
@@ -23,15 +27,23 @@ private:
   static std::string sanitise(const std::string &str);
   uint64_t offset() const;
   void load_prog();
+  void load_prog_tracing();
+  void load_prog_kprobe_multi();
   void attach_kprobe();
+  void attach_kprobe_multi();
   void attach_uprobe();
   void attach_tracepoint();
   void attach_profile();
+  void attach_interval();
+  void attach_kfunc();
 
   Probe &probe_;
   std::tuple<uint8_t *, uintptr_t> &func_;
+  std::vector<std::string> funcs_;
+  std::vector<uint64_t> func_ids_;
   std::vector<int> perf_event_fds_;
   int progfd_;
+  int link_fd_ = -1;
 };
 
 } // namespace bpftrace
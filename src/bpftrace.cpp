@@ -1,17 +1,26 @@
+#include <algorithm>
 #include <assert.h>
+#include <cinttypes>
+#include <chrono>
+#include <cmath>
+#include <cstring>
 #include <fstream>
-#include <iomanip>
 #include <iostream>
+#include <numeric>
 #include <regex>
 #include <sstream>
 #include <sys/epoll.h>
+#include <thread>
+#include <unistd.h>
 
 #include "bcc_syms.h"
 #include "perf_reader.h"
 
 #include "bpftrace.h"
 #include "attached_probe.h"
+#include "collector.h"
 #include "triggers.h"
+#include "arch/arch.h"
 
 namespace bpftrace {
 
@@ -41,6 +50,31 @@ int BPFtrace::add_probe(ast::Probe &p)
       special_probes_.push_back(probe);
       continue;
     }
+    else if (attach_point->provider == "syscall")
+    {
+      // All syscalls in one direction are handled by a single program on the
+      // raw_syscalls tracepoint, which filters on the syscall number itself
+      std::string tracepoint = "sys_" + attach_point->target;
+      bool attached = false;
+      for (auto &probe : probes_)
+      {
+        if (probe.type == ProbeType::syscall &&
+            probe.prog_name == p.name() &&
+            probe.attach_point == tracepoint)
+          attached = true;
+      }
+      if (attached)
+        continue;
+
+      Probe probe;
+      probe.path = "raw_syscalls";
+      probe.attach_point = tracepoint;
+      probe.type = probetype(attach_point->provider);
+      probe.prog_name = p.name();
+      probe.name = attach_point->name(attach_point->func);
+      probes_.push_back(probe);
+      continue;
+    }
 
     std::vector<std::string> attach_funcs;
     if (attach_point->func.find("*") != std::string::npos ||
@@ -52,6 +86,8 @@ int BPFtrace::add_probe(ast::Probe &p)
       {
         case ProbeType::kprobe:
         case ProbeType::kretprobe:
+        case ProbeType::kfunc:
+        case ProbeType::kretfunc:
           file_name = "/sys/kernel/debug/tracing/available_filter_functions";
           break;
         case ProbeType::tracepoint:
@@ -81,6 +117,9 @@ int BPFtrace::add_probe(ast::Probe &p)
       probe.prog_name = p.name();
       probe.name = attach_point->name(func);
       probe.freq = attach_point->freq;
+      if (probe.type == ProbeType::kprobe || probe.type == ProbeType::kretprobe ||
+          probe.type == ProbeType::kfunc || probe.type == ProbeType::kretfunc)
+        probe.func_id = func_id(func);
       probes_.push_back(probe);
     }
   }
@@ -129,6 +168,13 @@ void perf_event_printer(void *cb_cookie, void *data, int size)
   auto printf_id = *static_cast<uint64_t*>(data);
   auto arg_data = static_cast<uint8_t*>(data) + sizeof(uint64_t);
 
+  if (printf_id >= static_cast<uint64_t>(AsyncAction::print))
+  {
+    bpftrace->run_async_action(static_cast<AsyncAction>(printf_id),
+                               reinterpret_cast<uint64_t*>(arg_data));
+    return;
+  }
+
   auto fmt = std::get<0>(bpftrace->printf_args_[printf_id]).c_str();
   auto args = std::get<1>(bpftrace->printf_args_[printf_id]);
   std::vector<uint64_t> arg_values;
@@ -153,36 +199,66 @@ void perf_event_printer(void *cb_cookie, void *data, int size)
               bpftrace->resolve_usym(*(uint64_t*)arg_data).c_str()));
         arg_values.push_back((uint64_t)resolved_symbols.back().get());
         break;
+      case Type::func:
+        resolved_symbols.emplace_back(strdup(
+              bpftrace->resolve_func(*(uint64_t*)arg_data).c_str()));
+        arg_values.push_back((uint64_t)resolved_symbols.back().get());
+        break;
+      case Type::syscall:
+        resolved_symbols.emplace_back(strdup(
+              bpftrace->resolve_syscall(*(uint64_t*)arg_data).c_str()));
+        arg_values.push_back((uint64_t)resolved_symbols.back().get());
+        break;
       default:
         abort();
     }
     arg_data +=  arg.size;
   }
 
+  // Structured output gets each line of printf() output as a string
+  auto print = [&](auto... args)
+  {
+    RecordWriter *writer = bpftrace->record_writer();
+    if (!writer)
+    {
+      bpftrace->out_.printf(fmt, args...);
+      return;
+    }
+    int len = snprintf(nullptr, 0, fmt, args...);
+    if (len < 0)
+      return;
+    std::string msg(len, '\0');
+    snprintf(&msg[0], len + 1, fmt, args...);
+    writer->begin_record("printf");
+    writer->field("msg");
+    writer->value(msg);
+    writer->end_record();
+  };
+
   switch (args.size())
   {
     case 0:
-      printf(fmt);
+      print();
       break;
     case 1:
-      printf(fmt, arg_values.at(0));
+      print(arg_values.at(0));
       break;
     case 2:
-      printf(fmt, arg_values.at(0), arg_values.at(1));
+      print(arg_values.at(0), arg_values.at(1));
       break;
     case 3:
-      printf(fmt, arg_values.at(0), arg_values.at(1), arg_values.at(2));
+      print(arg_values.at(0), arg_values.at(1), arg_values.at(2));
       break;
     case 4:
-      printf(fmt, arg_values.at(0), arg_values.at(1), arg_values.at(2),
+      print(arg_values.at(0), arg_values.at(1), arg_values.at(2),
           arg_values.at(3));
       break;
     case 5:
-      printf(fmt, arg_values.at(0), arg_values.at(1), arg_values.at(2),
+      print(arg_values.at(0), arg_values.at(1), arg_values.at(2),
           arg_values.at(3), arg_values.at(4));
       break;
     case 6:
-      printf(fmt, arg_values.at(0), arg_values.at(1), arg_values.at(2),
+      print(arg_values.at(0), arg_values.at(1), arg_values.at(2),
           arg_values.at(3), arg_values.at(4), arg_values.at(5));
       break;
     default:
@@ -192,7 +268,16 @@ void perf_event_printer(void *cb_cookie, void *data, int size)
 
 void perf_event_lost(void *cb_cookie, uint64_t lost)
 {
-  printf("Lost %lu events\n", lost);
+  auto bpftrace = static_cast<BPFtrace*>(cb_cookie);
+  if (RecordWriter *writer = bpftrace->record_writer())
+  {
+    writer->begin_record("lost");
+    writer->field("count");
+    writer->value(lost);
+    writer->end_record();
+    return;
+  }
+  bpftrace->out_ << "Lost " << lost << " events\n";
 }
 
 std::unique_ptr<AttachedProbe> BPFtrace::attach_probe(Probe &probe)
@@ -207,13 +292,101 @@ std::unique_ptr<AttachedProbe> BPFtrace::attach_probe(Probe &probe)
   {
     return std::make_unique<AttachedProbe>(probe, func->second);
   }
-  catch (std::runtime_error e)
+  catch (const std::runtime_error &e)
   {
     std::cerr << e.what() << std::endl;
   }
   return nullptr;
 }
 
+std::unique_ptr<AttachedProbe> BPFtrace::attach_probe_multi(Probe &probe,
+    const std::vector<std::string> &funcs, const std::vector<uint64_t> &func_ids)
+{
+  auto func = sections_.find("s_" + probe.prog_name);
+  if (func == sections_.end())
+  {
+    std::cerr << "Code not generated for probe: " << probe.prog_name << std::endl;
+    return nullptr;
+  }
+  try
+  {
+    return std::make_unique<AttachedProbe>(probe, func->second, funcs, func_ids);
+  }
+  catch (const std::runtime_error &e)
+  {
+    // Not fatal - the caller falls back to attaching functions one at a time
+    std::cerr << "Attaching " << probe.prog_name << " with a multi-kprobe link failed ("
+              << e.what() << "), attaching its " << funcs.size()
+              << " functions one at a time" << std::endl;
+  }
+  return nullptr;
+}
+
+int BPFtrace::attach_probes()
+{
+  // On kernels with multi-kprobe links, all the kprobes sharing a program are
+  // attached with a single link instead of one tracefs event each. Group them
+  // by program, keeping the order they were added in.
+  std::vector<std::vector<Probe *>> kprobe_groups;
+
+  for (Probe &probe : probes_)
+  {
+    if (kprobe_multi_ &&
+        (probe.type == ProbeType::kprobe || probe.type == ProbeType::kretprobe))
+    {
+      auto group = std::find_if(kprobe_groups.begin(), kprobe_groups.end(),
+          [&](auto &g)
+          {
+            return g.front()->prog_name == probe.prog_name &&
+                   g.front()->type == probe.type;
+          });
+      if (group != kprobe_groups.end())
+        group->push_back(&probe);
+      else
+        kprobe_groups.push_back({ &probe });
+      continue;
+    }
+
+    auto attached_probe = attach_probe(probe);
+    if (attached_probe == nullptr)
+      return -1;
+    attached_probes_.push_back(std::move(attached_probe));
+  }
+
+  for (auto &group : kprobe_groups)
+  {
+    std::vector<std::string> funcs;
+    std::vector<uint64_t> func_ids;
+    for (Probe *probe : group)
+    {
+      if (std::find(funcs.begin(), funcs.end(), probe->attach_point) == funcs.end())
+      {
+        funcs.push_back(probe->attach_point);
+        func_ids.push_back(probe->func_id);
+      }
+    }
+
+    auto attached_probe = attach_probe_multi(*group.front(), funcs, func_ids);
+    if (attached_probe != nullptr)
+    {
+      attached_probes_.push_back(std::move(attached_probe));
+      continue;
+    }
+
+    // Some functions can be kprobed but not traced by ftrace, which
+    // multi-kprobe links rely on. Fall back to the slow path for these.
+    for (Probe *probe : group)
+    {
+      attached_probe = attach_probe(*probe);
+      if (attached_probe == nullptr)
+        return -1;
+      attached_probes_.push_back(std::move(attached_probe));
+    }
+  }
+
+  return 0;
+}
+
 int BPFtrace::run()
 {
   for (Probe &probe : special_probes_)
@@ -230,17 +403,26 @@ int BPFtrace::run()
 
   BEGIN_trigger();
 
-  for (Probe &probe : probes_)
-  {
-    auto attached_probe = attach_probe(probe);
-    if (attached_probe == nullptr)
-      return -1;
-    attached_probes_.push_back(std::move(attached_probe));
-  }
+  if (attach_probes() != 0)
+    return -1;
+
+  std::thread drainer;
+  if (drain_interval_ms_ > 0 && !double_buffered_maps_.empty())
+    drainer = std::thread(&BPFtrace::drain_maps_periodically, this);
 
   poll_perf_events(epollfd);
   attached_probes_.clear();
 
+  if (drainer.joinable())
+  {
+    {
+      std::lock_guard<std::mutex> lock(drain_mutex_);
+      stop_draining_ = true;
+    }
+    drain_cv_.notify_one();
+    drainer.join();
+  }
+
   END_trigger();
   poll_perf_events(epollfd, 100);
   special_attached_probes_.clear();
@@ -286,11 +468,33 @@ int BPFtrace::setup_perf_events()
 
 void BPFtrace::poll_perf_events(int epollfd, int timeout)
 {
+  // Pushes to a collector are made from here, between rounds of events, so
+  // that resolving symbols in keys doesn't race with printing
+  bool pushing = !push_address_.empty() && timeout < 0;
+  if (pushing)
+    next_push_ = std::chrono::steady_clock::now();
+
   auto events = std::vector<struct epoll_event>(online_cpus_);
   while (true)
   {
-    int ready = epoll_wait(epollfd, events.data(), online_cpus_, timeout);
-    if (ready <= 0)
+    int wait = timeout;
+    if (pushing)
+    {
+      auto now = std::chrono::steady_clock::now();
+      if (now >= next_push_)
+      {
+        if (connect_collector() == 0)
+        {
+          std::lock_guard<std::mutex> lock(drain_mutex_);
+          push_maps();
+        }
+        next_push_ = now + std::chrono::milliseconds(push_interval_ms_);
+      }
+      wait = std::chrono::duration_cast<std::chrono::milliseconds>(next_push_ - now).count();
+    }
+
+    int ready = epoll_wait(epollfd, events.data(), online_cpus_, wait);
+    if (ready < 0 || (ready == 0 && !pushing))
     {
       return;
     }
@@ -299,230 +503,1429 @@ void BPFtrace::poll_perf_events(int epollfd, int timeout)
     {
       perf_reader_event_read((perf_reader*)events[i].data.ptr);
     }
+
+    // Everything printed for this round of events is written out together
+    out_.flush();
   }
   return;
 }
 
 int BPFtrace::print_maps()
 {
+  // Whatever's left is pushed at the end, however many times connecting has
+  // failed before
+  int connect_err = push_address_.empty() ? 0 : connect_collector(true);
+
+  std::lock_guard<std::mutex> lock(drain_mutex_);
   for(auto &mapmap : maps_)
   {
     IMap &map = *mapmap.second.get();
-    int err;
-    if (map.type_.type == Type::quantize)
-      err = print_map_quantize(map);
-    else
-      err = print_map(map);
 
+    // Task storage can't be iterated over, and any values left in it belong
+    // to threads which didn't reach the point where they're cleared
+    if (map.map_type_ == BPF_MAP_TYPE_TASK_STORAGE)
+      continue;
+
+    // Move everything out of both copies of double-buffered maps
+    if (backbuffer_maps_.find(map.name_) != backbuffer_maps_.end())
+    {
+      if (drain_map(map.name_) || drain_map(map.name_))
+        return -1;
+    }
+
+    int err = print_map(map);
     if (err)
       return err;
   }
 
+  out_.flush();
+  if (!push_address_.empty())
+  {
+    // What's changed since the last push, with the maps now fully drained
+    int err = connect_err ? connect_err : push_maps();
+    if (push_fd_ >= 0)
+    {
+      close(push_fd_);
+      push_fd_ = -1;
+    }
+    return err;
+  }
   return 0;
 }
 
-int BPFtrace::print_map(IMap &map)
+void BPFtrace::run_async_action(AsyncAction action, const uint64_t *args)
 {
-  std::vector<uint8_t> old_key;
-  try
-  {
-    old_key = find_empty_key(map, map.key_.size());
-  }
-  catch (std::runtime_error &e)
+  const std::string &name = double_buffered_maps_.at(args[0]);
+  uint64_t run_id = args[1];
+  std::lock_guard<std::mutex> lock(drain_mutex_);
+
+  if (action == AsyncAction::print)
   {
-    std::cerr << "Error getting key for map '" << map.name_ << "': "
-              << e.what() << std::endl;
-    return -2;
+    if (drain_map(name))
+      return;
+    IMap &map = *maps_.at(name);
+    drained_[name].mark_printed(map.type_);
+    last_print_[name] = run_id;
+    print_map(map);
   }
-  auto key(old_key);
-
-  std::vector<std::pair<std::vector<uint8_t>, std::vector<uint8_t>>> values_by_key;
-
-  while (bpf_get_next_key(map.mapfd_, old_key.data(), key.data()) == 0)
+  else if (action == AsyncAction::clear)
   {
-    int value_size = map.type_.size;
-    if (map.type_.type == Type::count)
-      value_size *= ncpus_;
-    auto value = std::vector<uint8_t>(value_size);
-    int err = bpf_lookup_elem(map.mapfd_, key.data(), value.data());
-    if (err)
+    // Whatever was printed earlier in the same probe run has already been
+    // drained. Anything written since then, including what's been drained
+    // by the drainer thread or for a push, is left for the next print().
+    auto last_print = last_print_.find(name);
+    if (last_print != last_print_.end() && last_print->second == run_id)
     {
-      std::cerr << "Error looking up elem: " << err << std::endl;
-      return -1;
+      drained_[name].clear_printed();
+      return;
     }
+    if (drain_map(name))
+      return;
+    drained_[name].clear();
+  }
+  else
+  {
+    abort();
+  }
+}
 
-    values_by_key.push_back({key, value});
-
-    old_key = key;
+int BPFtrace::drain_map(const std::string &name)
+{
+  // Swap which copy of the map probes write to, then wait for the probes
+  // which might still be writing to the old copy. Nothing will touch it
+  // after that, so its entries can be moved out without losing updates.
+  uint32_t id = std::find(double_buffered_maps_.begin(),
+      double_buffered_maps_.end(), name) - double_buffered_maps_.begin();
+  uint64_t generation;
+  int err = bpf_lookup_elem(generation_map_->mapfd_, &id, &generation);
+  if (err)
+  {
+    std::cerr << "Error looking up generation of map '" << name << "': "
+              << err << std::endl;
+    return -1;
+  }
+  uint64_t next_generation = generation + 1;
+  err = bpf_update_elem(generation_map_->mapfd_, &id, &next_generation, 0);
+  if (!err)
+  {
+    if (!barrier_)
+      barrier_ = std::make_unique<ProgramBarrier>();
+    err = barrier_->wait();
+  }
+  if (err)
+  {
+    std::cerr << "Error swapping copies of map '" << name << "': " << err << std::endl;
+    return -1;
   }
 
-  if (map.type_.type == Type::count)
+  // Values are moved out with each CPU's copy already combined
+  IMap &old_map = generation % 2 ? *backbuffer_maps_.at(name) : *maps_.at(name);
+  std::vector<std::pair<std::vector<uint8_t>, std::vector<uint8_t>>> values_by_key;
+  if (old_map.is_array())
   {
-    std::sort(values_by_key.begin(), values_by_key.end(), [&](auto &a, auto &b)
+    err = read_array_map(old_map, [&](const std::vector<uint8_t> &key, const std::vector<uint8_t> &value)
     {
-      return reduce_value(a.second, ncpus_) < reduce_value(b.second, ncpus_);
+      values_by_key.push_back({key, combine_cpus(old_map.type_, value, ncpus_)});
     });
   }
   else
-  {
-    sort_by_key(map.key_.args_, values_by_key);
-  };
+    err = take_hash_map(old_map, values_by_key);
+  if (err)
+    return err;
+
+  size_t value_size = old_map.type_.size;
+  if (is_aggregation(old_map.type_.type))
+    value_size *= ncpus_;
+  auto zero = std::vector<uint8_t>(value_size);
 
+  auto &drained = drained_[name];
   for (auto &pair : values_by_key)
   {
-    auto key = pair.first;
-    auto value = pair.second;
+    auto &key = pair.first;
+    auto &value = pair.second;
 
-    std::cout << map.name_ << map.key_.argument_value_list(*this, key) << ": ";
+    // Array slots can't be removed, so they're zeroed instead
+    if (old_map.is_array())
+    {
+      uint32_t slot = *(uint64_t*)key.data();
+      err = bpf_update_elem(old_map.mapfd_, &slot, zero.data(), 0);
+      if (err)
+      {
+        std::cerr << "Error clearing elem: " << err << std::endl;
+        return -1;
+      }
+    }
 
-    if (map.type_.type == Type::stack)
-      std::cout << get_stack(*(uint32_t*)value.data(), false, 8);
-    else if (map.type_.type == Type::ustack)
-      std::cout << get_stack(*(uint32_t*)value.data(), true, 8);
-    else if (map.type_.type == Type::sym)
-      std::cout << resolve_sym(*(uintptr_t*)value.data());
-    else if (map.type_.type == Type::usym)
-      std::cout << resolve_usym(*(uintptr_t*)value.data());
-    else if (map.type_.type == Type::string)
-      std::cout << value.data() << std::endl;
-    else if (map.type_.type == Type::count)
-      std::cout << reduce_value(value, ncpus_) << std::endl;
-    else
-      std::cout << *(int64_t*)value.data() << std::endl;
+    drained.add(old_map.type_, key, std::move(value));
   }
 
-  std::cout << std::endl;
-
   return 0;
 }
 
-int BPFtrace::print_map_quantize(IMap &map)
+void BPFtrace::drain_maps_periodically()
 {
-  // A quantize-map adds an extra 8 bytes onto the end of its key for storing
-  // the bucket number.
-  // e.g. A map defined as: @x[1, 2] = @quantize(3);
-  // would actually be stored with the key: [1, 2, 3]
-
-  std::vector<uint8_t> old_key;
-  try
+  // Moving entries into userspace often enough keeps kernel maps from
+  // filling up, however many keys there are in total
+  std::unique_lock<std::mutex> lock(drain_mutex_);
+  auto interval = std::chrono::milliseconds(drain_interval_ms_);
+  while (!drain_cv_.wait_for(lock, interval, [this]() { return stop_draining_; }))
   {
-    old_key = find_empty_key(map, map.key_.size() + 8);
+    for (auto &name : double_buffered_maps_)
+    {
+      if (drain_map(name))
+        return;
+    }
   }
-  catch (std::runtime_error &e)
+}
+
+// Sums rows of words, one row per CPU. These are plain loops over contiguous
+// memory, which the compiler vectorizes.
+void BPFtrace::add_cpu_rows(const uint64_t *rows, size_t words, int ncpus, uint64_t *sums)
+{
+  if (words == 1)
   {
-    std::cerr << "Error getting key for map '" << map.name_ << "': "
-              << e.what() << std::endl;
-    return -2;
+    uint64_t sum = 0;
+    for (int cpu=0; cpu<ncpus; cpu++)
+      sum += rows[cpu];
+    *sums = sum;
+    return;
   }
-  auto key(old_key);
 
-  std::map<std::vector<uint8_t>, std::vector<uint64_t>> values_by_key;
-
-  while (bpf_get_next_key(map.mapfd_, old_key.data(), key.data()) == 0)
+  std::fill(sums, sums + words, 0);
+  for (int cpu=0; cpu<ncpus; cpu++)
   {
-    auto key_prefix = std::vector<uint8_t>(map.key_.size());
-    int bucket = key.at(map.key_.size());
-
-    for (size_t i=0; i<map.key_.size(); i++)
-      key_prefix.at(i) = key.at(i);
-
-    int value_size = map.type_.size * ncpus_;
-    auto value = std::vector<uint8_t>(value_size);
-    int err = bpf_lookup_elem(map.mapfd_, key.data(), value.data());
-    if (err)
-    {
-      std::cerr << "Error looking up elem: " << err << std::endl;
-      return -1;
-    }
-
-    if (values_by_key.find(key_prefix) == values_by_key.end())
-    {
-      // New key - create a list of buckets for it
-      values_by_key[key_prefix] = std::vector<uint64_t>(65);
-    }
-    values_by_key[key_prefix].at(bucket) = reduce_value(value, ncpus_);
-
-    old_key = key;
+    const uint64_t *row = rows + cpu * words;
+    for (size_t i=0; i<words; i++)
+      sums[i] += row[i];
   }
+}
 
-  // Sort based on sum of counts in all buckets
-  std::vector<std::pair<std::vector<uint8_t>, uint64_t>> total_counts_by_key;
-  for (auto &map_elem : values_by_key)
+void BPFtrace::add_largest(LargestEntries<size_t> &largest, MapSnapshot &snapshot,
+    int64_t sort_value, const uint8_t *key, const uint8_t *value)
+{
+  // Only elements which would be printed are copied into the snapshot, each
+  // taking over the slot of the one it displaces, so printing the top N of
+  // a map holds N elements however big the map is
+  if (!largest.accepts(sort_value))
+    return;
+
+  size_t slot;
+  if (largest.full())
   {
-    int sum = 0;
-    for (size_t i=0; i<map_elem.second.size(); i++)
-    {
-      sum += map_elem.second.at(i);
-    }
-    total_counts_by_key.push_back({map_elem.first, sum});
+    slot = largest.smallest().second;
+    snapshot.replace(slot, key, value);
   }
-  std::sort(total_counts_by_key.begin(), total_counts_by_key.end(), [&](auto &a, auto &b)
-  {
-    return a.second < b.second;
-  });
-
-  for (auto &key_count : total_counts_by_key)
+  else
   {
-    auto &key = key_count.first;
-    auto &value = values_by_key[key];
-    std::cout << map.name_ << map.key_.argument_value_list(*this, key) << ": " << std::endl;
-
-    print_quantize(value);
-
-    std::cout << std::endl;
+    slot = snapshot.size();
+    snapshot.add(key, value);
   }
-
-  return 0;
+  largest.add(sort_value, slot);
 }
 
-int BPFtrace::print_quantize(const std::vector<uint64_t> &values) const
+// Merges a single copy of an aggregation's value into another
+void BPFtrace::merge_fields(const SizedType &type, uint8_t *into, const uint8_t *from)
 {
-  int max_index = -1;
-  int max_value = 0;
-
-  for (size_t i = 0; i < values.size(); i++)
+  if (type.type == Type::distinct)
   {
-    int v = values.at(i);
-    if (v != 0)
-      max_index = i;
-    if (v > max_value)
-      max_value = v;
+    // Merging HyperLogLog sketches keeps the highest value of each register
+    for (size_t i=0; i<type.size; i++)
+      into[i] = std::max(into[i], from[i]);
+    return;
   }
 
-  if (max_index == -1)
-    return 0;
+  int64_t *a = (int64_t*)into;
+  const int64_t *b = (const int64_t*)from;
+  switch (type.type)
+  {
+    case Type::min:
+    case Type::max:
+      if (b[1] && (!a[1] ||
+          (type.type == Type::min ? b[0] < a[0] : b[0] > a[0])))
+      {
+        a[0] = b[0];
+        a[1] = 1;
+      }
+      break;
+    case Type::stats:
+      if (!b[0])
+        break;
+      if (!a[0] || b[2] < a[2])
+        a[2] = b[2];
+      if (!a[0] || b[3] > a[3])
+        a[3] = b[3];
+      a[0] += b[0];
+      a[1] += b[1];
+      break;
+    default:
+      // Counts, totals and histogram buckets
+      for (size_t i=0; i<type.size / sizeof(int64_t); i++)
+        a[i] += b[i];
+      break;
+  }
+}
 
-  for (int i = 0; i <= max_index; i++)
+void BPFtrace::combine_cpus_batch(const SizedType &type, const uint8_t *values,
+    size_t count, int ncpus, uint8_t *combined)
+{
+  // Values are read out of maps with each CPU's copy of them laid end to end,
+  // and batches of values end to end again
+  size_t value_size = type.size * ncpus;
+  for (size_t i=0; i<count; i++)
   {
-    std::ostringstream header;
-    if (i == 0)
-    {
-      header << "[0, 1]";
-    }
-    else
+    const uint8_t *value = values + i * value_size;
+    uint8_t *out = combined + i * type.size;
+    switch (type.type)
     {
-      header << "[" << quantize_index_label(i);
-      header << ", " << quantize_index_label(i+1) << ")";
+      case Type::count:
+      case Type::sum:
+      case Type::avg:
+      case Type::quantize:
+      case Type::lhist:
+      case Type::llhist:
+      case Type::topk:
+        add_cpu_rows((const uint64_t*)value, type.size / sizeof(uint64_t), ncpus,
+                     (uint64_t*)out);
+        break;
+      default:
+        std::copy(value, value + type.size, out);
+        for (int cpu=1; cpu<ncpus; cpu++)
+          merge_fields(type, out, value + cpu * type.size);
+        break;
     }
+  }
+}
 
-    int max_width = 52;
-    int bar_width = values.at(i)/(float)max_value*max_width;
-    std::string bar(bar_width, '@');
+std::vector<uint8_t> BPFtrace::combine_cpus(const SizedType &type,
+    const std::vector<uint8_t> &value, int ncpus)
+{
+  if (!is_aggregation(type.type))
+    return value;
+
+  auto combined = std::vector<uint8_t>(type.size);
+  combine_cpus_batch(type, value.data(), 1, ncpus, combined.data());
+  return combined;
+}
 
-    std::cout << std::setw(16) << std::left << header.str()
-              << std::setw(8) << std::right << values.at(i)
-              << " |" << std::setw(max_width) << std::left << bar << "|"
-              << std::endl;
+void BPFtrace::merge_value(const SizedType &type, std::vector<uint8_t> &into,
+    const std::vector<uint8_t> &from, int ncpus)
+{
+  // Aggregations are merged one CPU's copy at a time, with merge_fields() as
+  // when combining CPUs. Other values are simply replaced by the newer one.
+  if (!is_aggregation(type.type))
+  {
+    into = from;
+    return;
   }
 
+  for (int cpu=0; cpu<ncpus; cpu++)
+    merge_fields(type, into.data() + cpu * type.size, from.data() + cpu * type.size);
+}
+
+int BPFtrace::print_map(IMap &map)
+{
+  int err;
+  if (map.type_.type == Type::quantize)
+    err = print_map_quantize(map);
+  else if (map.type_.type == Type::lhist || map.type_.type == Type::llhist)
+    err = print_map_hist(map);
+  else if (map.type_.type == Type::topk)
+    err = print_map_topk(map);
+  else
+    err = print_map_values(map);
+  if (err)
+    return err;
+
+  if (!snapshot_file_.empty())
+    return write_snapshot(map);
   return 0;
 }
 
-std::string BPFtrace::quantize_index_label(int power)
+int BPFtrace::write_snapshot(IMap &map)
 {
-  char suffix = '\0';
-  if (power >= 40)
-  {
+  if (!can_snapshot(map))
+    return 0;
+
+  if (!saved_snapshot_)
+    saved_snapshot_ = std::make_unique<SnapshotFile>(snapshot_file_);
+
+  snapshot_.clear(snapshot_key_size(map), map.type_.size);
+  int err = read_map(map, [&](const std::vector<uint8_t> &key, const std::vector<uint8_t> &value)
+  {
+    snapshot_.add(key.data(), value.data());
+  });
+  if (err)
+    return err;
+
+  SnapshotMap section;
+  section.name = map.name_;
+  section.type = map.type_;
+  section.key_args = map.key_.args_;
+  section.num_elems = snapshot_.size();
+  SnapshotWriter &writer = saved_snapshot_->begin_map(section);
+  for (size_t i = 0; i < snapshot_.size(); i++)
+    writer.write_elem(snapshot_key(map, snapshot_.key(i)), snapshot_.value(i), map.type_.size);
+  return saved_snapshot_->save();
+}
+
+int BPFtrace::connect_collector(bool now)
+{
+  // Called without drain_mutex_ held, so the drainer isn't kept waiting on
+  // a collector which is slow to answer. While the collector can't be
+  // reached, connecting is retried less and less often, and only the first
+  // failure is reported, along with the last one when tracing ends.
+  if (push_fd_ >= 0)
+    return 0;
+  auto time = std::chrono::steady_clock::now();
+  if (!now && time < next_connect_)
+    return -1;
+
+  // Long enough for a collector on another host, short enough not to hold
+  // up reading events for long
+  const int connect_timeout_ms = 500;
+  push_fd_ = connect_to(push_address_, connect_timeout_ms, connect_failures_ > 0 && !now);
+  if (push_fd_ < 0)
+  {
+    int backoff = push_interval_ms_ << std::min(connect_failures_, 6);
+    next_connect_ = time + std::chrono::milliseconds(std::min(backoff, 60000));
+    connect_failures_++;
+    return -1;
+  }
+  connect_failures_ = 0;
+  // The collector may have lost what was pushed before, so start again
+  pushed_.clear();
+  return 0;
+}
+
+int BPFtrace::push_maps()
+{
+  // Called with drain_mutex_ held, once connect_collector() has connected.
+  // Values are running totals, so rather than sending differences, elements
+  // are sent whole whenever they've changed and the collector keeps the
+  // latest value from each agent.
+
+  std::ostringstream snapshot;
+  SnapshotWriter writer(snapshot);
+  std::vector<std::pair<std::string, const std::vector<uint8_t> *>> changed;
+  for (auto &mapmap : maps_)
+  {
+    IMap &map = *mapmap.second.get();
+    if (!can_snapshot(map))
+      continue;
+
+    if (backbuffer_maps_.find(map.name_) != backbuffer_maps_.end() &&
+        drain_map(map.name_))
+      return -1;
+
+    auto &pushed = pushed_[map.name_];
+    changed.clear();
+    int err = read_map(map, [&](const std::vector<uint8_t> &key, const std::vector<uint8_t> &value)
+    {
+      std::string elem_key = snapshot_key(map, key.data());
+      auto &last = pushed[elem_key];
+      if (last == value)
+        return;
+      last = value;
+      changed.emplace_back(std::move(elem_key), &last);
+    });
+    if (err)
+      return err;
+    if (changed.empty())
+      continue;
+
+    SnapshotMap section;
+    section.name = map.name_;
+    section.type = map.type_;
+    section.key_args = map.key_.args_;
+    section.num_elems = changed.size();
+    writer.write_map(section);
+    for (auto &elem : changed)
+      writer.write_elem(elem.first, elem.second->data(), map.type_.size);
+  }
+
+  static const std::string agent = [] {
+    char hostname[256] = {};
+    gethostname(hostname, sizeof(hostname) - 1);
+    return std::string(hostname) + ":" + std::to_string(getpid());
+  }();
+  if (send_message(push_fd_, agent, snapshot.str()))
+  {
+    close(push_fd_);
+    push_fd_ = -1;
+    return -1;
+  }
+  return 0;
+}
+
+std::string BPFtrace::snapshot_key(const IMap &map, const uint8_t *data)
+{
+  // See snapshot.h for how keys are laid out
+  std::string key;
+  auto append_string = [&](const std::string &s)
+  {
+    uint32_t len = s.size();
+    key.append((const char*)&len, sizeof(len));
+    key += s;
+  };
+
+  size_t offset = 0;
+  for (auto &arg : map.key_.args_)
+  {
+    const uint8_t *arg_data = data + offset;
+    offset += arg.size;
+    switch (arg.type)
+    {
+      case Type::stack:
+      case Type::ustack:
+      {
+        auto frames = get_stack_frames(*(uint32_t*)arg_data, arg.type == Type::ustack);
+        uint32_t num_frames = frames.size();
+        key.append((const char*)&num_frames, sizeof(num_frames));
+        for (auto &frame : frames)
+          append_string(frame);
+        break;
+      }
+      case Type::sym:
+        append_string(resolve_sym(*(uintptr_t*)arg_data));
+        break;
+      case Type::usym:
+        append_string(resolve_usym(*(uintptr_t*)arg_data));
+        break;
+      case Type::func:
+        append_string(resolve_func(*(uint64_t*)arg_data));
+        break;
+      case Type::syscall:
+        append_string(resolve_syscall(*(uint64_t*)arg_data));
+        break;
+      default:
+        key.append((const char*)arg_data, arg.size);
+        break;
+    }
+  }
+
+  if (map.type_.type == Type::quantize)
+    key.append((const char*)data + offset, sizeof(uint64_t));
+  return key;
+}
+
+int BPFtrace::print_drops()
+{
+  if (!drops_map_)
+    return 0;
+
+  // Two slots per probe, see CodegenLLVM::createDropCount()
+  auto value = std::vector<uint8_t>(sizeof(uint64_t) * ncpus_);
+  for (size_t probe = 0; probe < probe_names_.size(); probe++)
+  {
+    for (int kind = 0; kind < 2; kind++)
+    {
+      uint32_t slot = probe * 2 + kind;
+      int err = bpf_lookup_elem(drops_map_->mapfd_, &slot, value.data());
+      if (err)
+      {
+        std::cerr << "Error looking up elem: " << err << std::endl;
+        return -1;
+      }
+
+      uint64_t drops = reduce_value(value, ncpus_);
+      if (drops == 0)
+        continue;
+      if (RecordWriter *writer = record_writer())
+      {
+        writer->begin_record("drops");
+        writer->field("probe");
+        writer->value(probe_names_.at(probe));
+        writer->field("reason");
+        writer->value(kind == 0 ? "sample" : "rate_limit");
+        writer->field("count");
+        writer->value(drops);
+        writer->end_record();
+        continue;
+      }
+      if (kind == 0)
+        out_ << "Dropped by sample() in ";
+      else
+        out_ << "Dropped printf() calls by rate limit in ";
+      out_ << probe_names_.at(probe) << ": " << drops << '\n';
+    }
+  }
+
+  out_.flush();
+  return 0;
+}
+
+int BPFtrace::print_map_values(IMap &map)
+{
+  if (is_aggregation(map.type_.type))
+    return print_map_aggregation(map);
+
+  snapshot_.clear(snapshot_key_size(map), map.type_.size);
+  int err = read_map(map, [&](const std::vector<uint8_t> &key, const std::vector<uint8_t> &value)
+  {
+    snapshot_.add(key.data(), value.data());
+  });
+  if (err)
+    return err;
+
+  sort_by_key(map.key_.args_, snapshot_);
+
+  RecordWriter *writer = record_writer();
+  for (size_t i = 0; i < snapshot_.size(); i++)
+  {
+    const uint8_t *value = snapshot_.value(i);
+
+    if (writer)
+    {
+      begin_map_record(*writer, map.name_, map.key_, snapshot_.key(i));
+      write_value(*writer, map.type_, value);
+      writer->end_record();
+      continue;
+    }
+
+    out_ << map.name_;
+    map.key_.argument_value_list(*this, snapshot_.key(i), out_);
+    out_ << ": ";
+
+    if (map.type_.type == Type::stack)
+      out_ << get_stack(*(uint32_t*)value, false, 8);
+    else if (map.type_.type == Type::ustack)
+      out_ << get_stack(*(uint32_t*)value, true, 8);
+    else if (map.type_.type == Type::sym)
+      out_ << resolve_sym(*(uintptr_t*)value);
+    else if (map.type_.type == Type::usym)
+      out_ << resolve_usym(*(uintptr_t*)value);
+    else if (map.type_.type == Type::func)
+      out_ << resolve_func(*(uint64_t*)value) << '\n';
+    else if (map.type_.type == Type::syscall)
+      out_ << resolve_syscall(*(uint64_t*)value) << '\n';
+    else if (map.type_.type == Type::string)
+      out_ << (const char*)value << '\n';
+    else
+      out_ << *(int64_t*)value << '\n';
+  }
+
+  if (!writer)
+    out_ << '\n';
+
+  return 0;
+}
+
+int BPFtrace::print_map_aggregation(IMap &map)
+{
+  // Each value is reduced once as it's read, and only the largest are kept
+  // when there's a limit on how many to print. Values in the snapshot have
+  // each CPU's copy combined, so they hold the fields printed for stats().
+  snapshot_.clear(snapshot_key_size(map), map.type_.size);
+  LargestEntries<size_t> largest(print_top_);
+  int err = read_map(map, [&](const std::vector<uint8_t> &key, const std::vector<uint8_t> &value)
+  {
+    add_largest(largest, snapshot_, combined_value(map.type_, value.data()),
+                key.data(), value.data());
+  });
+  if (err)
+    return err;
+
+  RecordWriter *writer = record_writer();
+  for (auto &entry : largest.sorted())
+  {
+    size_t slot = entry.second;
+    const int64_t *fields = (const int64_t*)snapshot_.slot_value(slot);
+
+    if (writer)
+    {
+      begin_map_record(*writer, map.name_, map.key_, snapshot_.slot_key(slot));
+      if (map.type_.type == Type::stats)
+      {
+        writer->begin_object();
+        writer->field("count");
+        writer->value(fields[0]);
+        writer->field("average");
+        writer->value(entry.first);
+        writer->field("total");
+        writer->value(fields[1]);
+        writer->field("min");
+        writer->value(fields[2]);
+        writer->field("max");
+        writer->value(fields[3]);
+        writer->end_object();
+      }
+      else
+        writer->value(entry.first);
+      writer->end_record();
+      continue;
+    }
+
+    out_ << map.name_;
+    map.key_.argument_value_list(*this, snapshot_.slot_key(slot), out_);
+    out_ << ": ";
+
+    if (map.type_.type == Type::stats)
+    {
+      out_ << "count " << fields[0]
+           << ", average " << entry.first
+           << ", total " << fields[1]
+           << ", min " << fields[2]
+           << ", max " << fields[3] << '\n';
+    }
+    else
+      out_ << entry.first << '\n';
+  }
+
+  if (!writer)
+    out_ << '\n';
+
+  return 0;
+}
+
+int BPFtrace::read_map(IMap &map, const MapElemCallback &callback)
+{
+  // Values are given with each CPU's copy already combined, so printing
+  // only has to reduce them once. Double-buffered maps are read from what's
+  // been drained out of them, which is stored that way.
+  if (backbuffer_maps_.find(map.name_) != backbuffer_maps_.end())
+  {
+    auto drained = drained_.find(map.name_);
+    if (drained != drained_.end())
+      drained->second.read(map.type_, callback);
+    return 0;
+  }
+
+  if (!is_aggregation(map.type_.type))
+    return map.is_array() ? read_array_map(map, callback) : read_hash_map(map, callback);
+
+  auto row = std::vector<uint8_t>(map.type_.size);
+  auto combined = [&](const std::vector<uint8_t> &key, const std::vector<uint8_t> &value)
+  {
+    combine_cpus_batch(map.type_, value.data(), 1, ncpus_, row.data());
+    callback(key, row);
+  };
+  if (map.is_array())
+    return read_array_map(map, combined);
+  return read_hash_map(map, combined);
+}
+
+int BPFtrace::read_hash_map(IMap &map, const MapElemCallback &callback)
+{
+  std::vector<uint8_t> old_key;
+  try
+  {
+    old_key = find_empty_key(map, hash_key_size(map));
+  }
+  catch (std::runtime_error &e)
+  {
+    std::cerr << "Error getting key for map '" << map.name_ << "': "
+              << e.what() << std::endl;
+    return -2;
+  }
+  auto key(old_key);
+
+  // The key and value are reused for every element
+  int value_size = map.type_.size;
+  if (is_aggregation(map.type_.type))
+    value_size *= ncpus_;
+  auto value = std::vector<uint8_t>(value_size);
+
+  while (bpf_get_next_key(map.mapfd_, old_key.data(), key.data()) == 0)
+  {
+    int err = bpf_lookup_elem(map.mapfd_, key.data(), value.data());
+    if (err)
+    {
+      std::cerr << "Error looking up elem: " << err << std::endl;
+      return -1;
+    }
+
+    callback(key, value);
+
+    old_key = key;
+  }
+
+  return 0;
+}
+
+int BPFtrace::take_hash_map(IMap &map,
+    std::vector<std::pair<std::vector<uint8_t>, std::vector<uint8_t>>> &values_by_key)
+{
+  // Read and delete a whole batch of elements per syscall, on kernels which
+  // support it (Linux 5.6+). A batch the size of the map can't be too small
+  // for any of the hash table's buckets.
+  size_t key_size = hash_key_size(map);
+  size_t value_size = map.type_.size;
+  if (is_aggregation(map.type_.type))
+    value_size *= ncpus_;
+  uint32_t batch_size = map.max_entries_;
+  std::vector<uint8_t> keys(key_size * batch_size);
+  std::vector<uint8_t> values(value_size * batch_size);
+  std::vector<uint8_t> combined(map.type_.size * batch_size);
+
+  uint32_t in_batch, out_batch;
+  bool first = true;
+  while (true)
+  {
+    uint32_t count = batch_size;
+    int err = bpf_lookup_and_delete_batch(map.mapfd_, first ? nullptr : &in_batch,
+        &out_batch, keys.data(), values.data(), &count);
+    if (err && errno != ENOENT)
+    {
+      if (!first)
+      {
+        std::cerr << "Error draining map '" << map.name_ << "': "
+                  << strerror(errno) << std::endl;
+        return -1;
+      }
+      break;
+    }
+
+    // Each CPU's copy of the whole batch of values is combined at once
+    if (is_aggregation(map.type_.type))
+      combine_cpus_batch(map.type_, values.data(), count, ncpus_, combined.data());
+    else
+      std::copy(values.begin(), values.begin() + count * value_size, combined.begin());
+
+    for (uint32_t i = 0; i < count; i++)
+    {
+      values_by_key.push_back({
+          std::vector<uint8_t>(&keys.at(i * key_size), &keys.at(i * key_size) + key_size),
+          std::vector<uint8_t>(&combined.at(i * map.type_.size),
+                               &combined.at(i * map.type_.size) + map.type_.size)});
+    }
+
+    // ENOENT means there's nothing left
+    if (err)
+      return 0;
+    in_batch = out_batch;
+    first = false;
+  }
+
+  // Otherwise fall back to one element at a time
+  int err = read_hash_map(map, [&](const std::vector<uint8_t> &key, const std::vector<uint8_t> &value)
+  {
+    values_by_key.push_back({key, combine_cpus(map.type_, value, ncpus_)});
+  });
+  if (err)
+    return err;
+  for (auto &pair : values_by_key)
+  {
+    err = bpf_delete_elem(map.mapfd_, pair.first.data());
+    if (err)
+    {
+      std::cerr << "Error deleting elem: " << err << std::endl;
+      return -1;
+    }
+  }
+  return 0;
+}
+
+int BPFtrace::read_array_map(IMap &map, const MapElemCallback &callback)
+{
+  // Aggregations indexed by a single bounded integer are stored as arrays.
+  // Every slot exists, so zeroed slots, which no events have been counted in,
+  // are skipped as they would be missing from a hash.
+  int value_size = map.type_.size;
+  if (is_aggregation(map.type_.type))
+    value_size *= ncpus_;
+  auto value = std::vector<uint8_t>(value_size);
+  auto key = std::vector<uint8_t>(sizeof(uint64_t));
+
+  for (uint32_t i = 0; i < (uint32_t)map.max_entries_; i++)
+  {
+    int err = bpf_lookup_elem(map.mapfd_, &i, value.data());
+    if (err)
+    {
+      std::cerr << "Error looking up elem: " << err << std::endl;
+      return -1;
+    }
+
+    if (std::all_of(value.begin(), value.end(), [](uint8_t b) { return b == 0; }))
+      continue;
+
+    // Slots are given as 8 byte keys. For keyless quantize maps, this is the
+    // bucket number which other quantize maps have at the end of their keys.
+    *(uint64_t*)key.data() = i;
+    callback(key, value);
+  }
+
+  return 0;
+}
+
+int BPFtrace::print_map_quantize(IMap &map)
+{
+  // Each key's buckets are stored as separate elements, with the bucket
+  // number at the end of the key. Sorting by the rest of the key brings each
+  // key's buckets together.
+  size_t key_size = map.key_.size();
+  snapshot_.clear(snapshot_key_size(map), map.type_.size);
+  int err = read_map(map, [&](const std::vector<uint8_t> &key, const std::vector<uint8_t> &value)
+  {
+    snapshot_.add(key.data(), value.data());
+  });
+  if (err)
+    return err;
+
+  snapshot_.sort([&](size_t a, size_t b)
+  {
+    return std::memcmp(snapshot_.slot_key(a), snapshot_.slot_key(b), key_size) < 0;
+  });
+
+  // Sort based on sum of counts in all buckets
+  std::vector<uint64_t> buckets(65);
+  buckets_snapshot_.clear(key_size, buckets.size() * sizeof(uint64_t));
+  LargestEntries<size_t> largest(print_top_);
+  for (size_t i = 0; i < snapshot_.size(); )
+  {
+    const uint8_t *key = snapshot_.key(i);
+    std::fill(buckets.begin(), buckets.end(), 0);
+    uint64_t total = 0;
+    for (; i < snapshot_.size() && std::memcmp(snapshot_.key(i), key, key_size) == 0; i++)
+    {
+      int bucket = snapshot_.key(i)[key_size];
+      buckets.at(bucket) = *(const uint64_t*)snapshot_.value(i);
+      total += buckets.at(bucket);
+    }
+
+    add_largest(largest, buckets_snapshot_, total, key, (const uint8_t*)buckets.data());
+  }
+
+  RecordWriter *writer = record_writer();
+  for (auto &entry : largest.sorted())
+  {
+    size_t slot = entry.second;
+    const uint64_t *counts = (const uint64_t*)buckets_snapshot_.slot_value(slot);
+
+    if (writer)
+    {
+      begin_map_record(*writer, map.name_, map.key_, buckets_snapshot_.slot_key(slot));
+      write_hist(*writer, counts, buckets.size(), map.type_);
+      writer->end_record();
+      continue;
+    }
+
+    out_ << map.name_;
+    map.key_.argument_value_list(*this, buckets_snapshot_.slot_key(slot), out_);
+    out_ << ": \n";
+
+    print_hist(std::vector<uint64_t>(counts, counts + buckets.size()), map.type_);
+
+    out_ << '\n';
+  }
+
+  return 0;
+}
+
+int BPFtrace::print_map_hist(IMap &map)
+{
+  // lhist and llhist maps hold an array of buckets for each key. Sort based
+  // on sum of counts in all buckets.
+  size_t num_buckets = map.type_.size / sizeof(uint64_t);
+  snapshot_.clear(snapshot_key_size(map), map.type_.size);
+  LargestEntries<size_t> largest(print_top_);
+  int err = read_map(map, [&](const std::vector<uint8_t> &key, const std::vector<uint8_t> &value)
+  {
+    const uint64_t *counts = (const uint64_t*)value.data();
+    int64_t total = std::accumulate(counts, counts + num_buckets, (uint64_t)0);
+    add_largest(largest, snapshot_, total, key.data(), value.data());
+  });
+  if (err)
+    return err;
+
+  RecordWriter *writer = record_writer();
+  for (auto &entry : largest.sorted())
+  {
+    size_t slot = entry.second;
+    const uint64_t *counts = (const uint64_t*)snapshot_.slot_value(slot);
+
+    if (writer)
+    {
+      begin_map_record(*writer, map.name_, map.key_, snapshot_.slot_key(slot));
+      write_hist(*writer, counts, num_buckets, map.type_);
+      writer->end_record();
+      continue;
+    }
+
+    out_ << map.name_;
+    map.key_.argument_value_list(*this, snapshot_.slot_key(slot), out_);
+    out_ << ": \n";
+
+    print_hist(std::vector<uint64_t>(counts, counts + num_buckets), map.type_);
+
+    out_ << '\n';
+  }
+
+  return 0;
+}
+
+int BPFtrace::print_map_topk(IMap &map)
+{
+  // Sum each CPU's copy of the count-min sketch's rows. Rows which are all
+  // zero aren't read.
+  std::vector<std::vector<uint64_t>> rows(TOPK_SKETCH_DEPTH,
+      std::vector<uint64_t>(map.type_.size / sizeof(uint64_t)));
+  int err = read_map(map, [&](const std::vector<uint8_t> &key, const std::vector<uint8_t> &value)
+  {
+    rows.at(*(uint64_t*)key.data()) = reduce_hist(map.type_, value, 1);
+  });
+  if (err)
+    return err;
+
+  uint64_t total = std::accumulate(rows.at(0).begin(), rows.at(0).end(), (uint64_t)0);
+  if (total == 0)
+    return 0;
+
+  IMap &candidates = *topk_candidates_.at(map.name_);
+  // Keep the most common elements, printed with the largest last.
+  // Candidates can outlive their counts when the map is cleared.
+  LargestEntries<std::vector<uint8_t>> largest(map.type_.topk);
+  err = read_hash_map(candidates, [&](const std::vector<uint8_t> &key, const std::vector<uint8_t> &)
+  {
+    uint64_t estimate = topk_estimate(rows, key);
+    if (estimate > 0)
+      largest.add(estimate, key);
+  });
+  if (err)
+    return err;
+
+  // Every count is at least the true count, and at most this much higher
+  // with probability 1 - e^-depth
+  uint64_t error = std::ceil(M_E / TOPK_SKETCH_WIDTH * total);
+
+  auto counts_by_key = largest.sorted();
+  if (RecordWriter *writer = record_writer())
+  {
+    for (auto &pair : counts_by_key)
+    {
+      begin_map_record(*writer, map.name_, candidates.key_, pair.second.data());
+      writer->value(pair.first);
+      writer->end_record();
+    }
+    writer->begin_record("topk");
+    writer->field("map");
+    writer->value(map.name_);
+    writer->field("total");
+    writer->value(total);
+    writer->field("error");
+    writer->value(error);
+    writer->end_record();
+    return 0;
+  }
+
+  for (auto &pair : counts_by_key)
+  {
+    out_ << map.name_;
+    candidates.key_.argument_value_list(*this, pair.second.data(), out_);
+    out_ << ": " << pair.first << '\n';
+  }
+
+  out_ << map.name_ << ": top " << (uint64_t)counts_by_key.size() << " of " << total
+       << ", counts may be up to " << error << " too high ("
+       << (int64_t)std::lround(100 * (1 - std::exp(-TOPK_SKETCH_DEPTH)))
+       << "% confidence)\n";
+
+  out_ << '\n';
+
+  return 0;
+}
+
+uint64_t BPFtrace::topk_estimate(const std::vector<std::vector<uint64_t>> &rows,
+    const std::vector<uint8_t> &element)
+{
+  // The same columns as CodegenLLVM::visit(Call) counts the element in. Other
+  // elements may share any of them, so the smallest count is the closest.
+  uint64_t hash = hash_value(element);
+  uint64_t hash1 = hash & 0xffffffff;
+  uint64_t hash2 = (hash >> 32) | 1;
+  uint64_t estimate = UINT64_MAX;
+  for (size_t row = 0; row < rows.size(); row++)
+  {
+    auto &counts = rows.at(row);
+    uint64_t column = (hash1 + hash2 * row) & (counts.size() - 1);
+    estimate = std::min(estimate, counts.at(column));
+  }
+  return estimate;
+}
+
+uint64_t BPFtrace::hash_value(const std::vector<uint8_t> &value)
+{
+  // Must match CodegenLLVM::getHash()
+  // Values hashed by probes are always a whole number of words. Anything
+  // left over is mixed in as one more word.
+  uint64_t hash = 0x9e3779b97f4a7c15ULL;
+  for (size_t i = 0; i < value.size(); i += sizeof(uint64_t))
+  {
+    uint64_t word = 0;
+    memcpy(&word, value.data() + i, std::min(sizeof(word), value.size() - i));
+    hash ^= word;
+    hash = (hash ^ (hash >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    hash = (hash ^ (hash >> 27)) * 0x94d049bb133111ebULL;
+    hash = hash ^ (hash >> 31);
+  }
+  return hash;
+}
+
+size_t MapKeyHash::operator()(const std::vector<uint8_t> &key) const
+{
+  return BPFtrace::hash_value(key);
+}
+
+void DrainedEntries::merge(const SizedType &type, Entries &into,
+    const std::vector<uint8_t> &key, std::vector<uint8_t> value)
+{
+  auto search = into.find(key);
+  if (search == into.end())
+    into.emplace(key, std::move(value));
+  else
+    BPFtrace::merge_value(type, search->second, value, 1);
+}
+
+void DrainedEntries::add(const SizedType &type, const std::vector<uint8_t> &key,
+    std::vector<uint8_t> value)
+{
+  merge(type, since_print_, key, std::move(value));
+}
+
+void DrainedEntries::mark_printed(const SizedType &type)
+{
+  for (auto &pair : since_print_)
+    merge(type, printed_, pair.first, std::move(pair.second));
+  since_print_.clear();
+}
+
+void DrainedEntries::clear()
+{
+  printed_.clear();
+  since_print_.clear();
+}
+
+void DrainedEntries::read(const SizedType &type, const MapElemCallback &callback) const
+{
+  std::vector<uint8_t> total;
+  for (auto &pair : printed_)
+  {
+    auto since = since_print_.find(pair.first);
+    if (since == since_print_.end())
+    {
+      callback(pair.first, pair.second);
+      continue;
+    }
+    total = pair.second;
+    BPFtrace::merge_value(type, total, since->second, 1);
+    callback(pair.first, total);
+  }
+  for (auto &pair : since_print_)
+  {
+    if (printed_.find(pair.first) == printed_.end())
+      callback(pair.first, pair.second);
+  }
+}
+
+RecordWriter *BPFtrace::record_writer()
+{
+  if (output_format_ == OutputFormat::text)
+    return nullptr;
+  if (!writer_)
+  {
+    if (output_format_ == OutputFormat::json)
+      writer_ = std::make_unique<JsonWriter>(out_);
+    else
+      writer_ = std::make_unique<BinaryWriter>(out_);
+  }
+  return writer_.get();
+}
+
+void BPFtrace::begin_map_record(RecordWriter &writer, const std::string &name,
+    const MapKey &key, const uint8_t *data)
+{
+  // Map elements are written one record each, so big maps are streamed
+  // rather than built up as a single document
+  writer.begin_record("map");
+  writer.field("map");
+  writer.value(name);
+  writer.field("key");
+  writer.begin_list();
+  size_t offset = 0;
+  for (auto &arg : key.args_)
+  {
+    write_value(writer, arg, data + offset);
+    offset += arg.size;
+  }
+  writer.end_list();
+  writer.field("value");
+}
+
+void BPFtrace::write_value(RecordWriter &writer, const SizedType &type, const uint8_t *data)
+{
+  switch (type.type)
+  {
+    case Type::integer:
+      switch (type.size)
+      {
+        case 8:
+          writer.value(*(int64_t*)data);
+          return;
+        case 4:
+          writer.value((int64_t)*(int32_t*)data);
+          return;
+        case 2:
+          writer.value((int64_t)*(int16_t*)data);
+          return;
+        case 1:
+          writer.value((int64_t)*(int8_t*)data);
+          return;
+      }
+      break;
+    case Type::string:
+      writer.value(std::string((const char*)data, strnlen((const char*)data, type.size)));
+      return;
+    case Type::stack:
+    case Type::ustack:
+      // Stacks are lists of frames, innermost first
+      writer.begin_list();
+      for (auto &frame : get_stack_frames(*(uint32_t*)data, type.type == Type::ustack))
+        writer.value(frame);
+      writer.end_list();
+      return;
+    case Type::sym:
+      writer.value(resolve_sym(*(uintptr_t*)data));
+      return;
+    case Type::usym:
+      writer.value(resolve_usym(*(uintptr_t*)data));
+      return;
+    case Type::func:
+      writer.value(resolve_func(*(uint64_t*)data));
+      return;
+    case Type::syscall:
+      writer.value(resolve_syscall(*(uint64_t*)data));
+      return;
+    default:
+      break;
+  }
+  abort();
+}
+
+void BPFtrace::write_hist(RecordWriter &writer, const uint64_t *counts,
+    size_t num_buckets, const SizedType &type)
+{
+  // Histograms are lists of their non-empty buckets, each holding values
+  // from min up to but not including max. lhist's buckets for values
+  // outside of its range are only bounded on one side.
+  writer.begin_list();
+  for (size_t i = 0; i < num_buckets; i++)
+  {
+    if (counts[i] == 0)
+      continue;
+
+    auto range = hist_bucket_range(type, i);
+    bool below = type.type == Type::lhist && i == 0;
+    bool above = type.type == Type::lhist && i == num_buckets - 1;
+    writer.begin_object();
+    if (!below)
+    {
+      writer.field("min");
+      writer.value((int64_t)range.first);
+    }
+    if (!above)
+    {
+      writer.field("max");
+      writer.value((int64_t)range.second);
+    }
+    writer.field("count");
+    writer.value(counts[i]);
+    writer.end_object();
+  }
+  writer.end_list();
+}
+
+int BPFtrace::print_hist(const std::vector<uint64_t> &values, const SizedType &type)
+{
+  if (hist_output_ != HistOutput::summary)
+    print_hist_bars(values, type);
+  if (hist_output_ != HistOutput::bars)
+    print_hist_summary(values, type);
+  return 0;
+}
+
+void BPFtrace::print_hist_bars(const std::vector<uint64_t> &values, const SizedType &type)
+{
+  int min_index = -1;
+  int max_index = -1;
+  uint64_t max_value = 0;
+
+  for (size_t i = 0; i < values.size(); i++)
+  {
+    uint64_t v = values.at(i);
+    if (v != 0)
+    {
+      if (min_index == -1)
+        min_index = i;
+      max_index = i;
+    }
+    if (v > max_value)
+      max_value = v;
+  }
+
+  // quantize always starts from its first bucket
+  if (max_index == -1)
+    return;
+  if (type.type == Type::quantize)
+    min_index = 0;
+
+  std::vector<std::string> headers;
+  size_t header_width = 16;
+  for (int i = min_index; i <= max_index; i++)
+  {
+    headers.push_back(hist_bucket_label(type, i));
+    header_width = std::max(header_width, headers.back().size() + 1);
+  }
+
+  for (int i = min_index; i <= max_index; i++)
+  {
+    int max_width = 52;
+    int bar_width = values.at(i)/(float)max_value*max_width;
+    auto &header = headers.at(i - min_index);
+    out_.printf("%-*s%8" PRIu64 " |", (int)header_width, header.c_str(), values.at(i));
+    out_.fill('@', bar_width);
+    out_.fill(' ', max_width - bar_width);
+    out_ << "|\n";
+  }
+}
+
+void BPFtrace::print_hist_summary(const std::vector<uint64_t> &values, const SizedType &type)
+{
+  uint64_t count = std::accumulate(values.begin(), values.end(), (uint64_t)0);
+  if (count == 0)
+    return;
+
+  out_ << "count " << count
+       << ", mean " << (int64_t)std::llround(hist_mean(values, type));
+  for (double p : { 50.0, 90.0, 99.0, 99.9 })
+    out_ << ", p" << p << " " << (int64_t)std::llround(hist_percentile(values, type, p));
+  out_ << '\n';
+}
+
+std::vector<uint64_t> BPFtrace::reduce_hist(const SizedType &type,
+    const std::vector<uint8_t> &value, int ncpus)
+{
+  // Each CPU has its own copy of the bucket array
+  std::vector<uint64_t> buckets(type.size / sizeof(uint64_t));
+  add_cpu_rows((const uint64_t*)value.data(), buckets.size(), ncpus, buckets.data());
+  return buckets;
+}
+
+std::string BPFtrace::hist_bucket_label(const SizedType &type, int bucket)
+{
+  // The inverse of CodegenLLVM::getHistBucket()
+  int last = type.size / sizeof(uint64_t) - 1;
+  std::ostringstream label;
+  if (type.type == Type::quantize)
+  {
+    if (bucket == 0)
+      label << "[0, 1]";
+    else
+      label << "[" << quantize_index_label(bucket) << ", "
+            << quantize_index_label(bucket+1) << ")";
+  }
+  else if (type.type == Type::lhist)
+  {
+    if (bucket == 0)
+      label << "(..., " << type.hist_min << ")";
+    else if (bucket == last)
+      label << "[" << type.hist_max << ", ...)";
+    else
+    {
+      int64_t low = type.hist_min + (bucket - 1) * type.hist_step;
+      label << "[" << low << ", " << low + type.hist_step << ")";
+    }
+  }
+  else
+  {
+    int64_t sub_buckets = type.hist_step;
+    if (bucket == 0)
+    {
+      label << "(..., 1)";
+    }
+    else
+    {
+      int shift = std::max(bucket / sub_buckets - 1, (int64_t)0);
+      uint64_t sub_bucket = bucket - shift * sub_buckets;
+      label << "[" << (sub_bucket << shift) << ", "
+            << ((sub_bucket + 1) << shift) << ")";
+    }
+  }
+  return label.str();
+}
+
+std::pair<double, double> BPFtrace::hist_bucket_range(const SizedType &type, int bucket)
+{
+  // Buckets which are open at one end, holding values beyond the range of the
+  // histogram, are treated as if their values were all at its edge
+  int last = type.size / sizeof(uint64_t) - 1;
+  if (type.type == Type::quantize)
+  {
+    if (bucket == 0)
+      return { 0, 2 };
+    return { std::ldexp(1, bucket), std::ldexp(1, bucket + 1) };
+  }
+  else if (type.type == Type::lhist)
+  {
+    if (bucket == 0)
+      return { type.hist_min, type.hist_min };
+    if (bucket == last)
+      return { type.hist_max, type.hist_max };
+    double low = type.hist_min + (bucket - 1) * type.hist_step;
+    return { low, low + type.hist_step };
+  }
+  else
+  {
+    if (bucket == 0)
+      return { 0, 1 };
+    int shift = std::max(bucket / type.hist_step - 1, (int64_t)0);
+    double sub_bucket = bucket - shift * type.hist_step;
+    return { std::ldexp(sub_bucket, shift), std::ldexp(sub_bucket + 1, shift) };
+  }
+}
+
+double BPFtrace::hist_percentile(const std::vector<uint64_t> &values,
+    const SizedType &type, double percentile)
+{
+  // Find the bucket holding the value at this rank, then assume its values
+  // are spread evenly across it
+  uint64_t count = std::accumulate(values.begin(), values.end(), (uint64_t)0);
+  double rank = percentile / 100 * count;
+  uint64_t below = 0;
+  for (size_t i = 0; i < values.size(); i++)
+  {
+    if (values.at(i) == 0)
+      continue;
+    if (below + values.at(i) >= rank)
+    {
+      auto range = hist_bucket_range(type, i);
+      double fraction = (rank - below) / values.at(i);
+      return range.first + fraction * (range.second - range.first);
+    }
+    below += values.at(i);
+  }
+  return 0;
+}
+
+double BPFtrace::hist_mean(const std::vector<uint64_t> &values, const SizedType &type)
+{
+  // Each bucket's values are counted at its midpoint
+  uint64_t count = 0;
+  double total = 0;
+  for (size_t i = 0; i < values.size(); i++)
+  {
+    if (values.at(i) == 0)
+      continue;
+    auto range = hist_bucket_range(type, i);
+    total += values.at(i) * (range.first + range.second) / 2;
+    count += values.at(i);
+  }
+  return count ? total / count : 0;
+}
+
+std::string BPFtrace::quantize_index_label(int power)
+{
+  char suffix = '\0';
+  if (power >= 40)
+  {
     suffix = 'T';
     power -= 40;
   }
@@ -551,12 +1954,91 @@ std::string BPFtrace::quantize_index_label(int power)
 
 uint64_t BPFtrace::reduce_value(const std::vector<uint8_t> &value, int ncpus)
 {
-  uint64_t sum = 0;
-  for (int i=0; i<ncpus; i++)
+  uint64_t sum;
+  add_cpu_rows((const uint64_t*)value.data(), 1, ncpus, &sum);
+  return sum;
+}
+
+int64_t BPFtrace::aggregation_value(Type type, const int64_t *fields)
+{
+  switch (type)
   {
-    sum += *(uint64_t*)(value.data() + i*sizeof(uint64_t*));
+    case Type::count:
+    case Type::sum:
+    case Type::min:
+    case Type::max:
+    case Type::distinct:
+      return fields[0];
+    case Type::avg:
+    case Type::stats:
+      return fields[0] ? fields[1] / fields[0] : 0;
+    default:
+      abort();
   }
-  return sum;
+}
+
+int64_t BPFtrace::combined_value(const SizedType &type, const uint8_t *value)
+{
+  // Once each CPU's copy has been combined, a value is a single copy of the
+  // aggregation's fields, or distinct()'s registers
+  if (type.type == Type::distinct)
+    return hll_estimate(value, type.size);
+  return aggregation_value(type.type, (const int64_t*)value);
+}
+
+uint64_t BPFtrace::hll_estimate(const uint8_t *registers, size_t num_registers)
+{
+  // The raw HyperLogLog estimate is the normalised harmonic mean of 2^rank
+  // over all registers. It's biased high for small cardinalities, where
+  // counting the empty registers is more accurate (linear counting). The hash
+  // is 64 bits, so no correction is needed for large cardinalities.
+  double m = num_registers;
+  double alpha = 0.7213 / (1 + 1.079 / m);
+  double sum = 0;
+  int empty = 0;
+  for (size_t i = 0; i < num_registers; i++)
+  {
+    uint8_t rank = registers[i];
+    sum += std::ldexp(1, -rank);
+    if (rank == 0)
+      empty++;
+  }
+
+  double estimate = alpha * m * m / sum;
+  if (estimate <= 2.5 * m && empty > 0)
+    estimate = m * std::log(m / empty);
+  return std::llround(estimate);
+}
+
+size_t BPFtrace::hash_key_size(const IMap &map)
+{
+  // A quantize-map adds an extra 8 bytes onto the end of its key for storing
+  // the bucket number.
+  // e.g. A map defined as: @x[1, 2] = @quantize(3);
+  // would actually be stored with the key: [1, 2, 3]
+  size_t key_size = map.key_.size();
+  if (map.type_.type == Type::quantize)
+    key_size += 8;
+
+  // Keyless hash maps use a single 8 byte key
+  return key_size == 0 ? 8 : key_size;
+}
+
+size_t BPFtrace::snapshot_key_size(const IMap &map)
+{
+  // Array slots are given as 8 byte keys by read_array_map()
+  return map.is_array() ? sizeof(uint64_t) : hash_key_size(map);
+}
+
+bool BPFtrace::can_snapshot(const IMap &map)
+{
+  // topk() maps are sketches rather than elements, and values like stacks
+  // only mean anything on the host they were recorded on. Task storage
+  // can't be iterated over.
+  if (map.map_type_ == BPF_MAP_TYPE_TASK_STORAGE || map.type_.type == Type::topk)
+    return false;
+  return is_aggregation(map.type_.type) ||
+         map.type_.type == Type::integer || map.type_.type == Type::string;
 }
 
 std::vector<uint8_t> BPFtrace::find_empty_key(IMap &map, size_t size) const
@@ -564,7 +2046,7 @@ std::vector<uint8_t> BPFtrace::find_empty_key(IMap &map, size_t size) const
   if (size == 0) size = 8;
   auto key = std::vector<uint8_t>(size);
   int value_size = map.type_.size;
-  if (map.type_.type == Type::count || map.type_.type == Type::quantize)
+  if (is_aggregation(map.type_.type))
     value_size *= ncpus_;
   auto value = std::vector<uint8_t>(value_size);
 
@@ -583,30 +2065,38 @@ std::vector<uint8_t> BPFtrace::find_empty_key(IMap &map, size_t size) const
 }
 
 std::string BPFtrace::get_stack(uint32_t stackid, bool ustack, int indent)
+{
+  std::ostringstream stack;
+  std::string padding(indent, ' ');
+
+  stack << "\n";
+  for (auto &frame : get_stack_frames(stackid, ustack))
+    stack << padding << frame << std::endl;
+
+  return stack.str();
+}
+
+std::vector<std::string> BPFtrace::get_stack_frames(uint32_t stackid, bool ustack)
 {
   auto stack_trace = std::vector<uint64_t>(MAX_STACK_SIZE);
   int err = bpf_lookup_elem(stackid_map_->mapfd_, &stackid, stack_trace.data());
   if (err)
   {
     std::cerr << "Error looking up stack id " << stackid << ": " << err << std::endl;
-    return "";
+    return {};
   }
 
-  std::ostringstream stack;
-  std::string padding(indent, ' ');
-
-  stack << "\n";
+  std::vector<std::string> frames;
   for (auto &addr : stack_trace)
   {
     if (addr == 0)
       break;
     if (!ustack)
-      stack << padding << resolve_sym(addr, true) << std::endl;
+      frames.push_back(resolve_sym(addr, true));
     else
-      stack << padding << resolve_usym(addr) << std::endl;
+      frames.push_back(resolve_usym(addr));
   }
-
-  return stack.str();
+  return frames;
 }
 
 std::string BPFtrace::resolve_sym(uintptr_t addr, bool show_offset)
@@ -636,46 +2126,92 @@ std::string BPFtrace::resolve_usym(uintptr_t addr) const
   return symbol.str();
 }
 
-void BPFtrace::sort_by_key(std::vector<SizedType> key_args,
-    std::vector<std::pair<std::vector<uint8_t>, std::vector<uint8_t>>> &values_by_key)
+int BPFtrace::func_id(const std::string &func)
+{
+  auto search = func_ids_.find(func);
+  if (search != func_ids_.end())
+    return search->second;
+
+  int id = func_names_.size();
+  func_names_.push_back(func);
+  func_ids_[func] = id;
+  return id;
+}
+
+std::string BPFtrace::resolve_func(uint64_t id) const
 {
-  int arg_offset = 0;
-  for (auto arg : key_args)
+  if (id >= func_names_.size())
+    return "[unknown]";
+  return func_names_[id];
+}
+
+std::string BPFtrace::resolve_syscall(uint64_t nr) const
+{
+  std::string name = arch::syscall_name(nr);
+  if (name == "")
+    return "syscall_" + std::to_string(nr);
+  return name;
+}
+
+std::vector<int> BPFtrace::find_syscalls(const std::string &func)
+{
+  // Turn glob into a regex
+  auto regex_str = std::regex_replace(func, std::regex("\\*"), "[^\\s]*");
+  std::regex func_regex(regex_str);
+
+  std::vector<int> nrs;
+  for (auto &syscall : arch::syscalls())
   {
-    arg_offset += arg.size;
+    if (std::regex_match(syscall.second, func_regex))
+      nrs.push_back(syscall.first);
   }
+  return nrs;
+}
 
-  // Sort the key arguments in reverse order so the results are sorted by
-  // the first argument first, then the second, etc.
-  for (size_t i=key_args.size(); i-- > 0; )
+void BPFtrace::sort_by_key(const std::vector<SizedType> &key_args, MapSnapshot &snapshot)
+{
+  // Results are sorted by the first key argument first, then the second,
+  // etc. Each key is written out once in a form which compares the same way
+  // byte by byte, so they can be sorted in a single pass: integers
+  // big-endian, and strings without anything after their terminator.
+  size_t sort_key_size = 0;
+  for (auto &arg : key_args)
+    sort_key_size += arg.size;
+
+  std::vector<char> sort_keys(sort_key_size * snapshot.size());
+  for (size_t slot = 0; slot < snapshot.size(); slot++)
   {
-    auto arg = key_args.at(i);
-    arg_offset -= arg.size;
+    const char *key = (const char*)snapshot.slot_key(slot);
+    char *sort_key = sort_keys.data() + slot * sort_key_size;
 
-    if (arg.type == Type::integer)
+    size_t arg_offset = 0;
+    for (auto &arg : key_args)
     {
-      if (arg.size == 8)
+      if (arg_offset + arg.size > snapshot.key_size())
+        break;
+      const char *data = key + arg_offset;
+
+      if (arg.type == Type::integer)
       {
-        std::stable_sort(values_by_key.begin(), values_by_key.end(), [&](auto &a, auto &b)
-        {
-          return *(uint64_t*)(a.first.data() + arg_offset) < *(uint64_t*)(b.first.data() + arg_offset);
-        });
+        for (size_t byte = 0; byte < arg.size; byte++)
+          sort_key[arg_offset + byte] = data[arg.size - 1 - byte];
       }
-      else
-        abort();
-    }
-    else if (arg.type == Type::string)
-    {
-      std::stable_sort(values_by_key.begin(), values_by_key.end(), [&](auto &a, auto &b)
+      else if (arg.type == Type::string)
       {
-        return strncmp((char*)(a.first.data() + arg_offset),
-                       (char*)(b.first.data() + arg_offset),
-                       STRING_SIZE) < 0;
-      });
-    }
+        size_t len = strnlen(data, arg.size);
+        std::memcpy(sort_key + arg_offset, data, len);
+      }
 
-    // Other types don't get sorted
+      // Other types don't get sorted
+      arg_offset += arg.size;
+    }
   }
+
+  snapshot.sort([&](size_t a, size_t b)
+  {
+    return std::memcmp(sort_keys.data() + a * sort_key_size,
+                       sort_keys.data() + b * sort_key_size, sort_key_size) < 0;
+  });
 }
 
 } // namespace bpftrace
@@ -1,8 +1,14 @@
 #pragma once
 
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
 #include <map>
 #include <memory>
+#include <mutex>
 #include <set>
+#include <unordered_map>
 #include <vector>
 
 #include "common.h"
@@ -11,11 +17,128 @@
 #include "ast.h"
 #include "attached_probe.h"
 #include "imap.h"
+#include "map.h"
+#include "map_snapshot.h"
+#include "output.h"
+#include "snapshot.h"
 #include "struct.h"
 #include "types.h"
 
 namespace bpftrace {
 
+// What to print for histograms: the bucket counts, summary statistics
+// such as percentiles, or both
+enum class HistOutput
+{
+  bars,
+  summary,
+  both,
+};
+
+// How maps and printf() output are written: as text, one JSON object per
+// line, or as length-prefixed binary records (see BinaryWriter)
+enum class OutputFormat
+{
+  text,
+  json,
+  binary,
+};
+
+// Hashes raw map keys, for tables of entries read out of maps
+struct MapKeyHash
+{
+  size_t operator()(const std::vector<uint8_t> &key) const;
+};
+
+// Called with each element read from a map. The key and value are reused
+// for the next element, so they must be copied to be kept.
+using MapElemCallback = std::function<void(const std::vector<uint8_t> &key,
+                                           const std::vector<uint8_t> &value)>;
+
+// Entries moved out of a double-buffered map, with each CPU's copy of their
+// values combined. What was drained as of the last print() is kept apart
+// from what's been drained since, so a clear() after the print only removes
+// entries which were printed.
+class DrainedEntries
+{
+public:
+  // Merges in a value drained for key
+  void add(const SizedType &type, const std::vector<uint8_t> &key,
+           std::vector<uint8_t> value);
+  // Marks everything drained so far as printed
+  void mark_printed(const SizedType &type);
+  // Removes what was printed, keeping anything drained since
+  void clear_printed() { printed_.clear(); }
+  void clear();
+  // Calls callback with each key's value, printed or not
+  void read(const SizedType &type, const MapElemCallback &callback) const;
+
+private:
+  using Entries = std::unordered_map<std::vector<uint8_t>, std::vector<uint8_t>, MapKeyHash>;
+  static void merge(const SizedType &type, Entries &into, const std::vector<uint8_t> &key,
+                    std::vector<uint8_t> value);
+
+  Entries printed_;
+  Entries since_print_;
+};
+
+// Keeps the entries with the largest sort values added, in a min-heap so
+// each one costs O(log limit) however many are added. A limit of 0 keeps
+// every entry.
+template <typename T>
+class LargestEntries
+{
+public:
+  explicit LargestEntries(size_t limit) : limit_(limit) { }
+
+  // Whether adding an entry with this sort value would keep it
+  bool accepts(int64_t sort_value) const
+  {
+    return !full() || sort_value > entries_.front().first;
+  }
+
+  // Whether adding another entry would displace smallest()
+  bool full() const { return limit_ != 0 && entries_.size() == limit_; }
+  const std::pair<int64_t, T> &smallest() const { return entries_.front(); }
+
+  void add(int64_t sort_value, T entry)
+  {
+    if (limit_ == 0)
+    {
+      entries_.emplace_back(sort_value, std::move(entry));
+      return;
+    }
+    if (full())
+    {
+      if (!accepts(sort_value))
+        return;
+      std::pop_heap(entries_.begin(), entries_.end(), greater);
+      entries_.pop_back();
+    }
+    entries_.emplace_back(sort_value, std::move(entry));
+    std::push_heap(entries_.begin(), entries_.end(), greater);
+  }
+
+  // The entries kept, smallest first
+  std::vector<std::pair<int64_t, T>> sorted()
+  {
+    std::sort(entries_.begin(), entries_.end(), [](auto &a, auto &b)
+    {
+      return a.first < b.first;
+    });
+    return std::move(entries_);
+  }
+
+private:
+  static bool greater(const std::pair<int64_t, T> &a, const std::pair<int64_t, T> &b)
+  {
+    return a.first > b.first;
+  }
+
+  size_t limit_;
+  std::vector<std::pair<int64_t, T>> entries_;
+};
+
 class BPFtrace
 {
 public:
@@ -23,21 +146,69 @@ public:
   virtual ~BPFtrace() { }
   virtual int add_probe(ast::Probe &p);
   int num_probes() const;
+  int num_cpus() const { return ncpus_; }
   int run();
   int print_maps();
+  int print_drops();
+  void run_async_action(AsyncAction action, const uint64_t *args);
+  RecordWriter *record_writer();
   std::string get_stack(uint32_t stackid, bool ustack, int indent=0);
+  std::vector<std::string> get_stack_frames(uint32_t stackid, bool ustack);
   std::string resolve_sym(uintptr_t addr, bool show_offset=false);
   std::string resolve_usym(uintptr_t addr) const;
+  std::string resolve_func(uint64_t id) const;
+  std::string resolve_syscall(uint64_t nr) const;
 
   std::map<std::string, std::unique_ptr<IMap>> maps_;
+  std::map<std::string, std::unique_ptr<IMap>> topk_candidates_;
   std::map<std::string, std::tuple<uint8_t *, uintptr_t>> sections_;
   std::map<std::string, Struct> structs_;
   std::vector<std::tuple<std::string, std::vector<SizedType>>> printf_args_;
   std::unique_ptr<IMap> stackid_map_;
   std::unique_ptr<IMap> perf_event_map_;
+  std::unique_ptr<IMap> zero_map_;
+  std::unique_ptr<IMap> drops_map_;
+  std::unique_ptr<IMap> ratelimit_map_;
+  // Maps passed to print() or clear(), indexed by the IDs probes send for
+  // them. Each has a second copy in backbuffer_maps_, and a slot in
+  // generation_map_ saying which copy probes write to.
+  std::vector<std::string> double_buffered_maps_;
+  std::map<std::string, std::unique_ptr<IMap>> backbuffer_maps_;
+  std::unique_ptr<IMap> generation_map_;
+  std::vector<std::string> probe_names_;
+  OutputBuffer out_; // Where maps and printf() output are written to
+  int printf_rate_ = 0; // printf() lines per second, per probe. 0 for no limit
+  int drain_interval_ms_ = 0; // How often to drain aggregation maps. 0 for never
+  int print_top_ = 0; // How many of each map's largest elements to print. 0 for all
+  HistOutput hist_output_ = HistOutput::bars;
+  OutputFormat output_format_ = OutputFormat::text;
+  std::string snapshot_file_; // Where printed maps are saved. Empty for nowhere
+  std::string push_address_; // Collector to push changed map elements to. Empty for none
+  int push_interval_ms_ = 1000; // How often to push changed map elements
+  bool kprobe_multi_ = false;
+  bool task_storage_ = false;
 
-  static void sort_by_key(std::vector<SizedType> key_args,
-      std::vector<std::pair<std::vector<uint8_t>, std::vector<uint8_t>>> &values_by_key);
+  static std::vector<int> find_syscalls(const std::string &func);
+  static int64_t aggregation_value(Type type, const int64_t *fields);
+  static int64_t combined_value(const SizedType &type, const uint8_t *value);
+  static void merge_value(const SizedType &type, std::vector<uint8_t> &into,
+      const std::vector<uint8_t> &from, int ncpus);
+  static std::vector<uint8_t> combine_cpus(const SizedType &type,
+      const std::vector<uint8_t> &value, int ncpus);
+  static void combine_cpus_batch(const SizedType &type, const uint8_t *values,
+      size_t count, int ncpus, uint8_t *combined);
+  static uint64_t hll_estimate(const uint8_t *registers, size_t num_registers);
+  static uint64_t hash_value(const std::vector<uint8_t> &value);
+  static uint64_t topk_estimate(const std::vector<std::vector<uint64_t>> &rows,
+      const std::vector<uint8_t> &element);
+  static std::vector<uint64_t> reduce_hist(const SizedType &type,
+      const std::vector<uint8_t> &value, int ncpus);
+  static std::string hist_bucket_label(const SizedType &type, int bucket);
+  static std::pair<double, double> hist_bucket_range(const SizedType &type, int bucket);
+  static double hist_percentile(const std::vector<uint64_t> &values,
+      const SizedType &type, double percentile);
+  static double hist_mean(const std::vector<uint64_t> &values, const SizedType &type);
+  static void sort_by_key(const std::vector<SizedType> &key_args, MapSnapshot &snapshot);
 
 protected:
   virtual std::set<std::string> find_wildcard_matches(const std::string &prefix, const std::string &attach_point, const std::string &file_name);
@@ -50,14 +221,73 @@ private:
   KSyms ksyms_;
   int ncpus_;
   int online_cpus_;
+  std::vector<std::string> func_names_;
+  std::map<std::string, int> func_ids_;
+  std::unique_ptr<ProgramBarrier> barrier_;
+  // Entries moved out of double-buffered maps, by map name
+  std::map<std::string, DrainedEntries> drained_;
+  // The probe run which last printed each double-buffered map
+  std::map<std::string, uint64_t> last_print_;
+  // Held while draining maps or using what's been drained from them, which
+  // the drainer thread does as well as the main thread
+  std::mutex drain_mutex_;
+  std::condition_variable drain_cv_;
+  bool stop_draining_ = false;
+  // Reused for each map printed, so printing maps over and over doesn't
+  // allocate for every element
+  MapSnapshot snapshot_;
+  MapSnapshot buckets_snapshot_;
+  std::unique_ptr<RecordWriter> writer_;
+  std::unique_ptr<SnapshotFile> saved_snapshot_;
+  int push_fd_ = -1;
+  std::chrono::steady_clock::time_point next_push_;
+  // When to next try connecting to the collector, after connect_failures_
+  // failed attempts in a row
+  std::chrono::steady_clock::time_point next_connect_;
+  int connect_failures_ = 0;
+  // The values last pushed to the collector, by map name then snapshot key
+  std::map<std::string, std::unordered_map<std::string, std::vector<uint8_t>>> pushed_;
 
+  int func_id(const std::string &func);
   std::unique_ptr<AttachedProbe> attach_probe(Probe &probe);
+  std::unique_ptr<AttachedProbe> attach_probe_multi(Probe &probe,
+      const std::vector<std::string> &funcs, const std::vector<uint64_t> &func_ids);
+  int attach_probes();
   int setup_perf_events();
   void poll_perf_events(int epollfd, int timeout=-1);
+  int drain_map(const std::string &name);
+  void drain_maps_periodically();
   int print_map(IMap &map);
+  int write_snapshot(IMap &map);
+  int connect_collector(bool now = false);
+  int push_maps();
+  std::string snapshot_key(const IMap &map, const uint8_t *data);
+  int print_map_values(IMap &map);
+  int print_map_aggregation(IMap &map);
+  int read_map(IMap &map, const MapElemCallback &callback);
+  int read_hash_map(IMap &map, const MapElemCallback &callback);
+  int take_hash_map(IMap &map,
+      std::vector<std::pair<std::vector<uint8_t>, std::vector<uint8_t>>> &values_by_key);
+  int read_array_map(IMap &map, const MapElemCallback &callback);
   int print_map_quantize(IMap &map);
-  int print_quantize(const std::vector<uint64_t> &values) const;
+  int print_map_hist(IMap &map);
+  int print_map_topk(IMap &map);
+  int print_hist(const std::vector<uint64_t> &values, const SizedType &type);
+  void begin_map_record(RecordWriter &writer, const std::string &name,
+      const MapKey &key, const uint8_t *data);
+  void write_value(RecordWriter &writer, const SizedType &type, const uint8_t *data);
+  void write_hist(RecordWriter &writer, const uint64_t *counts, size_t num_buckets,
+      const SizedType &type);
+  void print_hist_bars(const std::vector<uint64_t> &values, const SizedType &type);
+  void print_hist_summary(const std::vector<uint64_t> &values, const SizedType &type);
   static uint64_t reduce_value(const std::vector<uint8_t> &value, int ncpus);
+  static void add_cpu_rows(const uint64_t *rows, size_t words, int ncpus, uint64_t *sums);
+  static void merge_fields(const SizedType &type, uint8_t *into, const uint8_t *from);
+  static void add_largest(LargestEntries<size_t> &largest, MapSnapshot &snapshot,
+      int64_t sort_value, const uint8_t *key, const uint8_t *value);
+  static size_t hash_key_size(const IMap &map);
+  static size_t snapshot_key_size(const IMap &map);
+  static bool can_snapshot(const IMap &map);
   static std::string quantize_index_label(int power);
   std::vector<uint8_t> find_empty_key(IMap &map, size_t size) const;
 };
@@ -0,0 +1,149 @@
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <vector>
+
+#include "btf.h"
+
+#include <linux/bpf.h>
+#include <linux/btf.h>
+
+namespace bpftrace {
+
+BTF::BTF(const std::string &path)
+{
+  std::ifstream file(path, std::ios::binary);
+  if (!file)
+    return;
+
+  const std::string data{std::istreambuf_iterator<char>(file),
+                         std::istreambuf_iterator<char>()};
+  has_data_ = parse(data);
+  if (!has_data_)
+    funcs_.clear();
+}
+
+bool BTF::has_data() const
+{
+  return has_data_;
+}
+
+int BTF::find_func(const std::string &name) const
+{
+  auto search = funcs_.find(name);
+  if (search == funcs_.end())
+    return -1;
+  return search->second;
+}
+
+bool BTF::parse(const std::string &data)
+{
+  struct btf_header hdr;
+  if (data.size() < sizeof(hdr))
+    return false;
+  memcpy(&hdr, data.data(), sizeof(hdr));
+
+  if (hdr.magic != BTF_MAGIC || hdr.hdr_len > data.size())
+    return false;
+  if ((uint64_t)hdr.hdr_len + hdr.type_off + hdr.type_len > data.size() ||
+      (uint64_t)hdr.hdr_len + hdr.str_off + hdr.str_len > data.size())
+    return false;
+
+  const char *types = data.data() + hdr.hdr_len + hdr.type_off;
+  const char *strs = data.data() + hdr.hdr_len + hdr.str_off;
+  size_t pos = 0;
+
+  // Type IDs are implicit: the first entry in the type section is ID 1
+  for (int id = 1; pos + sizeof(struct btf_type) <= hdr.type_len; id++)
+  {
+    struct btf_type t;
+    memcpy(&t, types + pos, sizeof(t));
+    pos += sizeof(t);
+
+    int vlen = BTF_INFO_VLEN(t.info);
+    switch (BTF_INFO_KIND(t.info))
+    {
+      case BTF_KIND_INT:
+      case BTF_KIND_VAR:
+      case BTF_KIND_DECL_TAG:
+        pos += sizeof(uint32_t);
+        break;
+      case BTF_KIND_ARRAY:
+        pos += sizeof(struct btf_array);
+        break;
+      case BTF_KIND_STRUCT:
+      case BTF_KIND_UNION:
+        pos += vlen * sizeof(struct btf_member);
+        break;
+      case BTF_KIND_ENUM:
+        pos += vlen * sizeof(struct btf_enum);
+        break;
+      case BTF_KIND_ENUM64:
+        pos += vlen * sizeof(struct btf_enum64);
+        break;
+      case BTF_KIND_FUNC_PROTO:
+        pos += vlen * sizeof(struct btf_param);
+        break;
+      case BTF_KIND_DATASEC:
+        pos += vlen * sizeof(struct btf_var_secinfo);
+        break;
+      case BTF_KIND_FUNC:
+        if (t.name_off < hdr.str_len)
+          funcs_.emplace(strs + t.name_off, id);
+        break;
+      case BTF_KIND_PTR:
+      case BTF_KIND_FWD:
+      case BTF_KIND_TYPEDEF:
+      case BTF_KIND_VOLATILE:
+      case BTF_KIND_CONST:
+      case BTF_KIND_RESTRICT:
+      case BTF_KIND_FLOAT:
+      case BTF_KIND_TYPE_TAG:
+        break;
+      default:
+        // Unknown kind - we can't tell how large it is, so give up
+        return false;
+    }
+  }
+
+  return pos == hdr.type_len;
+}
+
+int load_storage_btf()
+{
+  const char strs[] = "\0int\0u64";
+  struct int_type
+  {
+    struct btf_type type;
+    uint32_t encoding;
+  } types[] = {
+    { { 1, BTF_KIND_INT << 24, { 4 } }, BTF_INT_SIGNED << 24 | 32 },
+    { { 5, BTF_KIND_INT << 24, { 8 } }, 64 },
+  };
+
+  struct btf_header hdr;
+  memset(&hdr, 0, sizeof(hdr));
+  hdr.magic = BTF_MAGIC;
+  hdr.version = BTF_VERSION;
+  hdr.hdr_len = sizeof(hdr);
+  hdr.type_off = 0;
+  hdr.type_len = sizeof(types);
+  hdr.str_off = sizeof(types);
+  hdr.str_len = sizeof(strs);
+
+  std::vector<uint8_t> data(sizeof(hdr) + sizeof(types) + sizeof(strs));
+  memcpy(data.data(), &hdr, sizeof(hdr));
+  memcpy(data.data() + sizeof(hdr), types, sizeof(types));
+  memcpy(data.data() + sizeof(hdr) + sizeof(types), strs, sizeof(strs));
+
+  union bpf_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.btf = reinterpret_cast<uintptr_t>(data.data());
+  attr.btf_size = data.size();
+
+  return syscall(__NR_bpf, BPF_BTF_LOAD, &attr, sizeof(attr));
+}
+
+} // namespace bpftrace
@@ -0,0 +1,30 @@
+#pragma once
+
+#include <map>
+#include <string>
+
+namespace bpftrace {
+
+// Minimal reader for the kernel's BTF type information, as exported in
+// /sys/kernel/btf/vmlinux. Only function lookups are supported, which is
+// what is needed to attach kfunc/kretfunc probes.
+class BTF
+{
+public:
+  explicit BTF(const std::string &path="/sys/kernel/btf/vmlinux");
+  bool has_data() const;
+  int find_func(const std::string &name) const;
+
+private:
+  bool parse(const std::string &data);
+
+  std::map<std::string, int> funcs_;
+  bool has_data_ = false;
+};
+
+// Local storage maps must describe their key and value with BTF. This loads a
+// BTF object with an int (type ID 1) for the key and a u64 (type ID 2) for the
+// value, returning its fd or a negative value on error.
+int load_storage_btf();
+
+} // namespace bpftrace
@@ -0,0 +1,401 @@
+#include <cstring>
+#include <fcntl.h>
+#include <iostream>
+#include <netdb.h>
+#include <poll.h>
+#include <sstream>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "bpftrace.h"
+#include "collector.h"
+
+namespace bpftrace {
+
+namespace {
+
+const char unix_prefix[] = "unix:";
+const char tcp_prefix[] = "tcp:";
+
+bool starts_with(const std::string &s, const char *prefix)
+{
+  return s.compare(0, strlen(prefix), prefix) == 0;
+}
+
+// Makes a socket for address, and connects or binds it with the given
+// function. getaddrinfo() gives a list to try for TCP.
+template <typename Open>
+int open_socket(const std::string &address, bool passive, bool quiet, Open open)
+{
+  if (starts_with(address, unix_prefix))
+  {
+    struct sockaddr_un addr = {};
+    addr.sun_family = AF_UNIX;
+    std::string path = address.substr(strlen(unix_prefix));
+    if (path.empty() || path.size() >= sizeof(addr.sun_path))
+    {
+      if (!quiet)
+        std::cerr << "Invalid socket path: " << path << std::endl;
+      return -1;
+    }
+    strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0 || open(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0)
+    {
+      if (!quiet)
+        std::cerr << "Error opening '" << address << "': " << strerror(errno) << std::endl;
+      if (fd >= 0)
+        close(fd);
+      return -1;
+    }
+    return fd;
+  }
+
+  std::string host_port = address.substr(strlen(tcp_prefix));
+  size_t colon = host_port.rfind(':');
+  if (!starts_with(address, tcp_prefix) || colon == std::string::npos)
+  {
+    if (!quiet)
+      std::cerr << "Invalid address: " << address << std::endl;
+    return -1;
+  }
+  std::string host = host_port.substr(0, colon);
+  std::string port = host_port.substr(colon + 1);
+
+  struct addrinfo hints = {};
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = passive ? AI_PASSIVE : 0;
+  struct addrinfo *addrs;
+  int err = getaddrinfo(host.empty() ? nullptr : host.c_str(), port.c_str(), &hints, &addrs);
+  if (err)
+  {
+    if (!quiet)
+      std::cerr << "Error resolving '" << address << "': " << gai_strerror(err) << std::endl;
+    return -1;
+  }
+
+  int fd = -1;
+  for (auto *addr = addrs; addr; addr = addr->ai_next)
+  {
+    fd = socket(addr->ai_family, addr->ai_socktype | SOCK_CLOEXEC, addr->ai_protocol);
+    if (fd < 0)
+      continue;
+    if (open(fd, addr->ai_addr, addr->ai_addrlen) == 0)
+      break;
+    close(fd);
+    fd = -1;
+  }
+  if (fd < 0 && !quiet)
+    std::cerr << "Error opening '" << address << "': " << strerror(errno) << std::endl;
+  freeaddrinfo(addrs);
+  return fd;
+}
+
+bool write_all(int fd, const char *data, size_t len)
+{
+  while (len > 0)
+  {
+    ssize_t written = send(fd, data, len, MSG_NOSIGNAL);
+    if (written < 0 && errno == EINTR)
+      continue;
+    if (written <= 0)
+      return false;
+    data += written;
+    len -= written;
+  }
+  return true;
+}
+
+bool read_all(int fd, char *data, size_t len)
+{
+  while (len > 0)
+  {
+    ssize_t got = read(fd, data, len);
+    if (got < 0 && errno == EINTR)
+      continue;
+    if (got <= 0)
+      return false;
+    data += got;
+    len -= got;
+  }
+  return true;
+}
+
+// Splits a message body into the sender's name and snapshot
+bool parse_message(const std::string &body, std::string &name, std::string &snapshot)
+{
+  uint32_t name_len;
+  if (body.size() < sizeof(name_len))
+    return false;
+  memcpy(&name_len, body.data(), sizeof(name_len));
+  if (body.size() - sizeof(name_len) < name_len)
+    return false;
+  name = body.substr(sizeof(name_len), name_len);
+  snapshot = body.substr(sizeof(name_len) + name_len);
+  return true;
+}
+
+} // namespace
+
+bool is_address(const std::string &s)
+{
+  return starts_with(s, unix_prefix) || starts_with(s, tcp_prefix);
+}
+
+int connect_to(const std::string &address, int timeout_ms, bool quiet)
+{
+  return open_socket(address, false, quiet, [=](int fd, const struct sockaddr *addr, socklen_t len)
+  {
+    if (timeout_ms < 0)
+      return connect(fd, addr, len);
+
+    // Connect without blocking, then wait for the connection to be made for
+    // no longer than the timeout, before putting the socket back in
+    // blocking mode
+    int flags = fcntl(fd, F_GETFL);
+    if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0)
+      return -1;
+    if (connect(fd, addr, len) != 0)
+    {
+      if (errno != EINPROGRESS)
+        return -1;
+      struct pollfd pfd = { fd, POLLOUT, 0 };
+      int ready = poll(&pfd, 1, timeout_ms);
+      if (ready <= 0)
+      {
+        if (ready == 0)
+          errno = ETIMEDOUT;
+        return -1;
+      }
+      int err;
+      socklen_t err_len = sizeof(err);
+      if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &err_len) != 0)
+        return -1;
+      if (err)
+      {
+        errno = err;
+        return -1;
+      }
+    }
+    return fcntl(fd, F_SETFL, flags) < 0 ? -1 : 0;
+  });
+}
+
+int listen_on(const std::string &address)
+{
+  // Sockets left behind by a collector which didn't exit cleanly are reused
+  if (starts_with(address, unix_prefix))
+    unlink(address.substr(strlen(unix_prefix)).c_str());
+
+  return open_socket(address, true, false, [](int fd, const struct sockaddr *addr, socklen_t len)
+  {
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (bind(fd, addr, len) != 0)
+      return -1;
+    return listen(fd, SOMAXCONN);
+  });
+}
+
+int send_message(int fd, const std::string &name, const std::string &snapshot)
+{
+  uint32_t name_len = name.size();
+  uint32_t len = sizeof(name_len) + name_len + snapshot.size();
+  std::string message;
+  message.reserve(sizeof(len) + len);
+  message.append((const char*)&len, sizeof(len));
+  message.append((const char*)&name_len, sizeof(name_len));
+  message += name;
+  message += snapshot;
+  if (!write_all(fd, message.data(), message.size()))
+  {
+    std::cerr << "Error sending message: " << strerror(errno) << std::endl;
+    return -1;
+  }
+  return 0;
+}
+
+int recv_message(int fd, std::string &name, std::string &snapshot)
+{
+  uint32_t len;
+  std::string body;
+  bool ok = read_all(fd, (char*)&len, sizeof(len));
+  if (ok)
+  {
+    body.resize(len);
+    ok = read_all(fd, &body[0], len);
+  }
+  if (!ok || !parse_message(body, name, snapshot))
+  {
+    std::cerr << "Error receiving message" << std::endl;
+    return -1;
+  }
+  return 0;
+}
+
+int query_collector(const std::string &address, std::string &snapshot)
+{
+  int fd = connect_to(address);
+  if (fd < 0)
+    return -1;
+
+  std::string name;
+  int err = send_message(fd, "", "");
+  if (!err)
+    err = recv_message(fd, name, snapshot);
+  close(fd);
+  return err;
+}
+
+int Collector::add(const std::string &agent, const std::string &snapshot)
+{
+  std::istringstream in(snapshot);
+  SnapshotReader reader(in, agent);
+  auto &agent_maps = agents_[agent];
+
+  SnapshotMap map;
+  std::string key;
+  std::vector<uint8_t> value;
+  int err;
+  while ((err = reader.read_map(map)) == 0)
+  {
+    auto map_id = map_ids_.find(map.name);
+    if (map_id == map_ids_.end())
+    {
+      map_id = map_ids_.emplace(map.name, maps_.size()).first;
+      maps_.push_back(map);
+    }
+    else if (!maps_.at(map_id->second).same_type(map))
+    {
+      std::cerr << "Map '" << map.name << "' from '" << agent
+                << "' has a different type to other agents'" << std::endl;
+      return -1;
+    }
+    if (agent_maps.size() <= map_id->second)
+      agent_maps.resize(map_id->second + 1);
+
+    auto &elems = agent_maps.at(map_id->second);
+    for (uint64_t i = 0; i < map.num_elems; i++)
+    {
+      if (reader.read_elem(key, value))
+        return -1;
+      elems[key] = value;
+    }
+  }
+  return err < 0 ? -1 : 0;
+}
+
+std::string Collector::merged() const
+{
+  std::ostringstream out;
+  SnapshotWriter writer(out);
+  for (size_t map_id = 0; map_id < maps_.size(); map_id++)
+  {
+    Elems merged;
+    for (auto &agent : agents_)
+    {
+      if (agent.second.size() <= map_id)
+        continue;
+      for (auto &elem : agent.second.at(map_id))
+      {
+        auto search = merged.find(elem.first);
+        if (search == merged.end())
+          merged.emplace(elem.first, elem.second);
+        else
+          BPFtrace::merge_value(maps_.at(map_id).type, search->second, elem.second, 1);
+      }
+    }
+
+    SnapshotMap map = maps_.at(map_id);
+    map.num_elems = merged.size();
+    writer.write_map(map);
+    for (auto &elem : merged)
+      writer.write_elem(elem.first, elem.second.data(), elem.second.size());
+  }
+  return out.str();
+}
+
+int Collector::run(const std::string &address)
+{
+  int listen_fd = listen_on(address);
+  if (listen_fd < 0)
+    return -1;
+
+  // Everything is handled on one thread. Messages can arrive a piece at a
+  // time, so what's been read from each connection is kept until the rest
+  // of the message it's part of arrives.
+  std::vector<struct pollfd> fds = { { listen_fd, POLLIN, 0 } };
+  std::vector<std::string> received = { "" };
+  char buf[65536];
+  int err = 0;
+  while (true)
+  {
+    if (poll(fds.data(), fds.size(), -1) < 0)
+    {
+      if (errno != EINTR)
+      {
+        std::cerr << "Error polling sockets: " << strerror(errno) << std::endl;
+        err = -1;
+      }
+      break;
+    }
+
+    for (size_t i = fds.size(); i-- > 1; )
+    {
+      if (!fds[i].revents)
+        continue;
+
+      std::string &data = received[i];
+      ssize_t got = read(fds[i].fd, buf, sizeof(buf));
+      bool ok = got > 0;
+      if (ok)
+        data.append(buf, got);
+
+      uint32_t len;
+      while (ok && data.size() >= sizeof(len))
+      {
+        memcpy(&len, data.data(), sizeof(len));
+        if (data.size() - sizeof(len) < len)
+          break;
+
+        std::string name, snapshot;
+        ok = parse_message(data.substr(sizeof(len), len), name, snapshot);
+        data.erase(0, sizeof(len) + len);
+        if (!ok)
+          std::cerr << "Invalid message" << std::endl;
+        else if (name.empty())
+          ok = send_message(fds[i].fd, "", merged()) == 0;
+        else
+          ok = add(name, snapshot) == 0;
+      }
+
+      if (!ok)
+      {
+        close(fds[i].fd);
+        fds.erase(fds.begin() + i);
+        received.erase(received.begin() + i);
+      }
+    }
+
+    if (fds[0].revents & POLLIN)
+    {
+      int fd = accept4(listen_fd, nullptr, nullptr, SOCK_CLOEXEC);
+      if (fd >= 0)
+      {
+        fds.push_back({ fd, POLLIN, 0 });
+        received.emplace_back();
+      }
+    }
+  }
+
+  for (auto &pfd : fds)
+    close(pfd.fd);
+  if (starts_with(address, unix_prefix))
+    unlink(address.substr(strlen(unix_prefix)).c_str());
+  return err;
+}
+
+} // namespace bpftrace
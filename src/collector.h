@@ -0,0 +1,56 @@
+#pragma once
+
+#include <map>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "snapshot.h"
+
+namespace bpftrace {
+
+// Agents push the elements of their maps which have changed since their last
+// push to a collector, which keeps every agent's elements and merges them
+// for anyone who asks.
+//
+// Addresses are "unix:PATH" or "tcp:HOST:PORT". A message is a 32 bit
+// length, then the sender's name prefixed by its 32 bit length, then a
+// snapshot (see snapshot.h) of the elements being sent. A message with an
+// empty name asks a collector for its merged maps, which it replies to with
+// a message holding them. Numbers are in the host's byte order.
+
+bool is_address(const std::string &s);
+// These return a socket, or -1 on errors. Connecting gives up after
+// timeout_ms, unless it's negative, and quiet leaves errors unreported.
+int connect_to(const std::string &address, int timeout_ms = -1, bool quiet = false);
+int listen_on(const std::string &address);
+
+int send_message(int fd, const std::string &name, const std::string &snapshot);
+int recv_message(int fd, std::string &name, std::string &snapshot);
+
+// Fetches the merged maps from the collector at address, as a snapshot
+int query_collector(const std::string &address, std::string &snapshot);
+
+class Collector
+{
+public:
+  // Adds the elements in a snapshot pushed by an agent. Values are running
+  // totals, so each replaces the last one the agent sent for its key.
+  int add(const std::string &agent, const std::string &snapshot);
+
+  // Every agent's maps merged together, as a snapshot
+  std::string merged() const;
+
+  // Takes pushes and queries on address until interrupted
+  int run(const std::string &address);
+
+private:
+  using Elems = std::unordered_map<std::string, std::vector<uint8_t>>;
+
+  std::vector<SnapshotMap> maps_;
+  std::map<std::string, size_t> map_ids_;
+  // The latest elements from each agent, by map ID then key
+  std::map<std::string, std::vector<Elems>> agents_;
+};
+
+} // namespace bpftrace
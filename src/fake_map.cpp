@@ -4,13 +4,21 @@ namespace bpftrace {
 
 int FakeMap::next_mapfd_ = 1;
 
-FakeMap::FakeMap(const std::string &name, const SizedType &type, const MapKey &key)
+FakeMap::FakeMap(const std::string &name, const SizedType &type, const MapKey &key,
+                 enum bpf_map_type map_type, int max_entries)
 {
+  name_ = name;
+  type_ = type;
+  key_ = key;
+  map_type_ = map_type;
+  max_entries_ = max_entries;
   mapfd_ = next_mapfd_++;
 }
 
 FakeMap::FakeMap(enum bpf_map_type map_type)
 {
+  map_type_ = map_type;
+  max_entries_ = 0;
   mapfd_ = next_mapfd_++;
 }
 
@@ -6,7 +6,8 @@ namespace bpftrace {
 
 class FakeMap : public IMap {
 public:
-  FakeMap(const std::string &name, const SizedType &type, const MapKey &key);
+  FakeMap(const std::string &name, const SizedType &type, const MapKey &key,
+          enum bpf_map_type map_type, int max_entries);
   FakeMap(enum bpf_map_type map_type);
 
   static int next_mapfd_;
@@ -20,6 +20,13 @@ public:
   std::string name_;
   SizedType type_;
   MapKey key_;
+  enum bpf_map_type map_type_;
+  int max_entries_;
+
+  bool is_array() const
+  {
+    return map_type_ == BPF_MAP_TYPE_ARRAY || map_type_ == BPF_MAP_TYPE_PERCPU_ARRAY;
+  }
 };
 
 } // namespace bpftrace
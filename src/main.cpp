@@ -3,17 +3,41 @@
 
 #include "bpftrace.h"
 #include "codegen_llvm.h"
+#include "collector.h"
 #include "driver.h"
 #include "printer.h"
 #include "semantic_analyser.h"
+#include "take_rewriter.h"
 
 using namespace bpftrace;
 
 void usage()
 {
   std::cerr << "Usage:" << std::endl;
-  std::cerr << "  bpftrace filename" << std::endl;
-  std::cerr << "  bpftrace -e 'script'" << std::endl;
+  std::cerr << "  bpftrace [options] filename" << std::endl;
+  std::cerr << "  bpftrace [options] -e 'script'" << std::endl;
+  std::cerr << "  bpftrace -M output snapshot..." << std::endl;
+  std::cerr << "  bpftrace -C address" << std::endl;
+  std::cerr << std::endl;
+  std::cerr << "Options:" << std::endl;
+  std::cerr << "  -a MS    move the contents of aggregation maps into userspace every MS milliseconds" << std::endl;
+  std::cerr << "  -C ADDR  collect maps pushed by agents on ADDR (unix:PATH or tcp:HOST:PORT)" << std::endl;
+  std::cerr << "  -f FMT   output format: text (default), json or binary" << std::endl;
+  std::cerr << "  -M FILE  merge the snapshot files or collector addresses given as arguments into FILE" << std::endl;
+  std::cerr << "  -n NUM   print only the NUM largest elements of each aggregation map" << std::endl;
+  std::cerr << "  -p ADDR  push changed map elements to the collector at ADDR every second" << std::endl;
+  std::cerr << "  -r RATE  limit printf() to about RATE lines per second for each probe" << std::endl;
+  std::cerr << "  -s       print the count, mean and percentiles of histograms, as well as their buckets" << std::endl;
+  std::cerr << "  -S       print the count, mean and percentiles of histograms instead of their buckets" << std::endl;
+  std::cerr << "  -w FILE  save a snapshot of maps to FILE whenever they're printed" << std::endl;
+}
+
+// Empty signal handler for cleanly terminating the program
+void handle_sigint()
+{
+  struct sigaction act = {};
+  act.sa_handler = [](int) { };
+  sigaction(SIGINT, &act, NULL);
 }
 
 int main(int argc, char *argv[])
@@ -23,23 +47,109 @@ int main(int argc, char *argv[])
 
   std::string script;
   bool debug = false;
+  HistOutput hist_output = HistOutput::bars;
+  OutputFormat output_format = OutputFormat::text;
+  int printf_rate = 0;
+  int drain_interval_ms = 0;
+  int print_top = 0;
+  std::string snapshot_file;
+  std::string merge_file;
+  std::string push_address;
+  std::string collect_address;
   int c;
-  while ((c = getopt(argc, argv, "de:")) != -1)
+  while ((c = getopt(argc, argv, "a:C:de:f:M:n:p:r:sSw:")) != -1)
   {
     switch (c)
     {
+      case 'a':
+        drain_interval_ms = atoi(optarg);
+        if (drain_interval_ms <= 0)
+        {
+          std::cerr << "Invalid interval: " << optarg << std::endl;
+          return 1;
+        }
+        break;
+      case 'C':
+        collect_address = optarg;
+        break;
       case 'd':
         debug = true;
         break;
       case 'e':
         script = optarg;
         break;
+      case 'f':
+        if (std::string(optarg) == "text")
+          output_format = OutputFormat::text;
+        else if (std::string(optarg) == "json")
+          output_format = OutputFormat::json;
+        else if (std::string(optarg) == "binary")
+          output_format = OutputFormat::binary;
+        else
+        {
+          std::cerr << "Invalid output format: " << optarg << std::endl;
+          return 1;
+        }
+        break;
+      case 'M':
+        merge_file = optarg;
+        break;
+      case 'n':
+        print_top = atoi(optarg);
+        if (print_top <= 0)
+        {
+          std::cerr << "Invalid number of elements: " << optarg << std::endl;
+          return 1;
+        }
+        break;
+      case 'p':
+        push_address = optarg;
+        break;
+      case 'r':
+        printf_rate = atoi(optarg);
+        if (printf_rate <= 0)
+        {
+          std::cerr << "Invalid rate: " << optarg << std::endl;
+          return 1;
+        }
+        break;
+      case 's':
+        hist_output = HistOutput::both;
+        break;
+      case 'S':
+        hist_output = HistOutput::summary;
+        break;
+      case 'w':
+        snapshot_file = optarg;
+        break;
       default:
         usage();
         return 1;
     }
   }
 
+  if (!merge_file.empty())
+  {
+    if (optind == argc)
+    {
+      usage();
+      return 1;
+    }
+    return merge_snapshots(std::vector<std::string>(argv + optind, argv + argc), merge_file) ? 1 : 0;
+  }
+
+  if (!collect_address.empty())
+  {
+    if (optind != argc)
+    {
+      usage();
+      return 1;
+    }
+    handle_sigint();
+    Collector collector;
+    return collector.run(collect_address) ? 1 : 0;
+  }
+
   if (script.empty())
   {
     // There should only be 1 non-option argument (the script file)
@@ -66,6 +176,13 @@ int main(int argc, char *argv[])
     return err;
 
   BPFtrace bpftrace;
+  bpftrace.hist_output_ = hist_output;
+  bpftrace.output_format_ = output_format;
+  bpftrace.snapshot_file_ = snapshot_file;
+  bpftrace.push_address_ = push_address;
+  bpftrace.printf_rate_ = printf_rate;
+  bpftrace.drain_interval_ms_ = drain_interval_ms;
+  bpftrace.print_top_ = print_top;
 
   if (debug)
   {
@@ -73,15 +190,26 @@ int main(int argc, char *argv[])
     driver.root_->accept(p);
   }
 
+  ast::TakeRewriter take_rewriter(driver.root_);
+  take_rewriter.rewrite();
+
   ast::SemanticAnalyser semantics(driver.root_, bpftrace);
   err = semantics.analyse();
   if (err)
     return err;
 
+  // Decided before creating maps, as it changes which maps are used
+  if (!debug)
+    bpftrace.task_storage_ = task_storage_supported();
+
   err = semantics.create_maps(debug);
   if (err)
     return err;
 
+  // Decided before codegen, as it changes how func is generated
+  if (!debug)
+    bpftrace.kprobe_multi_ = kprobe_multi_supported();
+
   ast::CodegenLLVM llvm(driver.root_, bpftrace);
   err = llvm.compile(debug);
   if (err)
@@ -90,31 +218,36 @@ int main(int argc, char *argv[])
   if (debug)
     return 0;
 
-  // Empty signal handler for cleanly terminating the program
-  struct sigaction act;
-  act.sa_handler = [](int) { };
-  sigaction(SIGINT, &act, NULL);
+  handle_sigint();
+
+  // Only what's asked for goes to stdout when it's read by another program
+  std::ostream &info = output_format == OutputFormat::text ? std::cout : std::cerr;
 
   int num_probes = bpftrace.num_probes();
   if (num_probes == 0)
   {
-    std::cout << "No probes to attach" << std::endl;
+    info << "No probes to attach" << std::endl;
     return 1;
   }
   else if (num_probes == 1)
-    std::cout << "Attaching " << bpftrace.num_probes() << " probe..." << std::endl;
+    info << "Attaching " << bpftrace.num_probes() << " probe..." << std::endl;
   else
-    std::cout << "Attaching " << bpftrace.num_probes() << " probes..." << std::endl;
+    info << "Attaching " << bpftrace.num_probes() << " probes..." << std::endl;
 
   err = bpftrace.run();
   if (err)
     return err;
 
-  std::cout << "\n\n";
+  if (output_format == OutputFormat::text)
+    std::cout << "\n\n";
 
   err = bpftrace.print_maps();
   if (err)
     return err;
 
+  err = bpftrace.print_drops();
+  if (err)
+    return err;
+
   return 0;
 }
@@ -1,7 +1,9 @@
+#include <cstring>
 #include <iostream>
+#include <sys/syscall.h>
 #include <unistd.h>
-#include <linux/version.h>
 
+#include "btf.h"
 #include "common.h"
 #include "libbpf.h"
 
@@ -9,11 +11,71 @@
 
 namespace bpftrace {
 
-Map::Map(const std::string &name, const SizedType &type, const MapKey &key)
+int create_task_storage_map(const std::string &name, int value_size)
+{
+  int btf_fd = load_storage_btf();
+  if (btf_fd < 0)
+    return btf_fd;
+
+  union bpf_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.map_type = BPF_MAP_TYPE_TASK_STORAGE;
+  attr.key_size = sizeof(int);
+  attr.value_size = value_size;
+  attr.max_entries = 0;
+  attr.map_flags = BPF_F_NO_PREALLOC;
+  attr.btf_fd = btf_fd;
+  attr.btf_key_type_id = 1;
+  attr.btf_value_type_id = 2;
+  strncpy(attr.map_name, name.c_str(), BPF_OBJ_NAME_LEN - 1);
+
+  int mapfd = syscall(__NR_bpf, BPF_MAP_CREATE, &attr, sizeof(attr));
+  close(btf_fd);
+  return mapfd;
+}
+
+ProgramBarrier::ProgramBarrier()
+{
+  inner_mapfd_ = bpf_create_map(BPF_MAP_TYPE_ARRAY, "barrier_inner", 4, 4, 1, 0);
+
+  union bpf_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.map_type = BPF_MAP_TYPE_ARRAY_OF_MAPS;
+  attr.key_size = sizeof(int);
+  attr.value_size = sizeof(int);
+  attr.max_entries = 1;
+  attr.inner_map_fd = inner_mapfd_;
+  strncpy(attr.map_name, "barrier", BPF_OBJ_NAME_LEN - 1);
+  outer_mapfd_ = syscall(__NR_bpf, BPF_MAP_CREATE, &attr, sizeof(attr));
+
+  if (inner_mapfd_ < 0 || outer_mapfd_ < 0)
+    std::cerr << "Error creating barrier map" << std::endl;
+}
+
+ProgramBarrier::~ProgramBarrier()
+{
+  close(outer_mapfd_);
+  close(inner_mapfd_);
+}
+
+int ProgramBarrier::wait()
+{
+  // Replacing an element of a map-of-maps makes the kernel wait for an RCU
+  // grace period before returning, so that no program can still be using
+  // the map which was there. Programs run inside RCU read-side critical
+  // sections, so every program running now will have finished by then.
+  int key = 0;
+  return bpf_update_elem(outer_mapfd_, &key, &inner_mapfd_, 0);
+}
+
+Map::Map(const std::string &name, const SizedType &type, const MapKey &key,
+         enum bpf_map_type map_type, int max_entries)
 {
   name_ = name;
   type_ = type;
   key_ = key;
+  map_type_ = map_type;
+  max_entries_ = max_entries;
 
   int key_size = key.size();
   if (type.type == Type::quantize)
@@ -21,19 +83,17 @@ Map::Map(const std::string &name, const SizedType &type, const MapKey &key)
   if (key_size == 0)
     key_size = 8;
 
-  enum bpf_map_type map_type;
-  if ((type.type == Type::quantize || type.type == Type::count) &&
-      (LINUX_VERSION_CODE >= KERNEL_VERSION(4, 6, 0)))
-  {
-      map_type = BPF_MAP_TYPE_PERCPU_HASH;
-  }
-  else
-    map_type = BPF_MAP_TYPE_HASH;
+  // Arrays are indexed directly by a 32-bit slot number
+  if (is_array())
+    key_size = 4;
 
   int value_size = type.size;
-  int max_entries = 128;
   int flags = 0;
-  mapfd_ = bpf_create_map(map_type, name.c_str(), key_size, value_size, max_entries, flags);
+
+  if (map_type == BPF_MAP_TYPE_TASK_STORAGE)
+    mapfd_ = create_task_storage_map(name, value_size);
+  else
+    mapfd_ = bpf_create_map(map_type, name.c_str(), key_size, value_size, max_entries_, flags);
   if (mapfd_ < 0)
   {
     std::cerr << "Error creating map: '" << name_ << "'" << std::endl;
@@ -42,7 +102,9 @@ Map::Map(const std::string &name, const SizedType &type, const MapKey &key)
 
 Map::Map(enum bpf_map_type map_type)
 {
-  int key_size, value_size, max_entries, flags;
+  map_type_ = map_type;
+
+  int key_size, value_size, flags;
 
   std::string name;
   if (map_type == BPF_MAP_TYPE_STACK_TRACE)
@@ -50,7 +112,7 @@ Map::Map(enum bpf_map_type map_type)
     name = "stack";
     key_size = 4;
     value_size = sizeof(uintptr_t) * MAX_STACK_SIZE;
-    max_entries = 128;
+    max_entries_ = 128;
     flags = 0;
   }
   else if (map_type == BPF_MAP_TYPE_PERF_EVENT_ARRAY)
@@ -59,14 +121,14 @@ Map::Map(enum bpf_map_type map_type)
     name = "printf";
     key_size = 4;
     value_size = 4;
-    max_entries = cpus.size();
+    max_entries_ = cpus.size();
     flags = 0;
   }
   else
   {
     abort();
   }
-  mapfd_ = bpf_create_map(map_type, name.c_str(), key_size, value_size, max_entries, flags);
+  mapfd_ = bpf_create_map(map_type, name.c_str(), key_size, value_size, max_entries_, flags);
   if (mapfd_ < 0)
   {
     std::string name;
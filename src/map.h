@@ -4,9 +4,30 @@
 
 namespace bpftrace {
 
+// Creates a map holding one u64 per task, which the kernel frees when the
+// task exits
+int create_task_storage_map(const std::string &name, int value_size);
+
+// Lets userspace wait for every BPF program which is currently running to
+// finish
+class ProgramBarrier {
+public:
+  ProgramBarrier();
+  ~ProgramBarrier();
+  ProgramBarrier(const ProgramBarrier &) = delete;
+  ProgramBarrier& operator=(const ProgramBarrier &) = delete;
+
+  int wait();
+
+private:
+  int inner_mapfd_;
+  int outer_mapfd_;
+};
+
 class Map : public IMap {
 public:
-  Map(const std::string &name, const SizedType &type, const MapKey &key);
+  Map(const std::string &name, const SizedType &type, const MapKey &key,
+      enum bpf_map_type map_type, int max_entries);
   Map(enum bpf_map_type map_type);
   virtual ~Map() override;
 };
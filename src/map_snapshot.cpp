@@ -0,0 +1,31 @@
+#include <cstring>
+
+#include "map_snapshot.h"
+
+namespace bpftrace {
+
+void MapSnapshot::clear(size_t key_size, size_t value_size)
+{
+  key_size_ = key_size;
+  value_size_ = value_size;
+  data_.clear();
+  order_.clear();
+}
+
+void MapSnapshot::add(const uint8_t *key, const uint8_t *value)
+{
+  size_t offset = data_.size();
+  data_.resize(offset + key_size_ + value_size_);
+  std::memcpy(data_.data() + offset, key, key_size_);
+  std::memcpy(data_.data() + offset + key_size_, value, value_size_);
+  order_.push_back(order_.size());
+}
+
+void MapSnapshot::replace(size_t slot, const uint8_t *key, const uint8_t *value)
+{
+  uint8_t *data = data_.data() + slot * (key_size_ + value_size_);
+  std::memcpy(data, key, key_size_);
+  std::memcpy(data + key_size_, value, value_size_);
+}
+
+} // namespace bpftrace
@@ -0,0 +1,52 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+namespace bpftrace {
+
+// Elements read out of a map, with each key followed by its value in a
+// single buffer, so there's no allocation per element. Clearing a snapshot
+// keeps its buffer, so refilling it each time a map is printed doesn't
+// allocate either once it's grown to the size of the map.
+class MapSnapshot
+{
+public:
+  void clear(size_t key_size, size_t value_size);
+  void add(const uint8_t *key, const uint8_t *value);
+  // Overwrites the element added in slot, keeping its place in the order
+  void replace(size_t slot, const uint8_t *key, const uint8_t *value);
+
+  size_t size() const { return order_.size(); }
+  size_t key_size() const { return key_size_; }
+  size_t value_size() const { return value_size_; }
+
+  // The i-th element in sorted order, or the order elements were added in
+  // if the snapshot hasn't been sorted
+  const uint8_t *key(size_t i) const { return slot_key(order_[i]); }
+  const uint8_t *value(size_t i) const { return key(i) + key_size_; }
+
+  // Elements by the order they were added in, however they're sorted
+  const uint8_t *slot_key(size_t slot) const
+  {
+    return data_.data() + slot * (key_size_ + value_size_);
+  }
+  const uint8_t *slot_value(size_t slot) const { return slot_key(slot) + key_size_; }
+
+  // Sorts elements without moving them, by comparing the slots they were
+  // added in. Elements which compare equal stay in the order they were added.
+  template <typename Compare>
+  void sort(Compare less)
+  {
+    std::stable_sort(order_.begin(), order_.end(), less);
+  }
+
+private:
+  size_t key_size_ = 0;
+  size_t value_size_ = 0;
+  std::vector<uint8_t> data_;
+  std::vector<size_t> order_;
+};
+
+} // namespace bpftrace
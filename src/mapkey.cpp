@@ -30,30 +30,29 @@ std::string MapKey::argument_type_list() const
   return list.str();
 }
 
-std::string MapKey::argument_value_list(BPFtrace &bpftrace,
-    const std::vector<uint8_t> &data) const
+void MapKey::argument_value_list(BPFtrace &bpftrace,
+    const uint8_t *data, OutputBuffer &out) const
 {
   size_t n = args_.size();
   if (n == 0)
-    return "";
+    return;
 
-  std::ostringstream list;
-  list << "[";
+  out << '[';
   int offset = 0;
-  for (size_t i = 0; i < n-1; i++)
+  for (size_t i = 0; i < n; i++)
   {
+    if (i > 0)
+      out << ", ";
     const SizedType &arg = args_.at(i);
-    list << argument_value(bpftrace, arg, &data.at(offset)) << ", ";
+    argument_value(bpftrace, arg, data + offset, out);
     offset += arg.size;
   }
-  const SizedType &arg = args_.at(n-1);
-  list << argument_value(bpftrace, arg, &data.at(offset)) << "]";
-  return list.str();
+  out << ']';
 }
 
-std::string MapKey::argument_value(BPFtrace &bpftrace,
+void MapKey::argument_value(BPFtrace &bpftrace,
     const SizedType &arg,
-    const void *data)
+    const void *data, OutputBuffer &out)
 {
   switch (arg.type)
   {
@@ -61,20 +60,42 @@ std::string MapKey::argument_value(BPFtrace &bpftrace,
       switch (arg.size)
       {
         case 8:
-          return std::to_string(*(int64_t*)data);
+          out << *(int64_t*)data;
+          return;
         case 4:
-          return std::to_string(*(int32_t*)data);
+          out << *(int32_t*)data;
+          return;
+        case 2:
+          out << (int64_t)*(int16_t*)data;
+          return;
+        case 1:
+          out << (int64_t)*(int8_t*)data;
+          return;
       }
+      break;
     case Type::stack:
-      return bpftrace.get_stack(*(uint32_t*)data, false);
+      out << bpftrace.get_stack(*(uint32_t*)data, false);
+      return;
     case Type::ustack:
-      return bpftrace.get_stack(*(uint32_t*)data, true);
+      out << bpftrace.get_stack(*(uint32_t*)data, true);
+      return;
     case Type::sym:
-      return bpftrace.resolve_sym(*(uint64_t*)data);
+      out << bpftrace.resolve_sym(*(uint64_t*)data);
+      return;
     case Type::usym:
-      return bpftrace.resolve_usym(*(uint64_t*)data);
+      out << bpftrace.resolve_usym(*(uint64_t*)data);
+      return;
+    case Type::func:
+      out << bpftrace.resolve_func(*(uint64_t*)data);
+      return;
+    case Type::syscall:
+      out << bpftrace.resolve_syscall(*(uint64_t*)data);
+      return;
     case Type::string:
-      return std::string((char*)data);
+      out << (const char*)data;
+      return;
+    default:
+      break;
   }
   abort();
 }
@@ -3,6 +3,7 @@
 #include <string>
 #include <vector>
 
+#include "output.h"
 #include "types.h"
 
 namespace bpftrace {
@@ -18,13 +19,13 @@ public:
 
   size_t size() const;
   std::string argument_type_list() const;
-  std::string argument_value_list(BPFtrace &bpftrace,
-      const std::vector<uint8_t> &data) const;
+  void argument_value_list(BPFtrace &bpftrace,
+      const uint8_t *data, OutputBuffer &out) const;
 
 private:
-  static std::string argument_value(BPFtrace &bpftrace,
+  static void argument_value(BPFtrace &bpftrace,
       const SizedType &arg,
-      const void *data);
+      const void *data, OutputBuffer &out);
 };
 
 } // namespace bpftrace
@@ -0,0 +1,325 @@
+#include <algorithm>
+#include <cstring>
+
+#include "output.h"
+
+namespace bpftrace {
+
+namespace {
+
+const char digit_pairs[] =
+  "00010203040506070809"
+  "10111213141516171819"
+  "20212223242526272829"
+  "30313233343536373839"
+  "40414243444546474849"
+  "50515253545556575859"
+  "60616263646566676869"
+  "70717273747576777879"
+  "80818283848586878889"
+  "90919293949596979899";
+
+// The length of the well-formed UTF-8 sequence starting at s[i], or 0 if
+// there isn't one. Overlong encodings, surrogates and code points past
+// U+10FFFF aren't well-formed.
+size_t utf8_length(const std::string &s, size_t i)
+{
+  unsigned char c = s[i];
+  size_t len;
+  unsigned char min = 0x80, max = 0xbf;
+  if (c >= 0xc2 && c <= 0xdf)
+    len = 2;
+  else if (c >= 0xe0 && c <= 0xef)
+  {
+    len = 3;
+    if (c == 0xe0)
+      min = 0xa0;
+    else if (c == 0xed)
+      max = 0x9f;
+  }
+  else if (c >= 0xf0 && c <= 0xf4)
+  {
+    len = 4;
+    if (c == 0xf0)
+      min = 0x90;
+    else if (c == 0xf4)
+      max = 0x8f;
+  }
+  else
+    return 0;
+
+  if (s.size() - i < len)
+    return 0;
+  for (size_t j = 1; j < len; j++)
+  {
+    unsigned char next = s[i + j];
+    if (next < min || next > max)
+      return 0;
+    min = 0x80;
+    max = 0xbf;
+  }
+  return len;
+}
+
+} // namespace
+
+OutputBuffer &OutputBuffer::operator<<(const char *s)
+{
+  append(s, strlen(s));
+  return *this;
+}
+
+OutputBuffer &OutputBuffer::operator<<(int64_t n)
+{
+  if (n < 0)
+  {
+    append("-", 1);
+    return *this << -(uint64_t)n;
+  }
+  return *this << (uint64_t)n;
+}
+
+OutputBuffer &OutputBuffer::operator<<(uint64_t n)
+{
+  // Written backwards from the last digit, two digits at a time
+  char digits[20];
+  char *end = digits + sizeof(digits);
+  char *start = end;
+  while (n >= 100)
+  {
+    const char *pair = &digit_pairs[(n % 100) * 2];
+    n /= 100;
+    *--start = pair[1];
+    *--start = pair[0];
+  }
+  if (n >= 10)
+  {
+    *--start = digit_pairs[n * 2 + 1];
+    *--start = digit_pairs[n * 2];
+  }
+  else
+    *--start = '0' + n;
+
+  append(start, end - start);
+  return *this;
+}
+
+OutputBuffer &OutputBuffer::operator<<(double n)
+{
+  // The same as std::ostream's default formatting
+  printf("%g", n);
+  return *this;
+}
+
+void OutputBuffer::append(const char *s, size_t len)
+{
+  reserve(len);
+  std::memcpy(buf_.data() + used_, s, len);
+  used_ += len;
+  if (used_ >= flush_size)
+    flush();
+}
+
+void OutputBuffer::fill(char c, size_t count)
+{
+  reserve(count);
+  std::memset(buf_.data() + used_, c, count);
+  used_ += count;
+  if (used_ >= flush_size)
+    flush();
+}
+
+void OutputBuffer::reserve(size_t len)
+{
+  if (buf_.size() - used_ < len)
+    buf_.resize(std::max(used_ + len, 2 * flush_size));
+}
+
+void OutputBuffer::flush()
+{
+  if (used_ == 0)
+    return;
+  fwrite(buf_.data(), 1, used_, file_);
+  fflush(file_);
+  used_ = 0;
+}
+
+void JsonWriter::begin_record(const std::string &type)
+{
+  out_ << '{';
+  nonempty_.assign(1, false);
+  after_field_ = false;
+  field("type");
+  value(type);
+}
+
+void JsonWriter::end_record()
+{
+  out_ << "}\n";
+}
+
+void JsonWriter::field(const std::string &name)
+{
+  separate();
+  write_string(name);
+  out_ << ": ";
+  after_field_ = true;
+}
+
+void JsonWriter::value(int64_t n)
+{
+  separate();
+  out_ << n;
+}
+
+void JsonWriter::value(uint64_t n)
+{
+  separate();
+  out_ << n;
+}
+
+void JsonWriter::value(const std::string &s)
+{
+  separate();
+  write_string(s);
+}
+
+void JsonWriter::begin_list()
+{
+  separate();
+  out_ << '[';
+  nonempty_.push_back(false);
+}
+
+void JsonWriter::end_list()
+{
+  nonempty_.pop_back();
+  out_ << ']';
+}
+
+void JsonWriter::begin_object()
+{
+  separate();
+  out_ << '{';
+  nonempty_.push_back(false);
+}
+
+void JsonWriter::end_object()
+{
+  nonempty_.pop_back();
+  out_ << '}';
+}
+
+void JsonWriter::separate()
+{
+  // A value straight after its field's name is part of the same item
+  if (after_field_)
+  {
+    after_field_ = false;
+    return;
+  }
+  if (nonempty_.back())
+    out_ << ", ";
+  nonempty_.back() = true;
+}
+
+void JsonWriter::write_string(const std::string &s)
+{
+  out_ << '"';
+  size_t start = 0;
+  for (size_t i = 0; i < s.size(); i++)
+  {
+    unsigned char c = s[i];
+    if (c != '"' && c != '\\' && c >= 0x20 && c < 0x80)
+      continue;
+
+    // JSON must be UTF-8, but strings read from the kernel can hold
+    // anything. Bytes which aren't part of a valid sequence are escaped.
+    if (c >= 0x80)
+    {
+      size_t len = utf8_length(s, i);
+      if (len)
+      {
+        i += len - 1;
+        continue;
+      }
+    }
+
+    out_.append(s.data() + start, i - start);
+    start = i + 1;
+    if (c == '"')
+      out_ << "\\\"";
+    else if (c == '\\')
+      out_ << "\\\\";
+    else if (c == '\n')
+      out_ << "\\n";
+    else if (c == '\t')
+      out_ << "\\t";
+    else
+      out_.printf("\\u%04x", c);
+  }
+  out_.append(s.data() + start, s.size() - start);
+  out_ << '"';
+}
+
+void BinaryWriter::begin_record(const std::string &type)
+{
+  record_.clear();
+  field("type");
+  value(type);
+}
+
+void BinaryWriter::end_record()
+{
+  uint32_t len = record_.size();
+  out_.append((const char*)&len, sizeof(len));
+  out_.append(record_.data(), record_.size());
+}
+
+void BinaryWriter::field(const std::string &name)
+{
+  record_ += (char)name.size();
+  record_ += name;
+}
+
+void BinaryWriter::value(int64_t n)
+{
+  record_ += 'i';
+  record_.append((const char*)&n, sizeof(n));
+}
+
+void BinaryWriter::value(uint64_t n)
+{
+  record_ += 'u';
+  record_.append((const char*)&n, sizeof(n));
+}
+
+void BinaryWriter::value(const std::string &s)
+{
+  uint32_t len = s.size();
+  record_ += 's';
+  record_.append((const char*)&len, sizeof(len));
+  record_ += s;
+}
+
+void BinaryWriter::begin_list()
+{
+  record_ += '[';
+}
+
+void BinaryWriter::end_list()
+{
+  record_ += ']';
+}
+
+void BinaryWriter::begin_object()
+{
+  record_ += '{';
+}
+
+void BinaryWriter::end_object()
+{
+  record_ += '\0';
+}
+
+} // namespace bpftrace
@@ -0,0 +1,144 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+namespace bpftrace {
+
+// Text waiting to be written out. Maps and printf() output are formatted
+// straight into one reusable buffer, which is only written to the file in
+// large chunks or when flushed.
+class OutputBuffer
+{
+public:
+  explicit OutputBuffer(FILE *file = stdout) : file_(file) { }
+  ~OutputBuffer() { flush(); }
+  OutputBuffer(const OutputBuffer &) = delete;
+  OutputBuffer& operator=(const OutputBuffer &) = delete;
+
+  OutputBuffer &operator<<(const std::string &s) { append(s.data(), s.size()); return *this; }
+  OutputBuffer &operator<<(const char *s);
+  OutputBuffer &operator<<(char c) { append(&c, 1); return *this; }
+  OutputBuffer &operator<<(int n) { return *this << (int64_t)n; }
+  OutputBuffer &operator<<(unsigned int n) { return *this << (uint64_t)n; }
+  OutputBuffer &operator<<(int64_t n);
+  OutputBuffer &operator<<(uint64_t n);
+  OutputBuffer &operator<<(double n);
+
+  void append(const char *s, size_t len);
+  void fill(char c, size_t count);
+
+  // Formats with snprintf(), straight into the buffer
+  template <typename... Args>
+  void printf(const char *fmt, Args... args)
+  {
+    size_t avail = buf_.size() - used_;
+    int len = snprintf(buf_.data() + used_, avail, fmt, args...);
+    if (len < 0)
+      return;
+    if ((size_t)len >= avail)
+    {
+      reserve(len + 1);
+      snprintf(buf_.data() + used_, len + 1, fmt, args...);
+    }
+    used_ += len;
+    if (used_ >= flush_size)
+      flush();
+  }
+
+  const char *data() const { return buf_.data(); }
+  size_t size() const { return used_; }
+  void flush();
+
+private:
+  void reserve(size_t len);
+
+  // Written out once this much has been formatted, even if not flushed
+  static const size_t flush_size = 64 * 1024;
+
+  FILE *file_;
+  std::vector<char> buf_;
+  size_t used_ = 0;
+};
+
+// Writes records of named fields, for output which is read by programs
+// rather than people. Each record is a type and the fields which follow it.
+class RecordWriter
+{
+public:
+  explicit RecordWriter(OutputBuffer &out) : out_(out) { }
+  virtual ~RecordWriter() { }
+
+  virtual void begin_record(const std::string &type) = 0;
+  virtual void end_record() = 0;
+
+  // Names the next value, in a record or object
+  virtual void field(const std::string &name) = 0;
+
+  virtual void value(int64_t n) = 0;
+  virtual void value(uint64_t n) = 0;
+  virtual void value(const std::string &s) = 0;
+  virtual void begin_list() = 0;
+  virtual void end_list() = 0;
+  virtual void begin_object() = 0;
+  virtual void end_object() = 0;
+
+protected:
+  OutputBuffer &out_;
+};
+
+// One JSON object per line
+class JsonWriter : public RecordWriter
+{
+public:
+  explicit JsonWriter(OutputBuffer &out) : RecordWriter(out) { }
+
+  void begin_record(const std::string &type) override;
+  void end_record() override;
+  void field(const std::string &name) override;
+  void value(int64_t n) override;
+  void value(uint64_t n) override;
+  void value(const std::string &s) override;
+  void begin_list() override;
+  void end_list() override;
+  void begin_object() override;
+  void end_object() override;
+
+private:
+  void separate();
+  void write_string(const std::string &s);
+
+  // Whether each list or object being written has anything in it yet
+  std::vector<bool> nonempty_;
+  bool after_field_ = false;
+};
+
+// Each record is a 32 bit length followed by that many bytes of fields. A
+// field is a one byte name length, the name, then a tagged value:
+//   'i' and an int64, 'u' and a uint64, 's' then a uint32 length and bytes,
+//   '[' then values up to a ']', or '{' then fields up to a zero name length.
+// Numbers are in the host's byte order.
+class BinaryWriter : public RecordWriter
+{
+public:
+  explicit BinaryWriter(OutputBuffer &out) : RecordWriter(out) { }
+
+  void begin_record(const std::string &type) override;
+  void end_record() override;
+  void field(const std::string &name) override;
+  void value(int64_t n) override;
+  void value(uint64_t n) override;
+  void value(const std::string &s) override;
+  void begin_list() override;
+  void end_list() override;
+  void begin_object() override;
+  void end_object() override;
+
+private:
+  // Records are built up here, so their length can be written first
+  std::string record_;
+};
+
+} // namespace bpftrace
@@ -32,7 +32,8 @@ std::string verify_format_string(const std::string &fmt, std::vector<SizedType>
   for (int i=0; i<num_args; i++, token_iter++)
   {
     Type arg_type = args.at(i).type;
-    if (arg_type == Type::sym || arg_type == Type::usym)
+    if (arg_type == Type::sym || arg_type == Type::usym ||
+        arg_type == Type::func || arg_type == Type::syscall)
       arg_type = Type::string; // Symbols should be printed as strings
     int offset = 1;
 
@@ -0,0 +1,390 @@
+#include <cstring>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <unordered_map>
+
+#include "bpftrace.h"
+#include "collector.h"
+#include "snapshot.h"
+
+namespace bpftrace {
+
+namespace {
+
+// What write_type() writes for each type
+const uint64_t type_len = sizeof(uint32_t) + sizeof(uint64_t) + 4 * sizeof(int64_t);
+
+// Whether a map's values can be merged as the type says. Aggregations must
+// have exactly the fields they're laid out with in SemanticAnalyser, and
+// only types which are saved to snapshots are allowed.
+bool valid_value_type(const SizedType &type)
+{
+  switch (type.type)
+  {
+    case Type::count:
+    case Type::sum:
+    case Type::quantize:
+      return type.size == sizeof(int64_t);
+    case Type::avg:
+    case Type::min:
+    case Type::max:
+      return type.size == 2 * sizeof(int64_t);
+    case Type::stats:
+      return type.size == 4 * sizeof(int64_t);
+    case Type::lhist:
+    case Type::llhist:
+      return type.size > 0 && type.size % sizeof(int64_t) == 0;
+    case Type::integer:
+      return type.size > 0 && type.size <= sizeof(int64_t);
+    case Type::distinct:
+    case Type::string:
+      return type.size > 0;
+    default:
+      return false;
+  }
+}
+
+} // namespace
+
+bool SnapshotMap::same_type(const SnapshotMap &other) const
+{
+  return type == other.type &&
+         type.hist_min == other.type.hist_min &&
+         type.hist_max == other.type.hist_max &&
+         type.hist_step == other.type.hist_step &&
+         key_args == other.key_args;
+}
+
+SnapshotWriter::SnapshotWriter(std::ostream &out, bool header)
+  : out_(out)
+{
+  if (!header)
+    return;
+  write(SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC));
+  write(&SNAPSHOT_VERSION, sizeof(SNAPSHOT_VERSION));
+}
+
+SnapshotWriter::SnapshotWriter(const std::string &path)
+  : path_(path),
+    file_(path, std::ios::binary | std::ios::trunc),
+    out_(file_)
+{
+  write(SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC));
+  write(&SNAPSHOT_VERSION, sizeof(SNAPSHOT_VERSION));
+}
+
+std::unique_ptr<SnapshotWriter> SnapshotWriter::create(const std::string &path)
+{
+  auto writer = std::unique_ptr<SnapshotWriter>(new SnapshotWriter(path));
+  if (!writer->file_)
+  {
+    std::cerr << "Error creating snapshot file '" << path << "': "
+              << strerror(errno) << std::endl;
+    return nullptr;
+  }
+  return writer;
+}
+
+void SnapshotWriter::write_map(const SnapshotMap &map)
+{
+  uint32_t name_len = map.name.size();
+  write(&name_len, sizeof(name_len));
+  write(map.name.data(), name_len);
+  write_type(map.type);
+  uint32_t num_args = map.key_args.size();
+  write(&num_args, sizeof(num_args));
+  for (auto &arg : map.key_args)
+    write_type(arg);
+  write(&map.num_elems, sizeof(map.num_elems));
+}
+
+void SnapshotWriter::write_elem(const std::string &key, const uint8_t *value, size_t value_size)
+{
+  uint32_t key_len = key.size();
+  write(&key_len, sizeof(key_len));
+  write(key.data(), key_len);
+  write(value, value_size);
+}
+
+void SnapshotWriter::write_sections(const std::string &sections)
+{
+  write(sections.data(), sections.size());
+}
+
+int SnapshotWriter::close()
+{
+  if (&out_ == &file_)
+    file_.close();
+  if (!out_)
+  {
+    std::cerr << "Error writing snapshot file '" << path_ << "'" << std::endl;
+    return -1;
+  }
+  return 0;
+}
+
+void SnapshotWriter::write(const void *data, size_t len)
+{
+  out_.write(static_cast<const char*>(data), len);
+}
+
+void SnapshotWriter::write_type(const SizedType &type)
+{
+  uint32_t type_id = static_cast<uint32_t>(type.type);
+  uint64_t size = type.size;
+  write(&type_id, sizeof(type_id));
+  write(&size, sizeof(size));
+  write(&type.hist_min, sizeof(type.hist_min));
+  write(&type.hist_max, sizeof(type.hist_max));
+  write(&type.hist_step, sizeof(type.hist_step));
+  write(&type.topk, sizeof(type.topk));
+}
+
+std::unique_ptr<SnapshotReader> SnapshotReader::open(const std::string &path)
+{
+  auto reader = std::unique_ptr<SnapshotReader>(new SnapshotReader(path));
+  if (!reader->file_)
+  {
+    std::cerr << "Error opening snapshot file '" << path << "': "
+              << strerror(errno) << std::endl;
+    return nullptr;
+  }
+  if (reader->read_header())
+    return nullptr;
+  return reader;
+}
+
+int SnapshotReader::read_header()
+{
+  header_read_ = true;
+
+  // Lengths read from the snapshot are checked against what's left of it
+  // before anything is allocated for them. Streams which can't seek are
+  // only checked as they're read.
+  auto start = in_.tellg();
+  in_.seekg(0, std::ios::end);
+  auto end = in_.tellg();
+  in_.seekg(start);
+  if (start >= 0 && end >= start)
+    remaining_ = end - start;
+  in_.clear();
+
+  char magic[sizeof(SNAPSHOT_MAGIC)];
+  uint32_t version = 0;
+  if (!read(magic, sizeof(magic)) ||
+      std::memcmp(magic, SNAPSHOT_MAGIC, sizeof(magic)) != 0)
+    return error("not a snapshot");
+  if (!read(&version, sizeof(version)) || version != SNAPSHOT_VERSION)
+    return error("unsupported version " + std::to_string(version));
+  return 0;
+}
+
+int SnapshotReader::read_map(SnapshotMap &map)
+{
+  if (!header_read_ && read_header())
+    return -1;
+
+  uint32_t name_len;
+  if (remaining_ == 0)
+    return 1;
+  if (!read(&name_len, sizeof(name_len)))
+    return in_.eof() && in_.gcount() == 0 ? 1 : error("truncated map");
+  if (name_len > remaining_)
+    return error("truncated map");
+
+  map.name.resize(name_len);
+  if (!read(&map.name[0], name_len))
+    return error("truncated map");
+  int err = read_type(map.type);
+  if (err)
+    return err;
+  if (!valid_value_type(map.type))
+    return error("invalid type for map '" + map.name + "'");
+
+  uint32_t num_args;
+  if (!read(&num_args, sizeof(num_args)))
+    return error("truncated map");
+  if (num_args > remaining_ / type_len)
+    return error("truncated map");
+  map.key_args.resize(num_args);
+  for (auto &arg : map.key_args)
+  {
+    if ((err = read_type(arg)))
+      return err;
+  }
+
+  // Every element has at least a key length and a value
+  if (!read(&map.num_elems, sizeof(map.num_elems)))
+    return error("truncated map");
+  if (map.num_elems > 0 && (map.type.size > remaining_ ||
+      map.num_elems > remaining_ / (sizeof(uint32_t) + map.type.size)))
+    return error("truncated map");
+
+  value_size_ = map.type.size;
+  return 0;
+}
+
+int SnapshotReader::read_elem(std::string &key, std::vector<uint8_t> &value)
+{
+  uint32_t key_len;
+  if (!read(&key_len, sizeof(key_len)) || key_len > remaining_)
+    return error("truncated element");
+  key.resize(key_len);
+  value.resize(value_size_);
+  if (!read(&key[0], key_len) || !read(value.data(), value_size_))
+    return error("truncated element");
+  return 0;
+}
+
+bool SnapshotReader::read(void *data, size_t len)
+{
+  if (len > remaining_)
+    return false;
+  in_.read(static_cast<char*>(data), len);
+  remaining_ -= len;
+  return static_cast<bool>(in_);
+}
+
+int SnapshotReader::read_type(SizedType &type)
+{
+  uint32_t type_id;
+  uint64_t size;
+  if (!read(&type_id, sizeof(type_id)) || !read(&size, sizeof(size)) ||
+      !read(&type.hist_min, sizeof(type.hist_min)) ||
+      !read(&type.hist_max, sizeof(type.hist_max)) ||
+      !read(&type.hist_step, sizeof(type.hist_step)) ||
+      !read(&type.topk, sizeof(type.topk)))
+    return error("truncated map");
+  if (type_id > static_cast<uint32_t>(Type::cast))
+    return error("unknown type " + std::to_string(type_id));
+  type.type = static_cast<Type>(type_id);
+  type.size = size;
+  return 0;
+}
+
+int SnapshotReader::error(const std::string &what)
+{
+  std::cerr << "Error reading snapshot '" << path_ << "': " << what << std::endl;
+  return -1;
+}
+
+SnapshotWriter &SnapshotFile::begin_map(const SnapshotMap &map)
+{
+  section_name_ = map.name;
+  section_.str("");
+  section_writer_ = std::make_unique<SnapshotWriter>(section_, false);
+  section_writer_->write_map(map);
+  return *section_writer_;
+}
+
+int SnapshotFile::save()
+{
+  if (section_writer_)
+  {
+    sections_[section_name_] = section_.str();
+    section_writer_.reset();
+  }
+
+  // Written alongside and renamed over the old file, so readers never see
+  // a partly written one
+  std::string tmp_path = path_ + ".tmp";
+  auto writer = SnapshotWriter::create(tmp_path);
+  if (!writer)
+    return -1;
+  for (auto &section : sections_)
+    writer->write_sections(section.second);
+  if (writer->close())
+    return -1;
+  if (rename(tmp_path.c_str(), path_.c_str()) != 0)
+  {
+    std::cerr << "Error saving snapshot file '" << path_ << "': "
+              << strerror(errno) << std::endl;
+    return -1;
+  }
+  return 0;
+}
+
+int merge_snapshots(const std::vector<std::string> &inputs, const std::string &output)
+{
+  // Inputs are read one element at a time and folded into a table for each
+  // map, so only the merged maps are held in memory however many inputs
+  // there are. Maps are written out in the order they were first seen.
+  std::vector<SnapshotMap> maps;
+  std::vector<std::unordered_map<std::string, std::vector<uint8_t>>> elems_by_map;
+  std::map<std::string, size_t> map_ids;
+
+  std::string key;
+  std::vector<uint8_t> value;
+  for (auto &input : inputs)
+  {
+    std::unique_ptr<SnapshotReader> reader;
+    std::istringstream fetched;
+    if (is_address(input))
+    {
+      std::string snapshot;
+      if (query_collector(input, snapshot))
+        return -1;
+      fetched.str(snapshot);
+      reader.reset(new SnapshotReader(fetched, input));
+    }
+    else
+    {
+      reader = SnapshotReader::open(input);
+      if (!reader)
+        return -1;
+    }
+
+    SnapshotMap map;
+    int err;
+    while ((err = reader->read_map(map)) == 0)
+    {
+      auto map_id = map_ids.find(map.name);
+      if (map_id == map_ids.end())
+      {
+        map_id = map_ids.emplace(map.name, maps.size()).first;
+        maps.push_back(map);
+        elems_by_map.emplace_back();
+      }
+      else
+      {
+        if (!maps.at(map_id->second).same_type(map))
+        {
+          std::cerr << "Map '" << map.name << "' in '" << input
+                    << "' has a different type to earlier snapshots" << std::endl;
+          return -1;
+        }
+      }
+
+      auto &elems = elems_by_map.at(map_id->second);
+      for (uint64_t i = 0; i < map.num_elems; i++)
+      {
+        if (reader->read_elem(key, value))
+          return -1;
+        auto search = elems.find(key);
+        if (search == elems.end())
+          elems.emplace(key, value);
+        else
+          BPFtrace::merge_value(map.type, search->second, value, 1);
+      }
+    }
+    if (err < 0)
+      return -1;
+  }
+
+  auto writer = SnapshotWriter::create(output);
+  if (!writer)
+    return -1;
+  for (size_t i = 0; i < maps.size(); i++)
+  {
+    auto &map = maps.at(i);
+    auto &elems = elems_by_map.at(i);
+    map.num_elems = elems.size();
+    writer->write_map(map);
+    for (auto &elem : elems)
+      writer->write_elem(elem.first, elem.second.data(), elem.second.size());
+  }
+  return writer->close();
+}
+
+} // namespace bpftrace
@@ -0,0 +1,130 @@
+#pragma once
+
+#include <cstdint>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "types.h"
+
+namespace bpftrace {
+
+// Snapshot files hold the elements of maps as they were when printed, with
+// each CPU's values combined and the symbols and stacks in keys resolved to
+// text, so snapshots taken on different hosts can be merged.
+//
+// A file starts with SNAPSHOT_MAGIC and a 32 bit version, followed by a
+// section for each map printed. A section has the map's name, its type and
+// the types of its key's arguments, then a 64 bit count of elements. Each
+// element is a key, prefixed by its 32 bit length, followed by a value the
+// size of the map's type. Numbers are in the host's byte order.
+//
+// Keys are laid out like map keys, except that stacks are a 32 bit count of
+// frames and the other symbolised types are a single string, with each
+// string prefixed by its 32 bit length. quantize() maps have the bucket
+// number on the end of their keys, as they do in the kernel.
+const char SNAPSHOT_MAGIC[8] = { 'B', 'P', 'F', 'T', 'S', 'N', 'A', 'P' };
+const uint32_t SNAPSHOT_VERSION = 1;
+
+struct SnapshotMap
+{
+  std::string name;
+  SizedType type;
+  std::vector<SizedType> key_args;
+  uint64_t num_elems = 0;
+
+  // Whether elements of the two maps can be merged
+  bool same_type(const SnapshotMap &other) const;
+};
+
+class SnapshotWriter
+{
+public:
+  // Writes to a stream, such as a message being built up. Without a
+  // header, only sections are written, to be put in a snapshot later.
+  explicit SnapshotWriter(std::ostream &out, bool header = true);
+
+  // Returns nullptr if the file can't be created
+  static std::unique_ptr<SnapshotWriter> create(const std::string &path);
+
+  // Starts a map's section, which must be followed by num_elems elements
+  void write_map(const SnapshotMap &map);
+  void write_elem(const std::string &key, const uint8_t *value, size_t value_size);
+  // Copies in whole sections, from a writer without a header
+  void write_sections(const std::string &sections);
+  int close();
+
+private:
+  explicit SnapshotWriter(const std::string &path);
+  void write(const void *data, size_t len);
+  void write_type(const SizedType &type);
+
+  std::string path_;
+  std::ofstream file_;
+  std::ostream &out_;
+};
+
+class SnapshotReader
+{
+public:
+  // Reads from a stream, such as a message which has been received. name is
+  // used in error messages.
+  SnapshotReader(std::istream &in, const std::string &name)
+    : path_(name), in_(in) { }
+
+  // Returns nullptr if the file can't be opened, or isn't a snapshot
+  static std::unique_ptr<SnapshotReader> open(const std::string &path);
+
+  // Reads the start of the next map's section. Returns 1 at the end of the
+  // file, and -1 on errors.
+  int read_map(SnapshotMap &map);
+  int read_elem(std::string &key, std::vector<uint8_t> &value);
+
+private:
+  explicit SnapshotReader(const std::string &path)
+    : path_(path), file_(path, std::ios::binary), in_(file_) { }
+  int read_header();
+  bool read(void *data, size_t len);
+  int read_type(SizedType &type);
+  int error(const std::string &what);
+
+  std::string path_;
+  std::ifstream file_;
+  std::istream &in_;
+  bool header_read_ = false;
+  size_t value_size_ = 0;
+  // Bytes left to read, if the stream's length is known
+  uint64_t remaining_ = UINT64_MAX;
+};
+
+// A snapshot file holding the latest section saved for each map. The file is
+// rewritten whenever a section is saved, so a map saved each time it's
+// printed appears once, with its latest elements, and the file is complete
+// while tracing is still running.
+class SnapshotFile
+{
+public:
+  explicit SnapshotFile(const std::string &path) : path_(path) { }
+
+  // Starts a new section for a map, which replaces any earlier one for it
+  // when saved. It must be followed by map.num_elems elements.
+  SnapshotWriter &begin_map(const SnapshotMap &map);
+  int save();
+
+private:
+  std::string path_;
+  std::map<std::string, std::string> sections_;
+  std::string section_name_;
+  std::ostringstream section_;
+  std::unique_ptr<SnapshotWriter> section_writer_;
+};
+
+// Combines the maps in many snapshots into one, merging elements with the
+// same key the way each CPU's copies of them are combined. Inputs can be
+// files, or the addresses of collectors to fetch merged maps from.
+int merge_snapshots(const std::vector<std::string> &inputs, const std::string &output);
+
+} // namespace bpftrace
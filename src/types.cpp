@@ -28,17 +28,49 @@ std::string typestr(Type t)
     case Type::none:     return "none";     break;
     case Type::integer:  return "integer";  break;
     case Type::quantize: return "quantize"; break;
+    case Type::lhist:    return "lhist";    break;
+    case Type::llhist:   return "llhist";   break;
     case Type::count:    return "count";    break;
+    case Type::sum:      return "sum";      break;
+    case Type::min:      return "min";      break;
+    case Type::max:      return "max";      break;
+    case Type::avg:      return "avg";      break;
+    case Type::stats:    return "stats";    break;
+    case Type::distinct: return "distinct"; break;
+    case Type::topk:     return "topk";     break;
     case Type::stack:    return "stack";    break;
     case Type::ustack:   return "ustack";   break;
     case Type::string:   return "string";   break;
     case Type::sym:      return "sym";      break;
     case Type::usym:     return "usym";     break;
+    case Type::func:     return "func";     break;
+    case Type::syscall:  return "syscall";  break;
     case Type::cast:     return "cast";     break;
     default: abort();
   }
 }
 
+bool is_aggregation(Type t)
+{
+  switch (t)
+  {
+    case Type::quantize:
+    case Type::lhist:
+    case Type::llhist:
+    case Type::count:
+    case Type::sum:
+    case Type::min:
+    case Type::max:
+    case Type::avg:
+    case Type::stats:
+    case Type::distinct:
+    case Type::topk:
+      return true;
+    default:
+      return false;
+  }
+}
+
 ProbeType probetype(const std::string &type)
 {
   if (type == "kprobe")
@@ -57,6 +89,14 @@ ProbeType probetype(const std::string &type)
     return ProbeType::tracepoint;
   else if (type == "profile")
     return ProbeType::profile;
+  else if (type == "interval")
+    return ProbeType::interval;
+  else if (type == "kfunc")
+    return ProbeType::kfunc;
+  else if (type == "kretfunc")
+    return ProbeType::kretfunc;
+  else if (type == "syscall")
+    return ProbeType::syscall;
   abort();
 }
 
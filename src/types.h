@@ -1,5 +1,6 @@
 #pragma once
 
+#include <cstdint>
 #include <ostream>
 #include <sstream>
 #include <string>
@@ -10,23 +11,61 @@ namespace bpftrace {
 
 const int MAX_STACK_SIZE = 32;
 const int STRING_SIZE = 64;
+const int MAX_ARRAY_MAP_ENTRIES = 4096;
+const int MAX_HIST_BUCKETS = 1000;
+
+// Shape of the count-min sketch behind topk(). Counts are overestimated by at
+// most e/width of the total, with probability 1 - e^-depth (about 98%).
+const int TOPK_SKETCH_DEPTH = 4;
+const int TOPK_SKETCH_WIDTH = 2048;
+const int MAX_TOPK = 1000;
+
+// ld_imm64 instructions with this src_reg hold the ID of the function a probe
+// is attached to, and are patched with it when the program is loaded.
+const int FUNC_ID_PSEUDO_SRC = 0xf;
+// Patched in instead when one program is attached to many functions, telling
+// it to read the function ID from the attach cookie.
+const uint32_t FUNC_ID_FROM_COOKIE = 0xffffffff;
+
+// perf events start with the index of the printf() call they're for, or one
+// of these for builtins which are carried out by userspace
+enum class AsyncAction : uint64_t
+{
+  print = 1ULL << 32,
+  clear,
+};
 
 enum class Type
 {
   none,
   integer,
   quantize,
+  lhist,
+  llhist,
   count,
+  sum,
+  min,
+  max,
+  avg,
+  stats,
+  distinct,
+  topk,
   stack,
   ustack,
   string,
   sym,
   usym,
+  func,
+  syscall,
   cast,
 };
 
 std::ostream &operator<<(std::ostream &os, Type type);
 
+// Values produced by functions like count() and sum(), which are accumulated
+// separately on each CPU and combined when read
+bool is_aggregation(Type t);
+
 class SizedType
 {
 public:
@@ -37,6 +76,15 @@ public:
   size_t size;
   std::string cast_type;
 
+  // Bucket layout of lhist() values. llhist() only uses hist_step, for its
+  // number of sub-buckets per power of two.
+  int64_t hist_min = 0;
+  int64_t hist_max = 0;
+  int64_t hist_step = 0;
+
+  // Number of elements reported by topk()
+  int64_t topk = 0;
+
   bool operator==(const SizedType &t) const;
 };
 
@@ -51,6 +99,10 @@ enum class ProbeType
   uretprobe,
   tracepoint,
   profile,
+  interval,
+  kfunc,
+  kretfunc,
+  syscall,
 };
 
 std::string typestr(Type t);
@@ -65,6 +117,7 @@ public:
   std::string prog_name;
   std::string name;
   int freq;
+  int func_id = -1;
 };
 
 } // namespace bpftrace
@@ -1,6 +1,13 @@
+#include <chrono>
+#include <fcntl.h>
+#include <signal.h>
+#include <sstream>
+#include <sys/wait.h>
+
 #include "gmock/gmock.h"
 #include "gtest/gtest.h"
 #include "bpftrace.h"
+#include "collector.h"
 
 namespace bpftrace {
 namespace test {
@@ -35,6 +42,14 @@ void check_kprobe(Probe &p, const std::string &attach_point, const std::string &
   EXPECT_EQ("kprobe:" + attach_point, p.name);
 }
 
+void check_kfunc(Probe &p, ProbeType type, const std::string &attach_point, const std::string &prog_name)
+{
+  EXPECT_EQ(type, p.type);
+  EXPECT_EQ(attach_point, p.attach_point);
+  EXPECT_EQ(prog_name, p.prog_name);
+  EXPECT_EQ(std::string(type == ProbeType::kfunc ? "kfunc:" : "kretfunc:") + attach_point, p.name);
+}
+
 void check_uprobe(Probe &p, const std::string &path, const std::string &attach_point, const std::string &prog_name)
 {
   EXPECT_EQ(ProbeType::uprobe, p.type);
@@ -126,6 +141,27 @@ TEST(bpftrace, add_probes_multiple)
   check_kprobe(bpftrace.get_probes().at(1), "sys_write", probe_prog_name);
 }
 
+TEST(bpftrace, add_probes_func_ids)
+{
+  ast::AttachPoint a1("kprobe", "sys_read");
+  ast::AttachPoint a2("kretprobe", "sys_read");
+  ast::AttachPoint a3("kprobe", "sys_write");
+  ast::AttachPointList attach_points = { &a1, &a2, &a3 };
+  ast::Probe probe(&attach_points, nullptr, nullptr);
+
+  StrictMock<MockBPFtrace> bpftrace;
+  EXPECT_EQ(0, bpftrace.add_probe(probe));
+  EXPECT_EQ(3, bpftrace.get_probes().size());
+
+  EXPECT_EQ(0, bpftrace.get_probes().at(0).func_id);
+  EXPECT_EQ(0, bpftrace.get_probes().at(1).func_id);
+  EXPECT_EQ(1, bpftrace.get_probes().at(2).func_id);
+
+  EXPECT_EQ("sys_read", bpftrace.resolve_func(0));
+  EXPECT_EQ("sys_write", bpftrace.resolve_func(1));
+  EXPECT_EQ("[unknown]", bpftrace.resolve_func(2));
+}
+
 TEST(bpftrace, add_probes_character_class)
 {
   ast::AttachPoint a1("kprobe", "[Ss]y[Ss]_read");
@@ -206,6 +242,47 @@ TEST(bpftrace, add_probes_wildcard_no_matches)
   check_kprobe(bpftrace.get_probes().at(1), "sys_write", probe_prog_name);
 }
 
+TEST(bpftrace, add_probes_kfunc)
+{
+  ast::AttachPoint a1("kfunc", "vfs_read");
+  ast::AttachPoint a2("kretfunc", "vfs_read");
+  ast::AttachPointList attach_points = { &a1, &a2 };
+  ast::Probe probe(&attach_points, nullptr, nullptr);
+
+  StrictMock<MockBPFtrace> bpftrace;
+  EXPECT_EQ(0, bpftrace.add_probe(probe));
+  EXPECT_EQ(2, bpftrace.get_probes().size());
+  EXPECT_EQ(0, bpftrace.get_special_probes().size());
+
+  std::string probe_prog_name = "kfunc:vfs_read,kretfunc:vfs_read";
+  check_kfunc(bpftrace.get_probes().at(0), ProbeType::kfunc, "vfs_read", probe_prog_name);
+  check_kfunc(bpftrace.get_probes().at(1), ProbeType::kretfunc, "vfs_read", probe_prog_name);
+}
+
+TEST(bpftrace, add_probes_kfunc_wildcard)
+{
+  ast::AttachPoint a("kfunc", "vfs_*");
+  ast::AttachPointList attach_points = { &a };
+  ast::Probe probe(&attach_points, nullptr, nullptr);
+
+  StrictMock<MockBPFtrace> bpftrace;
+  std::set<std::string> matches = { "vfs_read", "vfs_write" };
+  ON_CALL(bpftrace, find_wildcard_matches(_, _, _))
+    .WillByDefault(Return(matches));
+  EXPECT_CALL(bpftrace,
+      find_wildcard_matches("", "vfs_*",
+        "/sys/kernel/debug/tracing/available_filter_functions"))
+    .Times(1);
+
+  EXPECT_EQ(0, bpftrace.add_probe(probe));
+  EXPECT_EQ(2, bpftrace.get_probes().size());
+  EXPECT_EQ(0, bpftrace.get_special_probes().size());
+
+  std::string probe_prog_name = "kfunc:vfs_*";
+  check_kfunc(bpftrace.get_probes().at(0), ProbeType::kfunc, "vfs_read", probe_prog_name);
+  check_kfunc(bpftrace.get_probes().at(1), ProbeType::kfunc, "vfs_write", probe_prog_name);
+}
+
 TEST(bpftrace, add_probes_uprobe)
 {
   ast::AttachPoint a("uprobe", "/bin/sh", "foo");
@@ -293,6 +370,36 @@ TEST(bpftrace, add_probes_tracepoint_wildcard_no_matches)
   EXPECT_EQ(0, bpftrace.get_special_probes().size());
 }
 
+TEST(bpftrace, add_probes_syscall)
+{
+  ast::AttachPoint a1("syscall", "enter", "read");
+  ast::AttachPoint a2("syscall", "enter", "write*");
+  ast::AttachPointList attach_points = { &a1, &a2 };
+  ast::Probe probe(&attach_points, nullptr, nullptr);
+
+  StrictMock<MockBPFtrace> bpftrace;
+  EXPECT_EQ(0, bpftrace.add_probe(probe));
+  EXPECT_EQ(1, bpftrace.get_probes().size());
+  EXPECT_EQ(0, bpftrace.get_special_probes().size());
+
+  Probe p = bpftrace.get_probes().at(0);
+  EXPECT_EQ(ProbeType::syscall, p.type);
+  EXPECT_EQ("raw_syscalls", p.path);
+  EXPECT_EQ("sys_enter", p.attach_point);
+  EXPECT_EQ("syscall:enter:read,syscall:enter:write*", p.prog_name);
+}
+
+TEST(bpftrace, find_syscalls)
+{
+  EXPECT_EQ(std::vector<int>({ 0 }), BPFtrace::find_syscalls("read"));
+  EXPECT_EQ(std::vector<int>({ 17, 295, 327 }), BPFtrace::find_syscalls("pread*"));
+  EXPECT_EQ(std::vector<int>(), BPFtrace::find_syscalls("not_a_syscall"));
+
+  BPFtrace bpftrace;
+  EXPECT_EQ("read", bpftrace.resolve_syscall(0));
+  EXPECT_EQ("syscall_1000", bpftrace.resolve_syscall(1000));
+}
+
 TEST(bpftrace, add_probes_profile)
 {
   ast::AttachPoint a("profile", "ms", 997);
@@ -361,6 +468,27 @@ std::pair<std::vector<uint8_t>, std::vector<uint8_t>> key_value_pair_int_str(int
   return pair;
 }
 
+// Sorts elements by loading them into a snapshot, then reads them back out
+// in sorted order
+void sort_by_key(const std::vector<SizedType> &key_args,
+    std::vector<std::pair<std::vector<uint8_t>, std::vector<uint8_t>>> &values_by_key)
+{
+  MapSnapshot snapshot;
+  snapshot.clear(values_by_key.at(0).first.size(), values_by_key.at(0).second.size());
+  for (auto &pair : values_by_key)
+    snapshot.add(pair.first.data(), pair.second.data());
+
+  BPFtrace::sort_by_key(key_args, snapshot);
+
+  values_by_key.clear();
+  for (size_t i = 0; i < snapshot.size(); i++)
+  {
+    values_by_key.push_back({
+        std::vector<uint8_t>(snapshot.key(i), snapshot.key(i) + snapshot.key_size()),
+        std::vector<uint8_t>(snapshot.value(i), snapshot.value(i) + snapshot.value_size())});
+  }
+}
+
 TEST(bpftrace, sort_by_key_int)
 {
   StrictMock<MockBPFtrace> bpftrace;
@@ -372,7 +500,7 @@ TEST(bpftrace, sort_by_key_int)
     key_value_pair_int({3}, 11),
     key_value_pair_int({1}, 10),
   };
-  bpftrace.sort_by_key(key_args, values_by_key);
+  sort_by_key(key_args, values_by_key);
 
   std::vector<std::pair<std::vector<uint8_t>, std::vector<uint8_t>>> expected_values =
   {
@@ -402,7 +530,7 @@ TEST(bpftrace, sort_by_key_int_int)
     key_value_pair_int({2,3,2}, 5),
     key_value_pair_int({2,1,2}, 6),
   };
-  bpftrace.sort_by_key(key_args, values_by_key);
+  sort_by_key(key_args, values_by_key);
 
   std::vector<std::pair<std::vector<uint8_t>, std::vector<uint8_t>>> expected_values =
   {
@@ -431,7 +559,7 @@ TEST(bpftrace, sort_by_key_str)
     key_value_pair_str({"x"}, 3),
     key_value_pair_str({"d"}, 4),
   };
-  bpftrace.sort_by_key(key_args, values_by_key);
+  sort_by_key(key_args, values_by_key);
 
   std::vector<std::pair<std::vector<uint8_t>, std::vector<uint8_t>>> expected_values =
   {
@@ -462,7 +590,7 @@ TEST(bpftrace, sort_by_key_str_str)
     key_value_pair_str({"z", "b", "p"}, 5),
     key_value_pair_str({"a", "b", "q"}, 6),
   };
-  bpftrace.sort_by_key(key_args, values_by_key);
+  sort_by_key(key_args, values_by_key);
 
   std::vector<std::pair<std::vector<uint8_t>, std::vector<uint8_t>>> expected_values =
   {
@@ -494,7 +622,7 @@ TEST(bpftrace, sort_by_key_int_str)
     key_value_pair_int_str(2, "a", 5),
     key_value_pair_int_str(3, "a", 6),
   };
-  bpftrace.sort_by_key(key_args, values_by_key);
+  sort_by_key(key_args, values_by_key);
 
   std::vector<std::pair<std::vector<uint8_t>, std::vector<uint8_t>>> expected_values =
   {
@@ -509,6 +637,888 @@ TEST(bpftrace, sort_by_key_int_str)
   EXPECT_THAT(values_by_key, ContainerEq(expected_values));
 }
 
+TEST(bpftrace, sort_by_key_int_widths)
+{
+  StrictMock<MockBPFtrace> bpftrace;
+
+  std::vector<SizedType> key_args = {
+    SizedType(Type::integer, 1),
+    SizedType(Type::integer, 4),
+    SizedType(Type::integer, 2),
+  };
+  auto key_value_pair = [](uint8_t a, uint32_t b, uint16_t c, int val)
+  {
+    std::pair<std::vector<uint8_t>, std::vector<uint8_t>> pair;
+    pair.first = std::vector<uint8_t>(7);
+    pair.second = std::vector<uint8_t>(sizeof(uint64_t));
+    pair.first.at(0) = a;
+    memcpy(pair.first.data() + 1, &b, sizeof(b));
+    memcpy(pair.first.data() + 5, &c, sizeof(c));
+    *(uint64_t*)pair.second.data() = val;
+    return pair;
+  };
+
+  std::vector<std::pair<std::vector<uint8_t>, std::vector<uint8_t>>> values_by_key =
+  {
+    key_value_pair(2, 1, 0x100, 1),
+    key_value_pair(1, 0x10000, 1, 2),
+    key_value_pair(2, 1, 0xff, 3),
+    key_value_pair(1, 0xff, 2, 4),
+    key_value_pair(1, 0xff, 2, 5),
+  };
+  sort_by_key(key_args, values_by_key);
+
+  std::vector<std::pair<std::vector<uint8_t>, std::vector<uint8_t>>> expected_values =
+  {
+    key_value_pair(1, 0xff, 2, 4),
+    key_value_pair(1, 0xff, 2, 5),
+    key_value_pair(1, 0x10000, 1, 2),
+    key_value_pair(2, 1, 0xff, 3),
+    key_value_pair(2, 1, 0x100, 1),
+  };
+
+  EXPECT_THAT(values_by_key, ContainerEq(expected_values));
+}
+
+TEST(bpftrace, map_snapshot)
+{
+  MapSnapshot snapshot;
+  snapshot.clear(2, 1);
+  uint8_t elems[][3] = { { 3, 0, 30 }, { 1, 0, 10 }, { 2, 0, 20 } };
+  for (auto &elem : elems)
+    snapshot.add(elem, elem + 2);
+  ASSERT_EQ(snapshot.size(), 3U);
+  EXPECT_EQ(snapshot.key(0)[0], 3);
+  EXPECT_EQ(*snapshot.value(0), 30);
+
+  // Sorting orders elements without moving them from their slots
+  snapshot.sort([&](size_t a, size_t b)
+  {
+    return snapshot.slot_key(a)[0] < snapshot.slot_key(b)[0];
+  });
+  EXPECT_EQ(snapshot.key(0)[0], 1);
+  EXPECT_EQ(*snapshot.value(1), 20);
+  EXPECT_EQ(*snapshot.value(2), 30);
+  EXPECT_EQ(*snapshot.slot_value(0), 30);
+
+  // Replacing an element keeps its place in the order
+  uint8_t replacement[] = { 4, 0, 40 };
+  snapshot.replace(1, replacement, replacement + 2);
+  EXPECT_EQ(snapshot.key(0)[0], 4);
+  EXPECT_EQ(*snapshot.value(0), 40);
+  EXPECT_EQ(snapshot.size(), 3U);
+
+  // Clearing keeps the buffer for refilling, with new strides
+  snapshot.clear(1, 0);
+  EXPECT_EQ(snapshot.size(), 0U);
+  snapshot.add(elems[1], elems[1] + 1);
+  ASSERT_EQ(snapshot.size(), 1U);
+  EXPECT_EQ(snapshot.key(0)[0], 1);
+}
+
+TEST(bpftrace, output_buffer)
+{
+  FILE *file = tmpfile();
+  ASSERT_NE(file, nullptr);
+  {
+    OutputBuffer out(file);
+    out << "@x[" << 0 << ", " << -7 << ", " << INT64_MIN << ", " << UINT64_MAX << "]: ";
+    out << 99.9 << ' ' << std::string("str");
+    out.fill('@', 3);
+    out.printf(" %-4s|%3d", "ab", 5);
+    EXPECT_EQ(std::string(out.data(), out.size()),
+              "@x[0, -7, -9223372036854775808, 18446744073709551615]: 99.9 str@@@ ab  |  5");
+
+    // Long output is written out in chunks without being flushed
+    for (int i = 0; i < 100000; i++)
+      out << i << '\n';
+    EXPECT_LT(out.size(), 64 * 1024U);
+  }
+
+  // Everything left is written out when the buffer goes away
+  fseek(file, 0, SEEK_END);
+  long size = ftell(file);
+  rewind(file);
+  std::string written(size, '\0');
+  ASSERT_EQ(fread(&written[0], 1, size, file), (size_t)size);
+  fclose(file);
+  EXPECT_EQ(written.substr(written.size() - 12), "99998\n99999\n");
+}
+
+void write_test_record(RecordWriter &writer)
+{
+  writer.begin_record("map");
+  writer.field("key");
+  writer.begin_list();
+  writer.value((int64_t)-1);
+  writer.value(std::string("a\"b\n"));
+  writer.end_list();
+  writer.field("value");
+  writer.begin_object();
+  writer.field("count");
+  writer.value((uint64_t)2);
+  writer.end_object();
+  writer.end_record();
+}
+
+TEST(bpftrace, json_writer)
+{
+  FILE *file = tmpfile();
+  ASSERT_NE(file, nullptr);
+  {
+    OutputBuffer out(file);
+    JsonWriter writer(out);
+    write_test_record(writer);
+    EXPECT_EQ(std::string(out.data(), out.size()),
+              "{\"type\": \"map\", \"key\": [-1, \"a\\\"b\\n\"], \"value\": {\"count\": 2}}\n");
+  }
+  fclose(file);
+}
+
+TEST(bpftrace, json_writer_utf8)
+{
+  FILE *file = tmpfile();
+  ASSERT_NE(file, nullptr);
+  {
+    OutputBuffer out(file);
+    JsonWriter writer(out);
+    writer.begin_record("map");
+    writer.field("key");
+    // Valid sequences are kept, while stray continuation bytes, truncated
+    // sequences, overlong encodings and surrogates are escaped byte by byte
+    writer.value(std::string("\xc3\xa9\xe2\x82\xac \x80 \xe2\x82 \xc0\xaf \xed\xa0\x80 \xff"));
+    writer.end_record();
+    EXPECT_EQ(std::string(out.data(), out.size()),
+              "{\"type\": \"map\", \"key\": \"\xc3\xa9\xe2\x82\xac \\u0080 \\u00e2\\u0082 "
+              "\\u00c0\\u00af \\u00ed\\u00a0\\u0080 \\u00ff\"}\n");
+  }
+  fclose(file);
+}
+
+TEST(bpftrace, binary_writer)
+{
+  FILE *file = tmpfile();
+  ASSERT_NE(file, nullptr);
+  OutputBuffer out(file);
+  BinaryWriter writer(out);
+  write_test_record(writer);
+
+  std::string expected;
+  auto append = [&](const void *data, size_t len) { expected.append((const char*)data, len); };
+  int64_t minus_one = -1;
+  uint64_t two = 2;
+  uint32_t type_len = 3, str_len = 4;
+  expected += "\x04type" "s";
+  append(&type_len, 4);
+  expected += "map";
+  expected += "\x03key" "[" "i";
+  append(&minus_one, 8);
+  expected += "s";
+  append(&str_len, 4);
+  expected += "a\"b\n" "]";
+  expected += "\x05value" "{" "\x05" "count" "u";
+  append(&two, 8);
+  expected += '\0';
+
+  uint32_t len = expected.size();
+  ASSERT_EQ(out.size(), 4 + expected.size());
+  EXPECT_EQ(*(const uint32_t*)out.data(), len);
+  EXPECT_EQ(std::string(out.data() + 4, out.size() - 4), expected);
+
+  out.flush();
+  fclose(file);
+}
+
+std::string temp_file()
+{
+  char path[] = "/tmp/bpftrace-test-XXXXXX";
+  int fd = mkstemp(path);
+  close(fd);
+  return path;
+}
+
+// The map snapshot tests use: count()s keyed by a string
+SnapshotMap counts_map(size_t num_elems)
+{
+  SnapshotMap map;
+  map.name = "@counts";
+  map.type = SizedType(Type::count, 8);
+  map.key_args = { SizedType(Type::string, STRING_SIZE) };
+  map.num_elems = num_elems;
+  return map;
+}
+
+void write_counts(SnapshotWriter &writer, const std::map<std::string, int64_t> &counts)
+{
+  for (auto &elem : counts)
+    writer.write_elem(elem.first, (const uint8_t*)&elem.second, 8);
+}
+
+// Reads the elements of a @counts section which has just been started
+std::map<std::string, int64_t> read_counts(SnapshotReader &reader, const SnapshotMap &map)
+{
+  EXPECT_EQ(map.name, "@counts");
+  EXPECT_EQ(map.type, SizedType(Type::count, 8));
+  std::string key;
+  std::vector<uint8_t> value;
+  std::map<std::string, int64_t> counts;
+  for (uint64_t i = 0; i < map.num_elems; i++)
+  {
+    EXPECT_EQ(reader.read_elem(key, value), 0);
+    counts[key] = *(int64_t*)value.data();
+  }
+  return counts;
+}
+
+std::string counts_snapshot(const std::map<std::string, int64_t> &counts)
+{
+  std::ostringstream out;
+  SnapshotWriter writer(out);
+  writer.write_map(counts_map(counts.size()));
+  write_counts(writer, counts);
+  return out.str();
+}
+
+std::map<std::string, int64_t> read_counts(const std::string &snapshot)
+{
+  std::istringstream in(snapshot);
+  SnapshotReader reader(in, "snapshot");
+  SnapshotMap map;
+  std::map<std::string, int64_t> counts;
+  while (reader.read_map(map) == 0)
+  {
+    for (auto &elem : read_counts(reader, map))
+      counts[elem.first] += elem.second;
+  }
+  return counts;
+}
+
+void write_snapshot(const std::string &path, const std::map<std::string, int64_t> &counts,
+    const std::vector<int64_t> &min)
+{
+  auto writer = SnapshotWriter::create(path);
+  ASSERT_NE(writer, nullptr);
+
+  writer->write_map(counts_map(counts.size()));
+  write_counts(*writer, counts);
+
+  SnapshotMap map;
+  map.name = "@min";
+  map.type = SizedType(Type::min, 16);
+  map.num_elems = 1;
+  writer->write_map(map);
+  writer->write_elem("", (const uint8_t*)min.data(), 16);
+  EXPECT_EQ(writer->close(), 0);
+}
+
+TEST(bpftrace, merge_snapshots)
+{
+  auto a = temp_file(), b = temp_file(), merged = temp_file();
+  write_snapshot(a, { { "x", 1 }, { "y", 2 } }, { 5, 1 });
+  write_snapshot(b, { { "y", 10 }, { "z", 3 } }, { 3, 1 });
+  ASSERT_EQ(merge_snapshots({ a, b }, merged), 0);
+
+  auto reader = SnapshotReader::open(merged);
+  ASSERT_NE(reader, nullptr);
+  SnapshotMap map;
+  std::string key;
+  std::vector<uint8_t> value;
+
+  // Counts add up
+  ASSERT_EQ(reader->read_map(map), 0);
+  ASSERT_EQ(map.key_args.size(), 1U);
+  EXPECT_EQ(map.key_args.at(0), SizedType(Type::string, STRING_SIZE));
+  EXPECT_EQ(read_counts(*reader, map),
+            (std::map<std::string, int64_t>{ { "x", 1 }, { "y", 12 }, { "z", 3 } }));
+
+  // min() keeps the smallest
+  ASSERT_EQ(reader->read_map(map), 0);
+  EXPECT_EQ(map.name, "@min");
+  ASSERT_EQ(map.num_elems, 1U);
+  ASSERT_EQ(reader->read_elem(key, value), 0);
+  EXPECT_EQ(*(int64_t*)value.data(), 3);
+
+  EXPECT_EQ(reader->read_map(map), 1);
+
+  // Maps with the same name must have the same type
+  std::ofstream(a, std::ios::trunc);
+  EXPECT_EQ(SnapshotReader::open(a), nullptr);
+  write_snapshot(a, { }, { 1, 1 });
+  {
+    auto writer = SnapshotWriter::create(b);
+    map.name = "@min";
+    map.type = SizedType(Type::max, 16);
+    map.num_elems = 0;
+    writer->write_map(map);
+    writer->close();
+  }
+  EXPECT_NE(merge_snapshots({ a, b }, merged), 0);
+
+  unlink(a.c_str());
+  unlink(b.c_str());
+  unlink(merged.c_str());
+}
+
+TEST(bpftrace, snapshot_file_replaces_sections)
+{
+  auto path = temp_file(), merged = temp_file();
+  SnapshotFile file(path);
+
+  // A map printed twice holds running totals both times, so only the
+  // latest section is kept
+  write_counts(file.begin_map(counts_map(2)), { { "x", 1 }, { "y", 2 } });
+  ASSERT_EQ(file.save(), 0);
+  write_counts(file.begin_map(counts_map(2)), { { "x", 3 }, { "y", 5 } });
+  ASSERT_EQ(file.save(), 0);
+  ASSERT_EQ(merge_snapshots({ path }, merged), 0);
+
+  auto reader = SnapshotReader::open(merged);
+  ASSERT_NE(reader, nullptr);
+  SnapshotMap map;
+  ASSERT_EQ(reader->read_map(map), 0);
+  EXPECT_EQ(read_counts(*reader, map),
+            (std::map<std::string, int64_t>{ { "x", 3 }, { "y", 5 } }));
+  EXPECT_EQ(reader->read_map(map), 1);
+
+  unlink(path.c_str());
+  unlink(merged.c_str());
+}
+
+TEST(bpftrace, collector)
+{
+  Collector collector;
+  EXPECT_EQ(read_counts(collector.merged()), (std::map<std::string, int64_t>{ }));
+
+  ASSERT_EQ(collector.add("a", counts_snapshot({ { "x", 1 }, { "y", 2 } })), 0);
+  ASSERT_EQ(collector.add("b", counts_snapshot({ { "y", 10 } })), 0);
+  EXPECT_EQ(read_counts(collector.merged()),
+            (std::map<std::string, int64_t>{ { "x", 1 }, { "y", 12 } }));
+
+  // Agents only send elements which have changed, with their new totals
+  ASSERT_EQ(collector.add("a", counts_snapshot({ { "y", 4 } })), 0);
+  ASSERT_EQ(collector.add("b", counts_snapshot({ })), 0);
+  EXPECT_EQ(read_counts(collector.merged()),
+            (std::map<std::string, int64_t>{ { "x", 1 }, { "y", 14 } }));
+
+  // Maps with the same name must have the same type
+  std::ostringstream out;
+  SnapshotWriter writer(out);
+  SnapshotMap map = counts_map(0);
+  map.type = SizedType(Type::sum, 8);
+  writer.write_map(map);
+  EXPECT_NE(collector.add("c", out.str()), 0);
+  EXPECT_NE(collector.add("c", "not a snapshot"), 0);
+}
+
+TEST(bpftrace, collector_rejects_invalid_snapshots)
+{
+  // Offsets into a snapshot of @counts with the one element "x"
+  const std::string valid = counts_snapshot({ { "x", 1 } });
+  const size_t name_len = 12, type_id = 16 + strlen("@counts"), type_size = type_id + 4;
+  const size_t key_len = valid.size() - 8 - 1 - 4, num_elems = key_len - 8;
+  auto patched = [&](size_t offset, auto value)
+  {
+    std::string snapshot = valid;
+    memcpy(&snapshot[offset], &value, sizeof(value));
+    return snapshot;
+  };
+
+  Collector collector;
+  // Truncated anywhere
+  for (size_t len : { valid.size() - 1, num_elems + 4, type_size, name_len + 2 })
+    EXPECT_NE(collector.add("a", valid.substr(0, len)), 0);
+
+  // Lengths and counts larger than the message
+  EXPECT_NE(collector.add("a", patched(name_len, UINT32_MAX)), 0);
+  EXPECT_NE(collector.add("a", patched(key_len, UINT32_MAX)), 0);
+  EXPECT_NE(collector.add("a", patched(key_len, (uint32_t)2)), 0);
+  EXPECT_NE(collector.add("a", patched(num_elems, UINT64_MAX)), 0);
+  EXPECT_NE(collector.add("a", patched(num_elems, (uint64_t)2)), 0);
+  EXPECT_NE(collector.add("a", patched(type_size, (uint64_t)1 << 40)), 0);
+
+  // Unknown types, and values too small for their aggregation's fields
+  EXPECT_NE(collector.add("a", patched(type_id, (uint32_t)1000)), 0);
+  EXPECT_NE(collector.add("a", patched(type_id, (uint32_t)Type::stats)), 0);
+  EXPECT_NE(collector.add("a", patched(type_id, (uint32_t)Type::topk)), 0);
+
+  EXPECT_EQ(collector.add("a", valid), 0);
+  EXPECT_EQ(read_counts(collector.merged()), (std::map<std::string, int64_t>{ { "x", 1 } }));
+}
+
+TEST(bpftrace, connect_with_timeout)
+{
+  std::string path = temp_file();
+  std::string address = "unix:" + path;
+  int listen_fd = listen_on(address);
+  ASSERT_GE(listen_fd, 0);
+
+  // Connected sockets are left blocking for sending messages
+  int fd = connect_to(address, 500);
+  ASSERT_GE(fd, 0);
+  EXPECT_EQ(fcntl(fd, F_GETFL) & O_NONBLOCK, 0);
+  close(fd);
+
+  close(listen_fd);
+  unlink(path.c_str());
+  EXPECT_EQ(connect_to(address, 500, true), -1);
+}
+
+TEST(bpftrace, collector_over_socket)
+{
+  std::string path = temp_file();
+  std::string address = "unix:" + path;
+  pid_t collector_pid = fork();
+  ASSERT_GE(collector_pid, 0);
+  if (collector_pid == 0)
+  {
+    struct sigaction act = {};
+    act.sa_handler = [](int) { };
+    sigaction(SIGINT, &act, NULL);
+    _exit(Collector().run(address) ? 1 : 0);
+  }
+
+  // Wait for the collector to start listening
+  int agents[3];
+  for (int i = 0; i < 100; i++)
+  {
+    struct stat st;
+    if (stat(path.c_str(), &st) == 0 && S_ISSOCK(st.st_mode))
+      break;
+    usleep(10000);
+  }
+  for (int &fd : agents)
+  {
+    fd = connect_to(address);
+    ASSERT_GE(fd, 0);
+  }
+
+  EXPECT_EQ(send_message(agents[0], "a", counts_snapshot({ { "x", 1 } })), 0);
+  EXPECT_EQ(send_message(agents[1], "b", counts_snapshot({ { "x", 2 }, { "y", 5 } })), 0);
+  EXPECT_EQ(send_message(agents[2], "c", counts_snapshot({ { "y", 7 } })), 0);
+  EXPECT_EQ(send_message(agents[0], "a", counts_snapshot({ { "x", 3 } })), 0);
+  for (int fd : agents)
+    close(fd);
+
+  // Messages from each agent are handled in order, but not across agents,
+  // so wait until all of them have been
+  std::map<std::string, int64_t> expected = { { "x", 5 }, { "y", 12 } };
+  std::string snapshot;
+  for (int i = 0; i < 100; i++)
+  {
+    ASSERT_EQ(query_collector(address, snapshot), 0);
+    if (read_counts(snapshot) == expected)
+      break;
+    usleep(10000);
+  }
+  EXPECT_EQ(read_counts(snapshot), expected);
+
+  // Interrupts only stop the collector while it's waiting for messages
+  int status;
+  pid_t exited = 0;
+  for (int i = 0; i < 100 && exited == 0; i++)
+  {
+    kill(collector_pid, SIGINT);
+    usleep(10000);
+    exited = waitpid(collector_pid, &status, WNOHANG);
+  }
+  ASSERT_EQ(exited, collector_pid);
+  EXPECT_TRUE(WIFEXITED(status));
+  EXPECT_EQ(WEXITSTATUS(status), 0);
+  EXPECT_NE(access(path.c_str(), F_OK), 0);
+}
+
+std::vector<uint8_t> per_cpu_value(const std::vector<std::vector<int64_t>> &cpus)
+{
+  std::vector<uint8_t> value;
+  for (auto &fields : cpus)
+  {
+    auto bytes = reinterpret_cast<const uint8_t *>(fields.data());
+    value.insert(value.end(), bytes, bytes + fields.size() * sizeof(int64_t));
+  }
+  return value;
+}
+
+TEST(bpftrace, combined_value)
+{
+  auto combined = [](const SizedType &type, const std::vector<uint8_t> &value, int ncpus)
+  {
+    auto row = BPFtrace::combine_cpus(type, value, ncpus);
+    return BPFtrace::combined_value(type, row.data());
+  };
+
+  SizedType sum(Type::sum, 8);
+  auto value = per_cpu_value({ { 5 }, { -2 }, { 10 } });
+  EXPECT_EQ(BPFtrace::combine_cpus(sum, value, 3), per_cpu_value({ { 13 } }));
+  EXPECT_EQ(combined(sum, value, 3), 13);
+
+  // CPUs which haven't seen a value don't count towards min and max
+  EXPECT_EQ(combined(SizedType(Type::min, 16),
+      per_cpu_value({ { 0, 0 }, { 7, 1 }, { 3, 1 } }), 3), 3);
+  EXPECT_EQ(combined(SizedType(Type::max, 16),
+      per_cpu_value({ { -7, 1 }, { 0, 0 }, { -3, 1 } }), 3), -3);
+
+  SizedType avg(Type::avg, 16);
+  value = per_cpu_value({ { 2, 10 }, { 0, 0 }, { 3, 20 } });
+  EXPECT_EQ(BPFtrace::combine_cpus(avg, value, 3), per_cpu_value({ { 5, 30 } }));
+  EXPECT_EQ(combined(avg, value, 3), 6);
+
+  SizedType stats(Type::stats, 32);
+  value = per_cpu_value({ { 2, 10, 4, 6 }, { 0, 0, 0, 0 }, { 1, -1, -1, -1 } });
+  EXPECT_EQ(BPFtrace::combine_cpus(stats, value, 3), per_cpu_value({ { 3, 9, -1, 6 } }));
+  EXPECT_EQ(combined(stats, value, 3), 3);
+}
+
+TEST(bpftrace, reduce_hist)
+{
+  SizedType type(Type::lhist, 3 * sizeof(uint64_t));
+  auto buckets = BPFtrace::reduce_hist(type,
+      per_cpu_value({ { 1, 0, 2 }, { 0, 0, 0 }, { 3, 4, 5 } }), 3);
+  EXPECT_THAT(buckets, ContainerEq(std::vector<uint64_t>{ 4, 4, 7 }));
+}
+
+TEST(bpftrace, hist_bucket_label_lhist)
+{
+  // lhist(x, 10, 40, 10)
+  SizedType type(Type::lhist, 5 * sizeof(uint64_t));
+  type.hist_min = 10;
+  type.hist_max = 40;
+  type.hist_step = 10;
+
+  EXPECT_EQ(BPFtrace::hist_bucket_label(type, 0), "(..., 10)");
+  EXPECT_EQ(BPFtrace::hist_bucket_label(type, 1), "[10, 20)");
+  EXPECT_EQ(BPFtrace::hist_bucket_label(type, 3), "[30, 40)");
+  EXPECT_EQ(BPFtrace::hist_bucket_label(type, 4), "[40, ...)");
+}
+
+TEST(bpftrace, hist_bucket_label_llhist)
+{
+  // llhist(x, 4)
+  SizedType type(Type::llhist, 62 * 4 * sizeof(uint64_t));
+  type.hist_step = 4;
+
+  EXPECT_EQ(BPFtrace::hist_bucket_label(type, 0), "(..., 1)");
+  EXPECT_EQ(BPFtrace::hist_bucket_label(type, 1), "[1, 2)");
+  EXPECT_EQ(BPFtrace::hist_bucket_label(type, 7), "[7, 8)");
+  EXPECT_EQ(BPFtrace::hist_bucket_label(type, 8), "[8, 10)");
+  EXPECT_EQ(BPFtrace::hist_bucket_label(type, 11), "[14, 16)");
+  EXPECT_EQ(BPFtrace::hist_bucket_label(type, 12), "[16, 20)");
+  EXPECT_EQ(BPFtrace::hist_bucket_label(type, 247), "[8070450532247928832, 9223372036854775808)");
+}
+
+TEST(bpftrace, hist_percentile)
+{
+  // lhist(x, 0, 40, 10)
+  SizedType type(Type::lhist, 6 * sizeof(uint64_t));
+  type.hist_min = 0;
+  type.hist_max = 40;
+  type.hist_step = 10;
+  std::vector<uint64_t> values = { 0, 10, 0, 10, 0, 0 };
+
+  // Values are interpolated within the bucket holding each rank
+  EXPECT_DOUBLE_EQ(BPFtrace::hist_percentile(values, type, 25), 5);
+  EXPECT_DOUBLE_EQ(BPFtrace::hist_percentile(values, type, 50), 10);
+  EXPECT_DOUBLE_EQ(BPFtrace::hist_percentile(values, type, 90), 28);
+  EXPECT_DOUBLE_EQ(BPFtrace::hist_mean(values, type), 15);
+
+  // Values beyond the histogram's range are counted at its edge
+  values = { 1, 0, 0, 0, 0, 3 };
+  EXPECT_DOUBLE_EQ(BPFtrace::hist_percentile(values, type, 10), 0);
+  EXPECT_DOUBLE_EQ(BPFtrace::hist_percentile(values, type, 99), 40);
+  EXPECT_DOUBLE_EQ(BPFtrace::hist_mean(values, type), 30);
+
+  EXPECT_DOUBLE_EQ(BPFtrace::hist_percentile({ 0, 0, 0 }, type, 50), 0);
+  EXPECT_DOUBLE_EQ(BPFtrace::hist_mean({ 0, 0, 0 }, type), 0);
+}
+
+TEST(bpftrace, hist_percentile_quantize)
+{
+  SizedType type(Type::quantize, 8);
+  std::vector<uint64_t> values(65);
+  values.at(0) = 2; // [0, 1]
+  values.at(3) = 2; // [8, 16)
+
+  EXPECT_DOUBLE_EQ(BPFtrace::hist_percentile(values, type, 50), 2);
+  EXPECT_DOUBLE_EQ(BPFtrace::hist_percentile(values, type, 75), 12);
+  EXPECT_DOUBLE_EQ(BPFtrace::hist_mean(values, type), 6.5);
+}
+
+static std::vector<uint8_t> int_value(uint64_t n)
+{
+  std::vector<uint8_t> value(sizeof(n));
+  *(uint64_t*)value.data() = n;
+  return value;
+}
+
+static void hll_add(std::vector<uint8_t> &registers, uint64_t value)
+{
+  // Matches the register update for distinct()
+  uint64_t h = BPFtrace::hash_value(int_value(value));
+
+  int precision = __builtin_ctzll(registers.size());
+  uint64_t rest = h & ((1ULL << (64 - precision)) - 1);
+  uint8_t rank = rest ? __builtin_clzll(rest) - precision + 1 : 64 - precision + 1;
+  uint8_t &reg = registers.at(h >> (64 - precision));
+  reg = std::max(reg, rank);
+}
+
+TEST(bpftrace, hll_estimate)
+{
+  std::vector<uint8_t> registers(1024);
+  EXPECT_EQ(BPFtrace::hll_estimate(registers.data(), registers.size()), 0);
+
+  for (int n : { 10, 1000, 100000 })
+  {
+    std::fill(registers.begin(), registers.end(), 0);
+    for (int i = 0; i < n; i++)
+    {
+      // Repeated values don't change the estimate
+      hll_add(registers, i);
+      hll_add(registers, i);
+    }
+    EXPECT_NEAR(BPFtrace::hll_estimate(registers.data(), registers.size()), n, n * 0.1);
+  }
+}
+
+TEST(bpftrace, combined_value_distinct)
+{
+  // Each CPU's sketch sees half of the values
+  SizedType type(Type::distinct, 1024);
+  std::vector<uint8_t> value(1024 * 2);
+  std::vector<uint8_t> registers(1024);
+  for (int cpu = 0; cpu < 2; cpu++)
+  {
+    std::fill(registers.begin(), registers.end(), 0);
+    for (int i = cpu; i < 2000; i += 2)
+      hll_add(registers, i);
+    std::copy(registers.begin(), registers.end(), value.begin() + cpu * 1024);
+  }
+
+  auto combined = BPFtrace::combine_cpus(type, value, 2);
+  EXPECT_NEAR(BPFtrace::combined_value(type, combined.data()), 2000, 200);
+}
+
+TEST(bpftrace, merge_value)
+{
+  // Two CPUs' worth of values, as read from a per-CPU map
+  auto values = [](std::vector<int64_t> fields)
+  {
+    std::vector<uint8_t> value(fields.size() * sizeof(int64_t));
+    std::copy(fields.begin(), fields.end(), (int64_t*)value.data());
+    return value;
+  };
+
+  auto count = values({ 1, 2 });
+  BPFtrace::merge_value(SizedType(Type::count, 8), count, values({ 10, 20 }), 2);
+  EXPECT_EQ(count, values({ 11, 22 }));
+
+  // Unset values don't count towards the minimum
+  auto min = values({ 5, 1, 0, 0 });
+  BPFtrace::merge_value(SizedType(Type::min, 16), min, values({ 7, 1, 3, 1 }), 2);
+  EXPECT_EQ(min, values({ 5, 1, 3, 1 }));
+  BPFtrace::merge_value(SizedType(Type::min, 16), min, values({ 0, 0, 2, 1 }), 2);
+  EXPECT_EQ(min, values({ 5, 1, 2, 1 }));
+
+  auto stats = values({ 2, 10, 4, 6,  0, 0, 0, 0 });
+  BPFtrace::merge_value(SizedType(Type::stats, 32), stats,
+      values({ 1, 1, 1, 1,  3, 30, 9, 11 }), 2);
+  EXPECT_EQ(stats, values({ 3, 11, 1, 6,  3, 30, 9, 11 }));
+
+  // Plain values are replaced by newer ones
+  auto integer = values({ 1 });
+  BPFtrace::merge_value(SizedType(Type::integer, 8), integer, values({ 2 }), 2);
+  EXPECT_EQ(integer, values({ 2 }));
+}
+
+TEST(bpftrace, drained_entries)
+{
+  SizedType count(Type::count, 8);
+  auto read = [&](const DrainedEntries &drained)
+  {
+    std::map<std::vector<uint8_t>, std::vector<uint8_t>> values;
+    drained.read(count, [&](const std::vector<uint8_t> &key, const std::vector<uint8_t> &value)
+    {
+      values[key] = value;
+    });
+    return values;
+  };
+
+  DrainedEntries drained;
+  drained.add(count, int_value(1), int_value(2));
+  drained.mark_printed(count);
+
+  // Drained between a print() and the clear() after it, so never printed
+  drained.add(count, int_value(1), int_value(3));
+  drained.add(count, int_value(2), int_value(4));
+  std::map<std::vector<uint8_t>, std::vector<uint8_t>> expected = {
+    { int_value(1), int_value(5) },
+    { int_value(2), int_value(4) },
+  };
+  EXPECT_EQ(read(drained), expected);
+
+  drained.clear_printed();
+  expected = {
+    { int_value(1), int_value(3) },
+    { int_value(2), int_value(4) },
+  };
+  EXPECT_EQ(read(drained), expected);
+
+  // Printing again without a clear() shows the totals
+  drained.add(count, int_value(2), int_value(1));
+  drained.mark_printed(count);
+  expected[int_value(2)] = int_value(5);
+  EXPECT_EQ(read(drained), expected);
+
+  drained.clear();
+  EXPECT_TRUE(read(drained).empty());
+}
+
+TEST(bpftrace, combine_cpus)
+{
+  std::vector<uint8_t> count(8 * 3);
+  ((uint64_t*)count.data())[0] = 1;
+  ((uint64_t*)count.data())[1] = 2;
+  ((uint64_t*)count.data())[2] = 4;
+  EXPECT_EQ(BPFtrace::combine_cpus(SizedType(Type::count, 8), count, 3), int_value(7));
+
+  // HyperLogLog registers keep the highest value
+  std::vector<uint8_t> distinct = { 1, 5, 0,  3, 2, 0 };
+  std::vector<uint8_t> registers = { 3, 5, 0 };
+  EXPECT_EQ(BPFtrace::combine_cpus(SizedType(Type::distinct, 3), distinct, 2), registers);
+
+  // Values which aren't per-CPU are left alone
+  EXPECT_EQ(BPFtrace::combine_cpus(SizedType(Type::integer, 8), int_value(3), 3), int_value(3));
+}
+
+TEST(bpftrace, combine_cpus_batch)
+{
+  // Two values, each with a copy on each of two CPUs
+  auto hist = per_cpu_value({ { 1, 2, 3,  10, 20, 30 }, { 4, 0, 0,  0, 0, 5 } });
+  std::vector<uint8_t> combined(2 * 24);
+  BPFtrace::combine_cpus_batch(SizedType(Type::lhist, 24), hist.data(), 2, 2, combined.data());
+  EXPECT_EQ(combined, per_cpu_value({ { 11, 22, 33 }, { 4, 0, 5 } }));
+
+  auto stats = per_cpu_value({ { 2, 10, 4, 6,  0, 0, 0, 0 }, { 1, -3, -3, -3,  2, 9, 1, 8 } });
+  combined.resize(2 * 32);
+  BPFtrace::combine_cpus_batch(SizedType(Type::stats, 32), stats.data(), 2, 2, combined.data());
+  EXPECT_EQ(combined, per_cpu_value({ { 2, 10, 4, 6 }, { 3, 6, -3, 8 } }));
+}
+
+// A microbenchmark of combining large per-CPU maps, compared with merging
+// CPUs one at a time. Run with --gtest_also_run_disabled_tests.
+TEST(bpftrace, DISABLED_combine_cpus_batch_benchmark)
+{
+  const int ncpus = 256;
+  const size_t count = 4096;
+  for (auto type : { SizedType(Type::count, 8), SizedType(Type::lhist, 8 * 32),
+                     SizedType(Type::stats, 32) })
+  {
+    std::vector<uint8_t> values(type.size * ncpus * count);
+    for (size_t i=0; i<values.size() / sizeof(uint64_t); i++)
+      ((uint64_t*)values.data())[i] = i % 7;
+    std::vector<uint8_t> combined(type.size * count);
+
+    auto start = std::chrono::steady_clock::now();
+    BPFtrace::combine_cpus_batch(type, values.data(), count, ncpus, combined.data());
+    auto batch = std::chrono::steady_clock::now() - start;
+
+    start = std::chrono::steady_clock::now();
+    for (size_t i=0; i<count; i++)
+    {
+      auto value = std::vector<uint8_t>(&values.at(i * type.size * ncpus),
+                                        &values.at(i * type.size * ncpus) + type.size);
+      for (int cpu=1; cpu<ncpus; cpu++)
+      {
+        auto cpu_value = std::vector<uint8_t>(
+            &values.at((i * ncpus + cpu) * type.size),
+            &values.at((i * ncpus + cpu) * type.size) + type.size);
+        BPFtrace::merge_value(type, value, cpu_value, 1);
+      }
+      EXPECT_TRUE(std::equal(value.begin(), value.end(), &combined.at(i * type.size)));
+    }
+    auto one_at_a_time = std::chrono::steady_clock::now() - start;
+
+    using std::chrono::microseconds;
+    std::cout << typestr(type.type) << ": batch "
+              << std::chrono::duration_cast<microseconds>(batch).count() << "us, one CPU at a time "
+              << std::chrono::duration_cast<microseconds>(one_at_a_time).count() << "us" << std::endl;
+  }
+}
+
+TEST(bpftrace, topk_estimate)
+{
+  std::vector<std::vector<uint64_t>> rows(TOPK_SKETCH_DEPTH,
+      std::vector<uint64_t>(TOPK_SKETCH_WIDTH));
+  auto add = [&](uint64_t n, int times)
+  {
+    uint64_t hash = BPFtrace::hash_value(int_value(n));
+    for (uint64_t row = 0; row < rows.size(); row++)
+    {
+      uint64_t column = (hash & 0xffffffff) + ((hash >> 32) | 1) * row;
+      rows.at(row).at(column & (TOPK_SKETCH_WIDTH - 1)) += times;
+    }
+  };
+
+  add(1, 1000);
+  add(2, 10);
+  for (int i = 100; i < 5100; i++)
+    add(i, 1);
+
+  // Estimates never undercount, and stay within e/width of the total
+  uint64_t error = std::ceil(M_E / TOPK_SKETCH_WIDTH * 6010);
+  uint64_t one = BPFtrace::topk_estimate(rows, int_value(1));
+  uint64_t two = BPFtrace::topk_estimate(rows, int_value(2));
+  EXPECT_GE(one, 1000);
+  EXPECT_LE(one, 1000 + error);
+  EXPECT_GE(two, 10);
+  EXPECT_LE(two, 10 + error);
+  EXPECT_LE(BPFtrace::topk_estimate(rows, int_value(3)), error);
+}
+
+TEST(bpftrace, hash_value)
+{
+  // Zero padding is hashed, so strings must always be padded to full size
+  std::vector<uint8_t> a(STRING_SIZE), b(STRING_SIZE);
+  a.at(0) = 'a';
+  b.at(0) = 'b';
+  EXPECT_NE(BPFtrace::hash_value(a), BPFtrace::hash_value(b));
+  EXPECT_EQ(BPFtrace::hash_value(a), BPFtrace::hash_value(a));
+  EXPECT_NE(BPFtrace::hash_value(int_value(1)), BPFtrace::hash_value(int_value(2)));
+}
+
+TEST(bpftrace, largest_entries)
+{
+  LargestEntries<int> largest(3);
+  for (int i : { 5, -2, 9, 1, 7, 3, 9 })
+    largest.add(i, i * 10);
+
+  auto entries = largest.sorted();
+  ASSERT_EQ(entries.size(), 3U);
+  EXPECT_EQ(entries.at(0), std::make_pair((int64_t)7, 70));
+  EXPECT_EQ(entries.at(1), std::make_pair((int64_t)9, 90));
+  EXPECT_EQ(entries.at(2), std::make_pair((int64_t)9, 90));
+
+  // Callers can check what would be kept before storing an entry
+  LargestEntries<int> top(2);
+  EXPECT_FALSE(top.full());
+  EXPECT_TRUE(top.accepts(INT64_MIN));
+  top.add(4, 40);
+  top.add(6, 60);
+  EXPECT_TRUE(top.full());
+  EXPECT_EQ(top.smallest(), std::make_pair((int64_t)4, 40));
+  EXPECT_FALSE(top.accepts(4));
+  EXPECT_TRUE(top.accepts(5));
+
+  // Without a limit, every entry is kept
+  LargestEntries<int> all(0);
+  for (int i : { 5, -2, 9 })
+    all.add(i, i);
+  EXPECT_FALSE(all.full());
+  entries = all.sorted();
+  ASSERT_EQ(entries.size(), 3U);
+  EXPECT_EQ(entries.at(0).first, -2);
+  EXPECT_EQ(entries.at(2).first, 9);
+}
+
 } // namespace bpftrace
 } // namespace test
 } // namespace bpftrace
@@ -228,6 +228,16 @@ TEST(Parser, uprobe)
       "  int: 1\n");
 }
 
+TEST(Parser, kfunc)
+{
+  test("kfunc:vfs_read { 1; } kretfunc:vfs_read { 2; }",
+      "Program\n"
+      " kfunc:vfs_read\n"
+      "  int: 1\n"
+      " kretfunc:vfs_read\n"
+      "  int: 2\n");
+}
+
 TEST(Parser, escape_chars)
 {
   test("kprobe:sys_open { \"newline\\nand tab\\tbackslash\\\\quote\\\"here\" }",
@@ -252,6 +262,15 @@ TEST(Parser, tracepoint_probe)
       "  int: 1\n");
 }
 
+TEST(Parser, syscall_probe)
+{
+  test("syscall:enter:read,syscall:enter:write { 1 }",
+      "Program\n"
+      " syscall:enter:read\n"
+      " syscall:enter:write\n"
+      "  int: 1\n");
+}
+
 TEST(Parser, profile_probe)
 {
   test("profile:ms:997 { 1 }",
@@ -132,6 +132,120 @@ TEST(semantic_analyser, call_count)
   test("kprobe:f { count(); }", 1);
 }
 
+TEST(semantic_analyser, call_aggregations)
+{
+  for (std::string func : { "sum", "min", "max", "avg", "stats" })
+  {
+    test("kprobe:f { @x = " + func + "(arg0); }", 0);
+    test("kprobe:f { @x[pid] = " + func + "(arg0 * 2); }", 0);
+    test("kprobe:f { @x = " + func + "(); }", 1);
+    test("kprobe:f { @x = " + func + "(arg0, 1); }", 1);
+    test("kprobe:f { @x = " + func + "(\"a\"); }", 10);
+    test("kprobe:f { " + func + "(arg0); }", 1);
+    test("kprobe:f { $x = " + func + "(arg0); }", 1);
+  }
+
+  test("kprobe:f { @x = sum(arg0); @y = @x }", 0);
+  test("kprobe:f { @x = avg(arg0); @y = @x }", 1);
+  test("kprobe:f { @x = stats(arg0); @y[@x] = 1 }", 1);
+  test("kprobe:f { @x = min(arg0); delete(@x) }", 0);
+}
+
+TEST(semantic_analyser, call_lhist)
+{
+  test("kprobe:f { @x = lhist(arg0, 0, 100, 10); }", 0);
+  test("kprobe:f { @x[comm] = lhist(arg0, 10, 20, 5); }", 0);
+  test("kprobe:f { @x = lhist(arg0, 0, 100); }", 1);
+  test("kprobe:f { @x = lhist(arg0, 0, arg1, 10); }", 1);
+  test("kprobe:f { @x = lhist(arg0, 0, 100, 0); }", 1);
+  test("kprobe:f { @x = lhist(arg0, 100, 100, 10); }", 1);
+  test("kprobe:f { @x = lhist(arg0, 0, 100, 30); }", 1);
+  test("kprobe:f { @x = lhist(arg0, 0, 100000, 1); }", 1);
+  test("kprobe:f { @x = lhist(\"a\", 0, 100, 10); }", 10);
+  test("kprobe:f { lhist(arg0, 0, 100, 10); }", 1);
+  test("kprobe:f { @x = lhist(arg0, 0, 100, 10); @x = lhist(arg1, 0, 100, 10); }", 0);
+  test("kprobe:f { @x = lhist(arg0, 0, 100, 10); @x = lhist(arg1, 0, 200, 10); }", 1);
+  test("kprobe:f { @x = lhist(arg0, 0, 100, 10); @y = @x }", 1);
+}
+
+TEST(semantic_analyser, call_llhist)
+{
+  test("kprobe:f { @x = llhist(arg0); }", 0);
+  test("kprobe:f { @x[pid] = llhist(arg0, 4); }", 0);
+  test("kprobe:f { @x = llhist(arg0, 1); }", 0);
+  test("kprobe:f { @x = llhist(arg0, 64); }", 0);
+  test("kprobe:f { @x = llhist(); }", 1);
+  test("kprobe:f { @x = llhist(arg0, 0); }", 1);
+  test("kprobe:f { @x = llhist(arg0, 12); }", 1);
+  test("kprobe:f { @x = llhist(arg0, 128); }", 1);
+  test("kprobe:f { @x = llhist(arg0, arg1); }", 1);
+  test("kprobe:f { @x = llhist(arg0); @x = llhist(arg1, 8); }", 1);
+}
+
+TEST(semantic_analyser, call_distinct)
+{
+  test("kprobe:f { @x = distinct(pid); }", 0);
+  test("kprobe:f { @x[comm] = distinct(arg0 + 1); }", 0);
+  test("kprobe:f { @x = distinct(str(arg0)); }", 0);
+  test("kprobe:f { @x = distinct(); }", 1);
+  test("kprobe:f { @x = distinct(pid, tid); }", 1);
+  test("kprobe:f { @x = distinct(stack); }", 10);
+  test("kprobe:f { distinct(pid); }", 1);
+  test("kprobe:f { @x = distinct(pid); @y = @x }", 1);
+}
+
+TEST(semantic_analyser, call_topk)
+{
+  test("kprobe:f { @x = topk(str(arg0)); }", 0);
+  test("kprobe:f { @x = topk(pid, 5); }", 0);
+  test("kprobe:f { @x = topk(); }", 1);
+  test("kprobe:f { @x = topk(pid, arg0); }", 1);
+  test("kprobe:f { @x = topk(pid, 0); }", 1);
+  test("kprobe:f { @x = topk(pid, 5000); }", 1);
+  test("kprobe:f { @x[tid] = topk(pid); }", 1);
+  test("kprobe:f { @x = topk(stack); }", 10);
+  test("kprobe:f { topk(pid); }", 1);
+  test("kprobe:f { @x = topk(pid); @x = topk(tid, 5); }", 1);
+  test("kprobe:f { @x = topk(pid); @y = @x }", 1);
+}
+
+TEST(semantic_analyser, call_sample)
+{
+  test("kprobe:f / sample(1000) / { @x = count(); }", 0);
+  test("kprobe:f / sample(10) && pid == 1 / { @x = count(); }", 0);
+  test("kprobe:f { @x = sample(2); }", 0);
+  test("kprobe:f / sample() / { @x = count(); }", 1);
+  test("kprobe:f / sample(arg0) / { @x = count(); }", 1);
+  test("kprobe:f / sample(0) / { @x = count(); }", 1);
+}
+
+TEST(semantic_analyser, drop_maps)
+{
+  BPFtrace bpftrace;
+  bpftrace.printf_rate_ = 100;
+  Driver driver;
+  ASSERT_EQ(driver.parse_str(
+      "kprobe:f / sample(10) / { @x = count() } kprobe:g { printf(\"hi\") }"), 0);
+  ast::SemanticAnalyser semantics(driver.root_, bpftrace);
+  ASSERT_EQ(semantics.analyse(), 0);
+  ASSERT_EQ(semantics.create_maps(true), 0);
+
+  // Two counters per probe, and a rate limit per probe
+  ASSERT_NE(bpftrace.drops_map_, nullptr);
+  EXPECT_EQ(bpftrace.drops_map_->max_entries_, 4);
+  ASSERT_NE(bpftrace.ratelimit_map_, nullptr);
+  EXPECT_EQ(bpftrace.ratelimit_map_->max_entries_, 2);
+
+  BPFtrace bpftrace2;
+  Driver driver2;
+  ASSERT_EQ(driver2.parse_str("kprobe:f { printf(\"hi\") }"), 0);
+  ast::SemanticAnalyser semantics2(driver2.root_, bpftrace2);
+  ASSERT_EQ(semantics2.analyse(), 0);
+  ASSERT_EQ(semantics2.create_maps(true), 0);
+  EXPECT_EQ(bpftrace2.drops_map_, nullptr);
+  EXPECT_EQ(bpftrace2.ratelimit_map_, nullptr);
+}
+
 TEST(semantic_analyser, call_delete)
 {
   test("kprobe:f { @x = 1; delete(@x); }", 0);
@@ -141,6 +255,153 @@ TEST(semantic_analyser, call_delete)
   test("kprobe:f { $y = delete(@x); }", 1);
 }
 
+TEST(semantic_analyser, call_print_clear)
+{
+  test("kprobe:f { @x = count(); } interval:s:1 { print(@x); clear(@x); }", 0);
+  test("kprobe:f { @x[pid] = quantize(arg0); } interval:s:1 { print(@x); }", 0);
+  test("kprobe:f { @x[comm] = 1; } interval:s:1 { clear(@x); }", 0);
+  test("interval:s:1 { print(1); }", 1);
+  test("interval:s:1 { print(); }", 1);
+  test("kprobe:f { @x[pid] = 1; } interval:s:1 { print(@x[1]); }", 1);
+  test("kprobe:f { @x = count(); } interval:s:1 { @y = print(@x); }", 1);
+  test("interval:s:1 { clear(@x); }", 10);
+
+  // Probes only see one copy of a double-buffered map
+  test("kprobe:f { @x = 1; @y = @x; } interval:s:1 { print(@x); }", 10);
+  test("kprobe:f { @x = 1; delete(@x); } interval:s:1 { clear(@x); }", 10);
+}
+
+TEST(semantic_analyser, double_buffered_maps)
+{
+  BPFtrace bpftrace;
+  bpftrace.task_storage_ = true;
+  Driver driver;
+  ASSERT_EQ(driver.parse_str(
+      "kprobe:f { @a = count(); @b[tid] = nsecs; @c = sum(arg0); } "
+      "interval:s:1 { print(@b); print(@a); clear(@a); }"), 0);
+  ast::SemanticAnalyser semantics(driver.root_, bpftrace);
+  ASSERT_EQ(semantics.analyse(), 0);
+  ASSERT_EQ(semantics.create_maps(true), 0);
+
+  std::vector<std::string> double_buffered = { "@a", "@b" };
+  EXPECT_EQ(bpftrace.double_buffered_maps_, double_buffered);
+  EXPECT_EQ(bpftrace.backbuffer_maps_.size(), 2);
+  EXPECT_EQ(bpftrace.backbuffer_maps_.at("@a")->map_type_, BPF_MAP_TYPE_PERCPU_ARRAY);
+  ASSERT_NE(bpftrace.generation_map_, nullptr);
+  EXPECT_EQ(bpftrace.generation_map_->max_entries_, 2);
+
+  // Task storage can't be read by userspace
+  EXPECT_EQ(bpftrace.maps_.at("@b")->map_type_, BPF_MAP_TYPE_HASH);
+}
+
+TEST(semantic_analyser, drained_maps)
+{
+  BPFtrace bpftrace;
+  bpftrace.drain_interval_ms_ = 1000;
+  Driver driver;
+  ASSERT_EQ(driver.parse_str(
+      "kprobe:f { @a[pid] = count(); @b[comm] = quantize(arg0); @c = count(); "
+      "@d = 1; @e[pid] = sum(arg0); delete(@e[1]); @f = topk(pid); }"), 0);
+  ast::SemanticAnalyser semantics(driver.root_, bpftrace);
+  ASSERT_EQ(semantics.analyse(), 0);
+  ASSERT_EQ(semantics.create_maps(true), 0);
+
+  // Only aggregations which probes don't delete from
+  std::vector<std::string> double_buffered = { "@a", "@b", "@c" };
+  EXPECT_EQ(bpftrace.double_buffered_maps_, double_buffered);
+}
+
+TEST(semantic_analyser, map_types)
+{
+  BPFtrace bpftrace;
+  Driver driver;
+  ASSERT_EQ(driver.parse_str(
+      "kprobe:f { @a = count(); @b = quantize(1); @c[pid] = count(); "
+      "@d = 1; @e = count(); delete(@e); @f = sum(arg0) }"), 0);
+  ast::SemanticAnalyser semantics(driver.root_, bpftrace);
+  ASSERT_EQ(semantics.analyse(), 0);
+  ASSERT_EQ(semantics.create_maps(true), 0);
+
+  EXPECT_EQ(bpftrace.maps_.at("@a")->map_type_, BPF_MAP_TYPE_PERCPU_ARRAY);
+  EXPECT_EQ(bpftrace.maps_.at("@b")->map_type_, BPF_MAP_TYPE_PERCPU_ARRAY);
+  EXPECT_EQ(bpftrace.maps_.at("@c")->map_type_, BPF_MAP_TYPE_PERCPU_HASH);
+  EXPECT_EQ(bpftrace.maps_.at("@d")->map_type_, BPF_MAP_TYPE_HASH);
+  EXPECT_EQ(bpftrace.maps_.at("@e")->map_type_, BPF_MAP_TYPE_PERCPU_HASH);
+  // A sum() which totals 0 must still be printed
+  EXPECT_EQ(bpftrace.maps_.at("@f")->map_type_, BPF_MAP_TYPE_PERCPU_HASH);
+}
+
+TEST(semantic_analyser, map_types_bounded_keys)
+{
+  BPFtrace bpftrace;
+  Driver driver;
+  ASSERT_EQ(driver.parse_str(
+      "kprobe:f { @a[cpu] = count(); @b[pid % 16] = nsecs; @c[pid & 7] = count(); "
+      "@d[pid & 7] = count(); @d[tid] = count(); @e[cpu] = comm; @f[3] = 1; "
+      "@f[pid % 10] = 2; @g[pid % 100000] = 1; @h[cpu] = 1; delete(@h[0]); "
+      "@i[cpu] = sum(retval) }"), 0);
+  ast::SemanticAnalyser semantics(driver.root_, bpftrace);
+  ASSERT_EQ(semantics.analyse(), 0);
+  ASSERT_EQ(semantics.create_maps(true), 0);
+
+  auto &maps = bpftrace.maps_;
+  EXPECT_EQ(maps.at("@a")->map_type_, BPF_MAP_TYPE_PERCPU_ARRAY);
+  EXPECT_EQ(maps.at("@a")->max_entries_, bpftrace.num_cpus());
+  EXPECT_EQ(maps.at("@b")->map_type_, BPF_MAP_TYPE_HASH);
+  EXPECT_EQ(maps.at("@c")->map_type_, BPF_MAP_TYPE_PERCPU_ARRAY);
+  EXPECT_EQ(maps.at("@c")->max_entries_, 8);
+  EXPECT_EQ(maps.at("@d")->map_type_, BPF_MAP_TYPE_PERCPU_HASH);
+  EXPECT_EQ(maps.at("@e")->map_type_, BPF_MAP_TYPE_HASH);
+  EXPECT_EQ(maps.at("@f")->map_type_, BPF_MAP_TYPE_HASH);
+  EXPECT_EQ(maps.at("@g")->map_type_, BPF_MAP_TYPE_HASH);
+  EXPECT_EQ(maps.at("@h")->map_type_, BPF_MAP_TYPE_HASH);
+  EXPECT_EQ(maps.at("@i")->map_type_, BPF_MAP_TYPE_PERCPU_HASH);
+}
+
+TEST(semantic_analyser, map_types_task_storage)
+{
+  std::string prog =
+      "kprobe:f { @a[tid] = nsecs; @b[tid] = comm; @c[tid] = count(); "
+      "@d[tid] = 1; @d[pid] = 2; @e[tid] = 1; @f[tid] = @f[tid] + arg2; "
+      "@g[tid] = nsecs } "
+      "kretprobe:f { @x = nsecs - @a[tid]; delete(@a[tid]); @e[tid + 1] = 1; "
+      "@h = @g[tid]; @i[tid] = 1; $i = take(@i[tid]) }";
+
+  for (bool task_storage : { false, true })
+  {
+    BPFtrace bpftrace;
+    bpftrace.task_storage_ = task_storage;
+    Driver driver;
+    ASSERT_EQ(driver.parse_str(prog), 0);
+    ast::SemanticAnalyser semantics(driver.root_, bpftrace);
+    ASSERT_EQ(semantics.analyse(), 0);
+    ASSERT_EQ(semantics.create_maps(true), 0);
+
+    auto &maps = bpftrace.maps_;
+    EXPECT_EQ(maps.at("@a")->map_type_,
+              task_storage ? BPF_MAP_TYPE_TASK_STORAGE : BPF_MAP_TYPE_HASH);
+    EXPECT_EQ(maps.at("@b")->map_type_, BPF_MAP_TYPE_HASH);
+    EXPECT_EQ(maps.at("@c")->map_type_, BPF_MAP_TYPE_PERCPU_HASH);
+    EXPECT_EQ(maps.at("@d")->map_type_, BPF_MAP_TYPE_HASH);
+    EXPECT_EQ(maps.at("@e")->map_type_, BPF_MAP_TYPE_HASH);
+    // Values which are never deleted are printed on exit
+    EXPECT_EQ(maps.at("@f")->map_type_, BPF_MAP_TYPE_HASH);
+    EXPECT_EQ(maps.at("@g")->map_type_, BPF_MAP_TYPE_HASH);
+    EXPECT_EQ(maps.at("@i")->map_type_,
+              task_storage ? BPF_MAP_TYPE_TASK_STORAGE : BPF_MAP_TYPE_HASH);
+  }
+}
+
+TEST(semantic_analyser, call_take)
+{
+  test("kprobe:f { @x = 1; @y = take(@x); }", 0);
+  test("kprobe:f { @x[pid] = 1; $y = take(@x[pid]) + 1; }", 0);
+  test("kprobe:f { @x = \"a\"; printf(\"%s\", take(@x)); }", 0);
+  test("kprobe:f { @y = take(1); }", 1);
+  test("kprobe:f { @y = take(); }", 1);
+  test("kprobe:f { @y = take(@x); }", 10);
+}
+
 TEST(semantic_analyser, call_str)
 {
   test("kprobe:f { str(arg0); }", 0);
@@ -325,6 +586,30 @@ TEST(semantic_analyser, kprobe)
   test("kretprobe { 1 }", 1);
 }
 
+TEST(semantic_analyser, kfunc)
+{
+  test("kfunc:f { 1 }", 0);
+  test("kfunc:path:f { 1 }", 1);
+  test("kfunc { 1 }", 1);
+
+  test("kretfunc:f { 1 }", 0);
+  test("kretfunc:path:f { 1 }", 1);
+  test("kretfunc { 1 }", 1);
+
+  test("kfunc:f,kretfunc:g { 1 }", 0);
+  test("kfunc:f,kprobe:g { 1 }", 1);
+  test("kretprobe:f,kretfunc:g { 1 }", 1);
+}
+
+TEST(semantic_analyser, kfunc_builtins)
+{
+  test("kfunc:f { @x = arg0 + arg1; @y = func }", 0);
+  test("kretfunc:f { @x = arg0 + retval; @y = func }", 0);
+  test("kfunc:f { @x = retval }", 1);
+  test("kfunc:f { reg(\"ip\") }", 1);
+  test("kretfunc:f { reg(\"ip\") }", 1);
+}
+
 TEST(semantic_analyser, uprobe)
 {
   test("uprobe:path:f { 1 }", 0);
@@ -356,6 +641,31 @@ TEST(semantic_analyser, tracepoint)
   test("tracepoint { 1 }", 1);
 }
 
+TEST(semantic_analyser, syscall)
+{
+  test("syscall:enter:read { 1 }", 0);
+  test("syscall:exit:read { 1 }", 0);
+  test("syscall:enter:* { 1 }", 0);
+  test("syscall:enter:read,syscall:enter:write { 1 }", 0);
+  test("syscall:enter:not_a_syscall { 1 }", 1);
+  test("syscall:during:read { 1 }", 1);
+  test("syscall:read { 1 }", 1);
+  test("syscall { 1 }", 1);
+
+  test("syscall:enter:read,syscall:exit:read { 1 }", 1);
+  test("syscall:enter:read,kprobe:f { 1 }", 1);
+}
+
+TEST(semantic_analyser, syscall_builtins)
+{
+  test("syscall:enter:read { @x[func] = arg0 + arg5 }", 0);
+  test("syscall:exit:read { @x[func] = retval }", 0);
+  test("syscall:enter:read { @x = retval }", 1);
+  test("syscall:exit:read { @x = arg0 }", 1);
+  test("syscall:enter:read { reg(\"ip\") }", 1);
+  test("syscall:enter:read { printf(\"%s\\n\", func) }", 0);
+}
+
 TEST(semantic_analyser, profile)
 {
   test("profile:hz:997 { 1 }", 0);
@@ -368,6 +678,16 @@ TEST(semantic_analyser, profile)
   test("profile { 1 }", 1);
 }
 
+TEST(semantic_analyser, interval)
+{
+  test("interval:s:1 { 1 }", 0);
+  test("interval:ms:100 { 1 }", 0);
+  test("interval:hz:997 { 1 }", 1);
+  test("interval:s:nan { 1 }", 1);
+  test("interval:s { 1 }", 1);
+  test("interval { 1 }", 1);
+}
+
 TEST(semantic_analyser, variable_cast_types)
 {
   test("kprobe:f { $x = (type1)cpu; $x = (type1)cpu; }", 0);
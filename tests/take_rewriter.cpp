@@ -0,0 +1,69 @@
+#include <sstream>
+
+#include "gtest/gtest.h"
+#include "driver.h"
+#include "printer.h"
+#include "take_rewriter.h"
+
+namespace bpftrace {
+namespace test {
+namespace take_rewriter {
+
+void test(const std::string &input, const std::string &expected)
+{
+  Driver driver;
+  ASSERT_EQ(driver.parse_str(input), 0);
+  ast::TakeRewriter rewriter(driver.root_);
+  rewriter.rewrite();
+
+  Driver expected_driver;
+  ASSERT_EQ(expected_driver.parse_str(expected), 0);
+
+  std::ostringstream out, expected_out;
+  ast::Printer printer(out), expected_printer(expected_out);
+  driver.root_->accept(printer);
+  expected_driver.root_->accept(expected_printer);
+  EXPECT_EQ(expected_out.str(), out.str()) << "\nInput:\n" << input;
+}
+
+void test(const std::string &input)
+{
+  test(input, input);
+}
+
+TEST(take_rewriter, read_then_delete)
+{
+  test("kprobe:f { @x = nsecs - @start[tid]; delete(@start[tid]) }",
+       "kprobe:f { @x = nsecs - take(@start[tid]) }");
+  test("kprobe:f { @x = @start; delete(@start) }",
+       "kprobe:f { @x = take(@start) }");
+  test("kprobe:f { printf(\"%d\", @a[pid, 1]); @b = 1; delete(@a[pid, 1]) }",
+       "kprobe:f { printf(\"%d\", take(@a[pid, 1])); @b = 1 }");
+  test("kprobe:f { $t = @start[arg0]; $x = 1; delete(@start[arg0]); @y = $t }",
+       "kprobe:f { $t = take(@start[arg0]); $x = 1; @y = $t }");
+  // Only the last read before the delete is affected
+  test("kprobe:f { @x = @start[tid]; @y = @start[tid]; delete(@start[tid]) }",
+       "kprobe:f { @x = @start[tid]; @y = take(@start[tid]) }");
+}
+
+TEST(take_rewriter, not_rewritten)
+{
+  // Different keys
+  test("kprobe:f { @x = @start[tid]; delete(@start[pid]) }");
+  // Key could change between the read and delete
+  test("kprobe:f { @x = @start[nsecs]; delete(@start[nsecs]) }");
+  test("kprobe:f { @x = @start[$k]; $k = 1; delete(@start[$k]) }");
+  test("kprobe:f { @x = @start[str(arg0)]; delete(@start[str(arg0)]) }");
+  // The map is used more than once in the statement before the delete
+  test("kprobe:f { @x = @start[tid] + @start[tid]; delete(@start[tid]) }");
+  // The map is written to in between
+  test("kprobe:f { @x = @start[tid]; @start[tid] = 1; delete(@start[tid]) }");
+  // The read isn't always evaluated
+  test("kprobe:f { @x = pid == 1 && @start[tid]; delete(@start[tid]) }");
+  // Delete without a read
+  test("kprobe:f { @x = 1; delete(@start[tid]) }");
+}
+
+} // namespace take_rewriter
+} // namespace test
+} // namespace bpftrace